@@ -21,6 +21,11 @@ using namespace std; //used to eliminate deprecated header file error message
 #include "TMath.h"
 #include "TDirectory.h"
 #include <fstream>
+#include "helios_unpack.h"
+#include "helios_scaler.h"
+#include "helios_hist.h"
+#include "helios_shm.h"
+#include "helios_window.h"
 
 #define NSCALERS 12
 
@@ -28,54 +33,103 @@ using namespace std; //used to eliminate deprecated header file error message
 
 Float_t totals[NSCALERS];
 Int_t stopped;
+ScalerWriter Scaler; //writes scalers.dat off the sort thread, see helios_scaler.h
+Bool_t DoShm=kTRUE;  //<--------serve the spectra to viewers in shared memory, see helios_shm.h
+HShmServer Shm;
+Bool_t DoDouble=kTRUE; //<--------double-buffer the spectra: hsnapshot() and hreset() from the session
+Double_t SnapPeriod=1; //<--------seconds between snapshots
+Bool_t DoWindow=kTRUE; //<--------rolling-window copies of hELUM, hEDE0, hDE0_RF and hXFXN, see helios_window.h
+Int_t WindowSlots=20; //<--------intervals in a window
+Int_t WindowSyncs=1;  //<--------sync events per interval
+Int_t nsyncs;
+
+//Array Wiring: re-maps raw ADC (5x16) channels to detector (24x3) signals
+Int_t MapDet[5][16]={{ 1, 0, 5, 4, 3, 2, 1, 0, 3, 2, 1, 0, 5, 4, 3, 2},
+  		       {11,10, 9, 8, 7, 6, 5, 4, 7, 6,11,10, 9, 8, 7, 6},
+ 		       {15,14,13,12,11,10, 9, 8,17,16,15,14,13,12,17,16},
+                       {20,21,22,23,18,19,20,21,12,13,14,15,16,17,18,19},
+                       {-1,-1,-1,-1,-1,-1,-1,-1,22,23,18,19,20,21,22,23}}; //for ADC5 only channels 0-7 
+                                                                           //are used for Si signals
+
+Int_t MapSig[5][16]={{1,1,0,0,0,0,0,0,2,2,2,2,1,1,1,1}, //0->E, 1->XF, 2->XN
+                       {0,0,0,0,0,0,2,2,2,2,1,1,1,1,1,1},
+                       {0,0,0,0,2,2,2,2,1,1,1,1,1,1,0,0},
+                       {0,0,0,0,1,1,1,1,2,2,2,2,2,2,0,0},
+		       {-1,-1,-1,-1,-1,-1,-1,-1,1,1,2,2,2,2,2,2}};
+Int_t MapSlot[NADC*NCHAN]; //flat (adc,chan)->Data slot table, built by buildmap() in userentry()
 
 // Declaration of Histograms
 
 /* 1-D histograms: */
 //TH1 *hE[24];
-TH1 *hELUM[6];
+H1I *hELUM[6];
 
 /* 2-D histograms */
-TH2F *hADC[6];
-TH2F *hTDC;
-TH2F *hXFXN[24];
-TH2F *hRDT[4];
-TH2F *hEDE0;
-TH2F *hDE0_RF;
-TH2F *hELUM_RF[6];
-
-/* function to count the number of set bits in a 16 bit word */
-Int_t cntbit(Int_t word)
+H2I *hADC[7];
+H2I *hTDC;
+H2I *hXFXN[24];
+H2I *hRDT[4];
+H2I *hEDE0;
+H2I *hDE0_RF;
+H2I *hELUM_RF[6];
+
+/* rolling windows, the last WindowSlots*WindowSyncs sync intervals */
+HWindow *wELUM[6];
+HWindow *wXFXN[24];
+HWindow *wEDE0;
+HWindow *wDE0_RF;
+
+/* Books the rolling windows, at a quarter of the spectra's binning so that the
+ * WindowSlots slots of each stay small.
+ */
+void bookwindows()
 {
-  Int_t nbits=0;
-  for (Int_t ibit=0; ibit<16; ibit++) {
-    if (word & (Int_t) TMath::Power(2,ibit)) {nbits++;}
+  nsyncs=0;
+  TString last=" last ";
+  last+=WindowSlots*WindowSyncs;
+  last+=" syncs";
+  wEDE0=hwbook2("hEDE0w","hEDE0"+last,128,0,4096,128,0,4096,WindowSlots);
+  wDE0_RF=hwbook2("hDE0_RFw","hDE0_RF"+last,128,0,4096,128,0,4096,WindowSlots);
+  for(int a=0;a<24;++a){
+    TString name="hXFXNw";
+    TString title="XF vs. XN detector ";
+    name+=(a+1);
+    title+=(a+1);
+    wXFXN[a]=hwbook2(name,title+last,128,0,4096,128,0,4096,WindowSlots);
+  }
+  for(int a=0;a<6;++a){
+    TString name="hELUMw";
+    TString title="raw ELUM";
+    name+=(a+1);
+    title+=(a+1);
+    wELUM[a]=hwbook1(name,title+last,256,0,4096,WindowSlots);
   }
-  return nbits;
 }
 
 /* The userentry() function:  
  */
 int userentry()
 {
+  buildmap(MapDet,MapSig,MapSlot); //flatten the array re-map matrices once per sort
 /* stopped flag for Elliot's scaler program */
   for (Int_t i=0; i<NSCALERS; i++) totals[i]=0;
   stopped = 1; 
+  scopen(Scaler,NSCALERS,totals);
 
  //Open ROOT file
   //f = new TFile("H007_online.root", "recreate");
  // 1d - 2d histograms
- hTDC=new TH2F("hTDC","hTDC",512,0,4096,17,0,17);
+ hTDC=hbook2i("hTDC","hTDC",512,0,4096,17,0,17);
  //E0 DE0
- hEDE0=new TH2F("hEDE0","hEDE0",512,0,4096,512,0,4096);
- hDE0_RF=new TH2F("hDE0_RF","hDE0_RF",512,0,4096,512,0,4096);
+ hEDE0=hbook2i("hEDE0","hEDE0",512,0,4096,512,0,4096);
+ hDE0_RF=hbook2i("hDE0_RF","hDE0_RF",512,0,4096,512,0,4096);
 
  for(int a=0;a<7;++a){
    TString name="hADC";
    TString title="raw ADC";
    name+=(a+1);
    title+=(a+1);
-   hADC[a]=new TH2F(name,title,1024,0,4096,17,0,17);
+   hADC[a]=hbook2i(name,title,1024,0,4096,17,0,17);
  }
  
  for(int a=0;a<24;++a){
@@ -83,7 +137,7 @@ int userentry()
    TString title="XF vs. XN detector ";
    name+=(a+1);
    title+=(a+1);
-   hXFXN[a]=new TH2F(name,title,512,0,4096,512,0,4096);
+   hXFXN[a]=hbook2i(name,title,512,0,4096,512,0,4096);
  
 
    //   TString nameE="hE";
@@ -98,7 +152,7 @@ for(int a=0;a<4;++a){
    TString title="raw RDT";
    name+=(a+1);
    title+=(a+1);
-   hRDT[a]=new TH2F(name,title,512,0,4096,512,0,4096);
+   hRDT[a]=hbook2i(name,title,512,0,4096,512,0,4096);
  }
  
  for(int a=0;a<6;++a){
@@ -106,14 +160,18 @@ for(int a=0;a<4;++a){
    TString title="raw ELUM";
    name+=(a+1);
    title+=(a+1);
-   hELUM[a]=new TH1F(name,title,1024,0,4096);
+   hELUM[a]=hbook1i(name,title,1024,0,4096);
 
    TString name1="hELUM_RF";
    TString title1="raw ELUM_RF";
    name1+=(a+1);
    title1+=(a+1);
-   hELUM_RF[a]=new TH2F(name1,title1,512,0,4096,512,0,4096);
+   hELUM_RF[a]=hbook2i(name1,title1,512,0,4096,512,0,4096);
  }
+ hmaster=hlist;
+ if(DoWindow) bookwindows();
+ if(DoDouble) hdoublebuffer();
+ if(DoShm) hshmserve(Shm,"/helios_H007",SnapPeriod);
  
  return 0;
 }
@@ -121,37 +179,8 @@ for(int a=0;a<4;++a){
 /* function to deal with scalers, adapted from Elliot's program */
 void scalers(ScarletEvnt &e)
 {
-    /* Adapted from Kanter's scaler program
-     */
-    unsigned int *p = reinterpret_cast<unsigned int*>(e.body());
-    unsigned int ttotal, tdiff, ithscaler, ithrate;
-    FILE *sf;
-
-    /* On the first sync event after a stop, the following tests for the
-     * existence of a file called scalers.zap.  If it exists, the scaler
-     * totals are reset.
-     */
-    if (stopped) {
-        struct stat st;
-        stopped = 0;
-        if (stat("scalers.zap", &st) == 0) {
-            for (int i = 0; i < NSCALERS; ++i) totals[i] = 0.0;
-        }
-    }
-
-
-    if ((sf = fopen("scalers.dat", "w")) == 0) return;
-    ttotal = *p++;
-    tdiff = *p++;
-    fprintf(sf, "%u %u\n", ttotal, tdiff);
-    for (int i = 0; i < NSCALERS; ++i) {
-        ithscaler = *p++ & 0x00ffffff;
-        totals[i] += ithscaler;
-
-        ithrate = tdiff != 0 ? ithscaler/tdiff : 0;
-        fprintf(sf, "%.0f %u\n", totals[i], ithrate);
-    }
-    fclose(sf);
+  scpush(Scaler,reinterpret_cast<unsigned int*>(e.body()),stopped); //totals, zap check and file by the writer thread
+  stopped=0;
 }
 
 
@@ -167,25 +196,10 @@ int userdecode(ScarletEvnt &event) {
     into a raw array scheme (5x16) and then mapped to an array scheme (24x3).  
   */
 
-  Int_t nhits[5]={0,0,0,0,0};
-  Int_t Chan[5][16];
-  Int_t RawData[5][16];
-  Int_t Data[24][3];
+  Int_t Data[NDET+1][NSIG]; //row NDET is scratch for unmapped channels
   Int_t RawAux[16];
   Int_t RawTDC[16];
 
-  Int_t MapDet[5][16]={{ 1, 0, 5, 4, 3, 2, 1, 0, 3, 2, 1, 0, 5, 4, 3, 2},
-  		       {11,10, 9, 8, 7, 6, 5, 4, 7, 6,11,10, 9, 8, 7, 6},
- 		       {15,14,13,12,11,10, 9, 8,17,16,15,14,13,12,17,16},
-                       {20,21,22,23,18,19,20,21,12,13,14,15,16,17,18,19},
-                       {-1,-1,-1,-1,-1,-1,-1,-1,22,23,18,19,20,21,22,23}}; //for ADC5 only channels 0-7 
-                                                                           //are used for Si signals
-
-  Int_t MapSig[5][16]={{1,1,0,0,0,0,0,0,2,2,2,2,1,1,1,1}, //0->E, 1->XF, 2->XN
-                       {0,0,0,0,0,0,2,2,2,2,1,1,1,1,1,1},
-                       {0,0,0,0,2,2,2,2,1,1,1,1,1,1,0,0},
-                       {0,0,0,0,1,1,1,1,2,2,2,2,2,2,0,0},
-		       {-1,-1,-1,-1,-1,-1,-1,-1,1,1,2,2,2,2,2,2}};
 
   for(Int_t ii=0; ii<24; ii++)
     {
@@ -238,6 +252,7 @@ int userdecode(ScarletEvnt &event) {
  // Fill Aux histograms
   for(int i=0;i<6;i++) {
     hELUM[i]->Fill(RawAux[i+2]); 
+    if(DoWindow) wELUM[i]->Fill(RawAux[i+2]);
     if(RawAux[i+3]>0){
       hELUM_RF[i]->Fill(RawAux[i+3],RawTDC[1]);
     }
@@ -251,39 +266,28 @@ int userdecode(ScarletEvnt &event) {
  // Fill raw e0 de0  
  hEDE0->Fill(RawAux[0],RawAux[1]);
  hDE0_RF->Fill(RawAux[0],RawTDC[0]);
+ if(DoWindow){
+   wEDE0->Fill(RawAux[0],RawAux[1]);
+   wDE0_RF->Fill(RawAux[0],RawTDC[0]);
+ }
  
   // Read in ARRAY
-  for(Int_t nadc=0;nadc<5;++nadc){ //loop over ADCs 1-5    
-    dataword=*p1++;
-    nhits[nadc]=cntbit(dataword); //determines number of hits in ADC by counting set bits (ones) in hit register
-    for(Int_t i=0;i<nhits[nadc];++i){ //loop over ADC hits, if any
-      dataword=*p1++;
-      Chan[nadc][i]=((dataword & 0x0000f000)>>12);
-      RawData[nadc][i]=(dataword & 0x00000fff);
-      hADC[nadc]->Fill(RawData[nadc][i],Chan[nadc][i]);
-      if(nadc>-1&&nadc<5&&i>-1&&i<16){ // Tests for sensible ADC and Channel numbers
-	if((MapDet[nadc][Chan[nadc][i]])>-1&&(MapDet[nadc][Chan[nadc][i]])<24&&
-	   (MapSig[nadc][Chan[nadc][i]])>-1&&(MapSig[nadc][Chan[nadc][i]])<3){ //Tests for sensible values in 
-	                                                      
-                 //remap matrices.  Note -1 is excluded.
-	  Data[MapDet[nadc][Chan[nadc][i]]][MapSig[nadc][Chan[nadc][i]]]=RawData[nadc][i]; //Remaps RawData array
-	  
-	}
-      }
-    }
-  }
+  p1=unpackarray(p1,MapSlot,hADC,Data); //hit pattern and data words for each of ADCs 1-5
 
 
   /****Done unpacking event, filling raw histograms, and remapping data.*****/      
      
   //Filling histograms with (24x3) detector mapping  
-  Float_t e=0,xf=0,xn=0;
+  Int_t e=0,xf=0,xn=0;
                        
   for(Int_t i=0;i<24;++i){
     e=Data[i][0];
     xf=Data[i][1];
     xn=Data[i][2];
-    if (xn>0 && xf>0) hXFXN[i]->Fill(xn,xf);
+    if (xn>0 && xf>0){
+      hXFXN[i]->Fill(xn,xf);
+      if(DoWindow) wXFXN[i]->Fill(xn,xf);
+    }
     //  if (xn>0 && xf>0 && e>0) hE[i]->Fill(e);
 
   }       
@@ -298,6 +302,7 @@ int userfunc(const struct ScarletEvntHdr* h)
     ScarletEvnt event, subevent;
     event = h;
  
+  hbegin(); //the banks are flipped only between events
   switch (event.eventtype()) {
 
   case SE_TYPE_TRIGGERED:
@@ -307,13 +312,16 @@ int userfunc(const struct ScarletEvntHdr* h)
   case SE_TYPE_SYNC:
     subevent=event[1];
     scalers(subevent);
+    if(DoWindow&&++nsyncs%WindowSyncs==0) hwindowtick(); //the windows move on an interval
     break;
 
   case SE_TYPE_STOP: 
     stopped=1;
     printf("received stop signal.\n");
+    unpackreport(); //channel-field cross-check from unpackarray()
     break;
   }
+  hend();
     return 0;
 }
 
@@ -326,6 +334,11 @@ int userfunc(const struct ScarletEvntHdr* h)
  */
 int userexit()
 {
+  scclose(Scaler);
+  hshmclose(Shm);
+  hsnapshot(); //the last events, when not served
+  hwindowfree(); //the windows stay as they were at the stop
+  hfree(); //the booking records; the histograms stay in the session, by name
   //    f->Write();
   //  f->Close();
   //    delete f;
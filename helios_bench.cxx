@@ -0,0 +1,318 @@
+/* Program: helios_bench.cxx
+ * Purpose:
+ *       Throughput benchmark of a sort without daphne or beam.  Synthetic SCARLET
+ *       events are made in memory and handed to the sort's userentry()/userfunc()/
+ *       userexit() as daphne would, on one thread, and the rate is reported: events
+ *       per second, nanoseconds per array hit, and the peak resident memory.  Built
+ *       against each sort in turn, it catches a slowdown in helios_sort_Si28.cxx or
+ *       its siblings before a run does.
+ *
+ *       A triggered event's body is laid out as the sorts read it: the TAC word,
+ *       then for each of ADCs 1-5 the hit pattern and a data word per channel that
+ *       fired, in ascending channel order (channel in bits 12-15, value in 0-11),
+ *       then 0x0000dead.  A detector that fires sets its E, XF and XN channels, found
+ *       through the sort's own MapDet/MapSig, with XF+XN a little below E as on a
+ *       real strip.  Each event fires mult detectors chosen from the first ndet, so
+ *       ndet sets the array occupancy.  A sync event, the time words and NSCALERS
+ *       counts, is sent after every nsync triggered events, and a stop at the end,
+ *       which prints the sort's own totals.
+ *
+ *       The events are made before the clock starts, a pool of POOLEVENTS that is
+ *       gone round as often as needed, so only the sort is timed.  Peak RSS is the
+ *       process's, the pool included.  With -o the same stream is also written, before
+ *       the clock starts, as an event file to time helios_offline_sort on.
+ *
+ *       Only the length word leading each record is fixed by helios_evfile.h; the
+ *       rest of the SCARLET header is as benchrecord() lays it out.  Every record made
+ *       is read back through ScarletEvnt before the clock starts: its type, and the
+ *       place, length and words of the body event[1] gives, must be those written, or
+ *       the benchmark stops rather than time records the sort misreads.
+ *
+ * Build:
+ *       g++ -O2 -o helios_bench_Si28 helios_bench.cxx helios_sort_Si28.cxx \
+ *           `root-config --cflags --libs` -lScarletEvnt -lpthread
+ *       (add -lrt for H007_online_sort.cxx, and -DHELIOS_PROF to see the sort's stages)
+ *
+ * Usage:
+ *       helios_bench_Si28 [-n events] [-m mult] [-d ndet] [-s nsync] [-w words] [-r seed]
+ *                         [-o run.evt]
+ *           -n triggered events sorted (1000000)
+ *           -m detectors fired per event (2)
+ *           -d detectors that fire at all, 1-24 (24)
+ *           -s triggered events per sync event, 0 for none (10000)
+ *           -w words before ADC1's hit pattern (1, the TAC; 22 for H007: 16 aux and 6 TDC)
+ *           -r seed of the generator (1)
+ */
+
+// Header Files
+using namespace std;
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "daphuserfunc.h"
+#include "ScarletEvnt.h"
+#include "TRandom.h"
+#include "helios_unpack.h"
+
+#define POOLEVENTS 65536 //distinct triggered events made
+#define MAXWORDS   128   //body words of an event, at most
+#define MAXSCALERS 18    //counts in a sync event; a sort reads its NSCALERS of them
+#define DEADWORD   0x0000dead
+
+extern Int_t MapDet[NADC][NCHAN]; //the wiring of the sort linked in
+extern Int_t MapSig[NADC][NCHAN];
+
+struct BenchHdr {  //event header: its length in bytes, type, and subevents
+  UInt_t len;
+  UInt_t type;
+  UInt_t nsub;
+  UInt_t serial;
+};
+
+struct BenchSub {  //subevent header: its length in bytes, body included, and id
+  UInt_t len;
+  UInt_t id;
+};
+
+Int_t nEvents=1000000;
+Int_t nMult=2;
+Int_t nDet=24;
+Int_t nSync=10000;
+Int_t nWords=1;
+UInt_t Seed=1;
+Int_t AdcChan[NDET][NSIG]; //adc*NCHAN+chan of each detector signal, -1 if not wired
+
+Double_t secnow()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec+1e-9*ts.tv_nsec;
+}
+
+/* Lays out a record of the given type with one body, as subevent 1 after an empty
+ * subevent 0 (the sorts read event[1]).  Returns its length in bytes.
+ */
+UInt_t benchrecord(char *rec,Int_t type,UInt_t serial,const Int_t *body,Int_t nwords)
+{
+  BenchHdr h={0,(UInt_t)type,2,serial};
+  BenchSub s0={sizeof(BenchSub),0};
+  BenchSub s1={(UInt_t)(sizeof(BenchSub)+nwords*sizeof(Int_t)),1};
+  h.len=sizeof(h)+s0.len+s1.len;
+  char *p=rec;
+  memcpy(p,&h,sizeof(h));
+  p+=sizeof(h);
+  memcpy(p,&s0,sizeof(s0));
+  p+=sizeof(s0);
+  memcpy(p,&s1,sizeof(s1));
+  p+=sizeof(s1);
+  memcpy(p,body,nwords*sizeof(Int_t));
+  return h.len;
+}
+
+/* Reads a record back as the sorts do.  Returns 0 if ScarletEvnt finds in it the type
+ * and body it was made with, after saying what it found otherwise.
+ */
+Int_t benchcheck(const char *rec,Int_t type,const Int_t *body,Int_t nwords)
+{
+  ScarletEvnt event,subevent;
+  event=reinterpret_cast<const ScarletEvntHdr*>(rec);
+  if(event.eventtype()!=type){
+    printf("ScarletEvnt reads type %d from a record made as type %d\n",event.eventtype(),type);
+    return 1;
+  }
+  subevent=event[1];
+  const char *p=reinterpret_cast<const char*>(subevent.body());
+  const char *at=rec+sizeof(BenchHdr)+2*sizeof(BenchSub);
+  if(p!=at){
+    printf("ScarletEvnt finds the body of event[1] %ld bytes from where it was written\n",(long)(p-at));
+    return 1;
+  }
+  if(*(const UInt_t*)rec!=(at-rec)+nwords*sizeof(Int_t)||memcmp(p,body,nwords*sizeof(Int_t))){
+    printf("ScarletEvnt reads another body from a record of %d words\n",nwords);
+    return 1;
+  }
+  return 0;
+}
+
+/* Inverts the sort's wiring: where each detector's E, XF and XN are read from */
+void buildchannels()
+{
+  for(Int_t i=0;i<NDET;i++)
+    for(Int_t s=0;s<NSIG;s++) AdcChan[i][s]=-1;
+  for(Int_t a=0;a<NADC;a++)
+    for(Int_t c=0;c<NCHAN;c++){
+      Int_t i=MapDet[a][c],s=MapSig[a][c];
+      if(i>-1&&i<NDET&&s>-1&&s<NSIG&&AdcChan[i][s]<0) AdcChan[i][s]=a*NCHAN+c;
+    }
+}
+
+/* Makes the body of one triggered event with mult of the first ndet detectors fired.
+ * Returns its number of words; *nhits is the detectors fired.
+ */
+Int_t benchevent(TRandom &r,Int_t *body,Int_t *nhits)
+{
+  Int_t raw[NADC*NCHAN];
+  memset(raw,0,sizeof(raw));
+  Int_t fired=0;
+  UInt_t used=0;
+  Int_t mult=nMult<nDet ? nMult : nDet;
+  while(fired<mult){
+    Int_t i=r.Integer(nDet);
+    if(used&(1u<<i)) continue;
+    used|=1u<<i;
+    fired++;
+    Double_t e=r.Uniform(400,3800);
+    Double_t x=r.Uniform(0.05,0.95);
+    Double_t sum=e*r.Uniform(0.90,0.98); //XF+XN a little below E
+    Int_t v[NSIG]={(Int_t)e,(Int_t)(sum*x),(Int_t)(sum*(1-x))};
+    for(Int_t s=0;s<NSIG;s++)
+      if(AdcChan[i][s]>=0) raw[AdcChan[i][s]]=v[s]>0 ? v[s] : 1;
+  }
+  Int_t n=0;
+  for(Int_t k=0;k<nWords;k++) body[n++]=r.Integer(2000)+1000; //TAC, or the aux and TDC words
+  for(Int_t a=0;a<NADC;a++){
+    Int_t *pattern=&body[n++];
+    *pattern=0;
+    for(Int_t c=0;c<NCHAN;c++){
+      if(!raw[a*NCHAN+c]) continue;
+      *pattern|=1<<c;
+      body[n++]=(c<<12)|(raw[a*NCHAN+c]&0x0fff);
+    }
+  }
+  body[n++]=DEADWORD;
+  *nhits=fired;
+  return n;
+}
+
+/* Makes the body of a sync event: total time, time difference, then the counts */
+Int_t benchsync(TRandom &r,Int_t *body,UInt_t &ttotal)
+{
+  Int_t n=0;
+  UInt_t tdiff=100;
+  ttotal+=tdiff;
+  body[n++]=ttotal;
+  body[n++]=tdiff;
+  for(Int_t i=0;i<MAXSCALERS;i++) body[n++]=r.Integer(100000);
+  return n;
+}
+
+/* Writes the stream the benchmark sorts to an event file, before the clock starts */
+void benchwrite(const char *name,TRandom &r,const ScarletEvntHdr **events,char *sync,
+		const char *stop)
+{
+  FILE *fp=fopen(name,"wb");
+  if(!fp){
+    printf("Cannot create \"%s\"; not written\n",name);
+    return;
+  }
+  Int_t body[MAXWORDS];
+  UInt_t ttotal=0;
+  for(Int_t k=0;k<nEvents;k++){
+    if(nSync>0&&k%nSync==0){
+      Int_t n=benchsync(r,body,ttotal);
+      fwrite(sync,benchrecord(sync,SE_TYPE_SYNC,k,body,n),1,fp);
+    }
+    const ScarletEvntHdr *h=events[k%POOLEVENTS];
+    fwrite(h,*(const UInt_t*)h,1,fp);
+  }
+  fwrite(stop,*(const UInt_t*)stop,1,fp);
+  printf("Events written to %s: %.1f MB\n",name,ftell(fp)/1e6);
+  fclose(fp);
+}
+
+int main(int argc,char **argv)
+{
+  Int_t opt;
+  const char *out=0;
+  while((opt=getopt(argc,argv,"n:m:d:s:w:r:o:"))!=-1){
+    if(opt=='n') nEvents=atoi(optarg);
+    else if(opt=='m') nMult=atoi(optarg);
+    else if(opt=='d') nDet=atoi(optarg);
+    else if(opt=='s') nSync=atoi(optarg);
+    else if(opt=='w') nWords=atoi(optarg);
+    else if(opt=='r') Seed=atoi(optarg);
+    else if(opt=='o') out=optarg;
+    else{
+      printf("Usage: %s [-n events] [-m mult] [-d ndet] [-s nsync] [-w words] [-r seed] [-o run.evt]\n",argv[0]);
+      return 1;
+    }
+  }
+  if(nDet<1||nDet>NDET) nDet=NDET;
+  if(nMult<0) nMult=0;
+  if(nWords<0||nWords>MAXWORDS-NADC*(NCHAN+1)-1) nWords=1;
+
+  //The pool: triggered events back to back, then one sync and one stop record
+  buildchannels();
+  TRandom r(Seed);
+  const size_t reclen=sizeof(BenchHdr)+2*sizeof(BenchSub)+MAXWORDS*sizeof(Int_t);
+  char *pool=(char*)malloc(POOLEVENTS*reclen);
+  const ScarletEvntHdr **events=new const ScarletEvntHdr*[POOLEVENTS];
+  Int_t *hits=new Int_t[POOLEVENTS];
+  Int_t body[MAXWORDS];
+  size_t used=0;
+  Int_t bad=0;
+  for(Int_t k=0;k<POOLEVENTS&&!bad;k++){
+    Int_t n=benchevent(r,body,&hits[k]);
+    events[k]=reinterpret_cast<const ScarletEvntHdr*>(pool+used);
+    UInt_t len=benchrecord(pool+used,SE_TYPE_TRIGGERED,k,body,n);
+    bad=benchcheck(pool+used,SE_TYPE_TRIGGERED,body,n);
+    used+=(len+7)&~7; //records stay 8-byte aligned
+  }
+  char *sync=(char*)malloc(reclen);
+  char *stop=(char*)malloc(reclen);
+  UInt_t ttotal=0;
+  benchrecord(stop,SE_TYPE_STOP,0,body,0);
+  if(!bad) bad=benchcheck(stop,SE_TYPE_STOP,body,0);
+  if(!bad){
+    TRandom c(Seed); //not r, whose events are timed
+    UInt_t t=0;
+    Int_t n=benchsync(c,body,t);
+    benchrecord(sync,SE_TYPE_SYNC,0,body,n);
+    bad=benchcheck(sync,SE_TYPE_SYNC,body,n);
+  }
+  if(bad){
+    printf("The records made here are not laid out as libScarletEvnt reads them: change\n"
+	   "BenchHdr, BenchSub and benchrecord() to its ScarletEvntHdr.  Nothing sorted.\n");
+    return 1;
+  }
+  if(out) benchwrite(out,r,events,sync,stop);
+
+  if(userentry()){
+    printf("userentry() failed.  Nothing sorted.\n");
+    return 1;
+  }
+  printf("Sorting %d events: %d of %d detectors fired per event, a sync every %d\n",
+	 nEvents,nMult<nDet ? nMult : nDet,nDet,nSync);
+
+  Long64_t nhits=0,nsyncs=0;
+  Double_t t0=secnow();
+  for(Int_t k=0;k<nEvents;k++){
+    if(nSync>0&&k%nSync==0){
+      Int_t n=benchsync(r,body,ttotal); //once per nsync events, so cheap beside the sort
+      benchrecord(sync,SE_TYPE_SYNC,k,body,n);
+      userfunc(reinterpret_cast<const ScarletEvntHdr*>(sync));
+      nsyncs++;
+    }
+    Int_t e=k%POOLEVENTS;
+    userfunc(events[e]);
+    nhits+=hits[e];
+  }
+  Double_t t=secnow()-t0;
+  userfunc(reinterpret_cast<const ScarletEvntHdr*>(stop));
+  userexit();
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF,&ru);
+  printf("%d events (%lld sync), %lld hits in %.3f s: %.0f events/s, %.1f ns/event, %.1f ns/hit\n",
+	 nEvents,nsyncs,nhits,t,nEvents/t,1e9*t/nEvents,nhits ? 1e9*t/nhits : 0.);
+  printf("Peak RSS: %.1f MB\n",ru.ru_maxrss/1024.);
+  free(pool);
+  free(sync);
+  free(stop);
+  delete[] events;
+  delete[] hits;
+  return 0;
+}
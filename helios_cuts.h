@@ -0,0 +1,219 @@
+/* Program: helios_cuts.h
+ * Purpose:
+ *       Graphical cuts for the HELIOS sort programs, resolved by name once per
+ *       sort instead of on every hit.  A Gate holds a copy of the TCutG's
+ *       vertices, interleaved (x0,y0,x1,y1,...) so the polygon test walks one
+ *       array, and the bounding box of the polygon, which rejects most points
+ *       before any edge is looked at.  The inside test is the crossing-number
+ *       rule of TMath::IsInside(), so a Gate passes exactly the points the
+ *       TCutG passes.
+ *
+ * Usage:
+ *       Gate gEZ;                                //file scope
+ *       gateresolve(gEZ,"cEZ");                  //in userentry(), after the cuts are loaded
+ *       if(gateinside(gEZ,z,e)) goodEZ=kTRUE;    //per hit
+ *
+ *       A cut that cannot be found is reported when it is resolved and the Gate
+ *       then never passes, as checkcutg() did for a missing cut.
+ *
+ *       gateraster(gEZ,512,minZ,maxZ,512,0,maxE); //optional, with the gated histogram's binning
+ *
+ *       rasterises the polygon onto a grid of cells.  Each cell is marked inside,
+ *       outside or edge; a point in an inside or outside cell is decided by one
+ *       read, and only points in edge cells (or off the grid) run the polygon
+ *       test.  A cell is marked edge if any side of the polygon passes within
+ *       GATE_MARGIN of a cell width of it, so the rounding of the cell index can
+ *       never put a point in a cell whose mark disagrees with the exact test.
+ */
+#ifndef HELIOS_CUTS_H
+#define HELIOS_CUTS_H
+
+#include "TROOT.h"
+#include "TCutG.h"
+
+#define GATE_OUT    0
+#define GATE_IN     1
+#define GATE_EDGE   2
+#define GATE_MARGIN 0.01 //fraction of a cell by which an edge cell reaches into its neighbours
+
+struct Gate {
+  char name[32];
+  Int_t n;                        //vertices; 0 when the cut was not found
+  Double_t xmin,xmax,ymin,ymax;   //bounding box
+  Double_t *xy;                   //vertices, x and y interleaved
+  UChar_t *grid;                  //cell marks from gateraster(), 0 if not rasterised
+  Int_t gnx,gny;                  //grid cells
+  Double_t gx0,gy0;               //low edge of the grid
+  Double_t gdx,gdy;               //cell size
+  Double_t gxinv,gyinv;           //cells per unit
+};
+
+/* Copies n polygon vertices into g and sets its bounding box */
+inline void gatesetpoints(Gate &g,const char *name,Int_t n,const Double_t *x,const Double_t *y)
+{
+  strncpy(g.name,name,sizeof(g.name)-1);
+  g.name[sizeof(g.name)-1]=0;
+  g.n=n;
+  g.grid=0;
+  g.xy=new Double_t[2*n];
+  g.xmin=g.xmax=x[0];
+  g.ymin=g.ymax=y[0];
+  for(Int_t i=0;i<n;i++){
+    g.xy[2*i]=x[i];
+    g.xy[2*i+1]=y[i];
+    if(x[i]<g.xmin) g.xmin=x[i];
+    if(x[i]>g.xmax) g.xmax=x[i];
+    if(y[i]<g.ymin) g.ymin=y[i];
+    if(y[i]>g.ymax) g.ymax=y[i];
+  }
+}
+
+/* Finds the TCutG called name and copies it into g.  Returns 0 if found. */
+inline Int_t gateresolve(Gate &g,const char *name)
+{
+  strncpy(g.name,name,sizeof(g.name)-1);
+  g.name[sizeof(g.name)-1]=0;
+  g.n=0;
+  g.xy=0;
+  g.grid=0;
+  TCutG *cut=(TCutG *) gROOT->GetListOfSpecials()->FindObject(name);
+  if(!cut){
+    TObject *obj=gROOT->FindObject(name);
+    if(obj&&obj->InheritsFrom("TCutG")) cut=(TCutG *) obj;
+  }
+  if(!cut||cut->GetN()<1){
+    printf("Cut \"%s\" not found.  Its gate will not pass any events.\n",name);
+    return 1;
+  }
+  gatesetpoints(g,name,cut->GetN(),cut->GetX(),cut->GetY());
+  printf("Cut \"%s\": %d points, %g<x<%g, %g<y<%g\n",name,g.n,g.xmin,g.xmax,g.ymin,g.ymax);
+  return 0;
+}
+
+/* The crossing-number test of TMath::IsInside() on the gate's polygon */
+inline Bool_t gatepolygon(const Gate &g,Double_t x,Double_t y)
+{
+  const Double_t *p=g.xy;
+  const Double_t *q=g.xy+2*(g.n-1); //previous vertex, closing the polygon
+  Bool_t inside=kFALSE;
+  for(Int_t i=0;i<g.n;i++,q=p,p+=2){
+    Double_t yi=p[1],yj=q[1];
+    if((yi<y&&yj>=y)||(yj<y&&yi>=y)){
+      if(p[0]+(y-yi)/(yj-yi)*(q[0]-p[0])<x) inside=!inside;
+    }
+  }
+  return inside;
+}
+
+/* Returns kTRUE if (x,y) is inside the gate's polygon */
+inline Bool_t gateinside(const Gate &g,Double_t x,Double_t y)
+{
+  if(!(x>=g.xmin&&x<=g.xmax&&y>=g.ymin&&y<=g.ymax)) return kFALSE; //also rejects a missing cut and NaN
+  if(g.grid){
+    Double_t u=(x-g.gx0)*g.gxinv;
+    Double_t v=(y-g.gy0)*g.gyinv;
+    if(u>=0&&u<g.gnx&&v>=0&&v<g.gny){
+      UChar_t mark=g.grid[(Int_t)v*g.gnx+(Int_t)u];
+      if(mark!=GATE_EDGE) return mark;
+    }
+  }
+  return gatepolygon(g,x,y);
+}
+
+/* Does the segment (ax,ay)-(bx,by) touch the rectangle [x0,x1]x[y0,y1]?  Liang-Barsky clip. */
+inline Bool_t gatecrosses(Double_t ax,Double_t ay,Double_t bx,Double_t by,
+			  Double_t x0,Double_t x1,Double_t y0,Double_t y1)
+{
+  Double_t t0=0,t1=1;
+  Double_t d[2]={bx-ax,by-ay};
+  Double_t lo[2]={x0-ax,y0-ay};
+  Double_t hi[2]={x1-ax,y1-ay};
+  for(Int_t k=0;k<2;k++){
+    if(d[k]==0){
+      if(lo[k]>0||hi[k]<0) return kFALSE;
+      continue;
+    }
+    Double_t ta=lo[k]/d[k],tb=hi[k]/d[k];
+    if(ta>tb){Double_t tmp=ta;ta=tb;tb=tmp;}
+    if(ta>t0) t0=ta;
+    if(tb<t1) t1=tb;
+    if(t0>t1) return kFALSE;
+  }
+  return kTRUE;
+}
+
+/* Rasterises the gate onto the bins of a histogram axis pair (nx bins over x0..x1,
+ * ny over y0..y1), keeping only the bins that overlap the polygon's bounding box.
+ * Returns the number of edge cells.
+ */
+inline Int_t gateraster(Gate &g,Int_t nx,Double_t x0,Double_t x1,Int_t ny,Double_t y0,Double_t y1)
+{
+  if(!g.n||nx<1||ny<1||x1<=x0||y1<=y0) return 0;
+  Double_t dx=(x1-x0)/nx,dy=(y1-y0)/ny;
+  //grid limited to the bins covering the bounding box
+  Int_t bx0=(Int_t)floor((g.xmin-x0)/dx),bx1=(Int_t)floor((g.xmax-x0)/dx)+1;
+  Int_t by0=(Int_t)floor((g.ymin-y0)/dy),by1=(Int_t)floor((g.ymax-y0)/dy)+1;
+  if(bx0<0) bx0=0;
+  if(by0<0) by0=0;
+  if(bx1>nx) bx1=nx;
+  if(by1>ny) by1=ny;
+  if(bx1<=bx0||by1<=by0) return 0;
+  delete[] g.grid;
+  g.gnx=bx1-bx0;
+  g.gny=by1-by0;
+  g.gdx=dx;
+  g.gdy=dy;
+  g.gx0=x0+bx0*dx;
+  g.gy0=y0+by0*dy;
+  g.gxinv=1/dx;
+  g.gyinv=1/dy;
+  g.grid=new UChar_t[g.gnx*g.gny];
+  memset(g.grid,GATE_OUT,g.gnx*g.gny);
+
+  //edge cells: every cell a side of the polygon comes within the margin of
+  Double_t mx=GATE_MARGIN*dx,my=GATE_MARGIN*dy;
+  Int_t nedge=0;
+  for(Int_t i=0;i<g.n;i++){
+    Int_t j=(i+g.n-1)%g.n;
+    Double_t ax=g.xy[2*i],ay=g.xy[2*i+1],bx=g.xy[2*j],by=g.xy[2*j+1];
+    Int_t cx0=(Int_t)floor(((ax<bx ? ax : bx)-mx-g.gx0)*g.gxinv);
+    Int_t cx1=(Int_t)floor(((ax>bx ? ax : bx)+mx-g.gx0)*g.gxinv);
+    Int_t cy0=(Int_t)floor(((ay<by ? ay : by)-my-g.gy0)*g.gyinv);
+    Int_t cy1=(Int_t)floor(((ay>by ? ay : by)+my-g.gy0)*g.gyinv);
+    if(cx0<0) cx0=0;
+    if(cy0<0) cy0=0;
+    if(cx1>=g.gnx) cx1=g.gnx-1;
+    if(cy1>=g.gny) cy1=g.gny-1;
+    for(Int_t cy=cy0;cy<=cy1;cy++)
+      for(Int_t cx=cx0;cx<=cx1;cx++){
+	UChar_t &mark=g.grid[cy*g.gnx+cx];
+	if(mark==GATE_EDGE) continue;
+	Double_t lx=g.gx0+cx*dx,ly=g.gy0+cy*dy;
+	if(gatecrosses(ax,ay,bx,by,lx-mx,lx+dx+mx,ly-my,ly+dy+my)){
+	  mark=GATE_EDGE;
+	  nedge++;
+	}
+      }
+  }
+
+  //the other cells: no side comes near, so a run of them along a row is all in or all
+  //out, decided by the exact test at the centre of the run's first cell
+  Int_t nin=0;
+  for(Int_t cy=0;cy<g.gny;cy++){
+    UChar_t run=GATE_EDGE;
+    for(Int_t cx=0;cx<g.gnx;cx++){
+      UChar_t &mark=g.grid[cy*g.gnx+cx];
+      if(mark==GATE_EDGE){
+	run=GATE_EDGE;
+	continue;
+      }
+      if(run==GATE_EDGE) run=gatepolygon(g,g.gx0+(cx+0.5)*dx,g.gy0+(cy+0.5)*dy) ? GATE_IN : GATE_OUT;
+      mark=run;
+      nin+=(run==GATE_IN);
+    }
+  }
+  printf("Cut \"%s\" rasterised on %dx%d cells: %d inside, %d edge\n",g.name,g.gnx,g.gny,nin,nedge);
+  return nedge;
+}
+
+#endif
@@ -0,0 +1,161 @@
+/* Program: helios_evfile.h
+ * Purpose:
+ *       Reader for recorded SCARLET event files, so a run can be replayed into a
+ *       sort's userfunc() without daphne.  A file is a sequence of event records,
+ *       each a ScarletEvntHdr followed by its subevents; the first 32-bit word of
+ *       every record is the record length in bytes, header included.
+ *
+ *       A regular file is mapped into memory whole, and evnext() returns a pointer
+ *       to the record where it lies in the mapping: nothing is copied, and the
+ *       record stays valid until evclose().  The kernel is told the mapping is
+ *       read in order (madvise MADV_SEQUENTIAL), so it reads ahead and drops the
+ *       pages behind, and a multi-GB run streams at the disk's rate.  With EVHUGE
+ *       it is also asked to back the mapping with huge pages (MADV_HUGEPAGE), which
+ *       the kernel honours for files on a filesystem that supports them, such as
+ *       tmpfs.  A file that cannot be mapped (a pipe, or with EVREAD) is read a
+ *       record at a time into a buffer, as before, and a record is then valid only
+ *       until the next evnext().
+ *
+ * Usage:
+ *       EvFile ev;
+ *       if(evopen(ev,"run123.evt")) return 1;   //or evopen(ev,name,EVHUGE)
+ *       const ScarletEvntHdr *h;
+ *       while((h=evnext(ev))) userfunc(h);
+ *       evclose(ev);
+ */
+#ifndef HELIOS_EVFILE_H
+#define HELIOS_EVFILE_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Rtypes.h"
+#include "ScarletEvnt.h"
+
+#define EVMAXLEN (1<<24) //largest record accepted, in bytes; anything longer is taken as corruption
+
+#define EVREAD 1         //evopen() flags: read the file instead of mapping it
+#define EVHUGE 2         //ask for huge pages behind the mapping
+
+struct EvFile {
+  FILE *fp;          //file being read, 0 when it is mapped
+  const char *name;
+  char *buf;         //current record, valid until the next evnext()
+  UInt_t bufsize;
+  const char *map;   //the mapped file, 0 when it is read
+  size_t mapsize;
+  size_t pos;        //offset of the next record in the mapping
+  Long64_t nevents;  //records read so far
+  Long64_t nbytes;
+};
+
+/* Length in bytes of the record starting at rec, header included */
+inline UInt_t evntlength(const void *rec)
+{
+  UInt_t len;
+  memcpy(&len,rec,sizeof(len));
+  return len;
+}
+
+/* Maps a regular file.  Returns 0 if it is mapped. */
+inline Int_t evmap(EvFile &ev,Int_t flags)
+{
+  int fd=open(ev.name,O_RDONLY);
+  if(fd<0) return 1;
+  struct stat st;
+  if(fstat(fd,&st)||!S_ISREG(st.st_mode)||st.st_size==0){
+    close(fd);
+    return 1;
+  }
+  void *p=mmap(0,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd); //the mapping keeps the file
+  if(p==MAP_FAILED) return 1;
+  madvise(p,st.st_size,MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+  if(flags&EVHUGE) madvise(p,st.st_size,MADV_HUGEPAGE);
+#endif
+  ev.map=(const char*)p;
+  ev.mapsize=st.st_size;
+  return 0;
+}
+
+inline Int_t evopen(EvFile &ev,const char *name,Int_t flags=0)
+{
+  ev.fp=0;
+  ev.name=name;
+  ev.buf=0;
+  ev.bufsize=0;
+  ev.map=0;
+  ev.mapsize=0;
+  ev.pos=0;
+  ev.nevents=0;
+  ev.nbytes=0;
+  if(!(flags&EVREAD)&&!evmap(ev,flags)) return 0;
+  ev.fp=fopen(name,"rb");
+  if(!ev.fp){
+    printf("Cannot open event file \"%s\"\n",name);
+    return 1;
+  }
+  return 0;
+}
+
+/* Steps to the next record.  Returns 0 at the end of the file, or at a record whose
+ * length word is out of range or which is cut short, after saying so.
+ */
+inline const ScarletEvntHdr *evnext(EvFile &ev)
+{
+  UInt_t len;
+  if(ev.map){
+    if(ev.mapsize-ev.pos<sizeof(len)) return 0;
+    const char *rec=ev.map+ev.pos;
+    len=evntlength(rec);
+    if(len<sizeof(len)||len>EVMAXLEN){
+      printf("%s: bad record length %u after %lld events.  Stopped.\n",ev.name,len,ev.nevents);
+      return 0;
+    }
+    if(len>ev.mapsize-ev.pos){
+      printf("%s: record %lld cut short at end of file.  Stopped.\n",ev.name,ev.nevents+1);
+      return 0;
+    }
+    ev.pos+=len;
+    ev.nevents++;
+    ev.nbytes+=len;
+    return reinterpret_cast<const ScarletEvntHdr*>(rec);
+  }
+
+  if(fread(&len,sizeof(len),1,ev.fp)!=1) return 0;
+  if(len<sizeof(len)||len>EVMAXLEN){
+    printf("%s: bad record length %u after %lld events.  Stopped.\n",ev.name,len,ev.nevents);
+    return 0;
+  }
+  if(len>ev.bufsize){
+    free(ev.buf);
+    ev.bufsize=len;
+    ev.buf=(char*)malloc(ev.bufsize);
+  }
+  memcpy(ev.buf,&len,sizeof(len));
+  if(fread(ev.buf+sizeof(len),len-sizeof(len),1,ev.fp)!=1&&len>sizeof(len)){
+    printf("%s: record %lld cut short at end of file.  Stopped.\n",ev.name,ev.nevents+1);
+    return 0;
+  }
+  ev.nevents++;
+  ev.nbytes+=len;
+  return reinterpret_cast<const ScarletEvntHdr*>(ev.buf);
+}
+
+inline void evclose(EvFile &ev)
+{
+  if(ev.fp) fclose(ev.fp);
+  if(ev.map) munmap((void*)ev.map,ev.mapsize);
+  free(ev.buf);
+  ev.fp=0;
+  ev.map=0;
+  ev.buf=0;
+  ev.bufsize=0;
+}
+
+#endif
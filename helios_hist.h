@@ -0,0 +1,987 @@
+/* Program: helios_hist.h
+ * Purpose:
+ *       Histogram booking layer for the HELIOS sort programs.  hbook1()/hbook2()
+ *       record a booking (name, title, binning and the current directory) in
+ *       the booking thread's hlist, in booking order, but do not create the
+ *       TH1F/TH2F: it is created, in the directory of the booking, by the first
+ *       Fill().  A spectrum that stays empty through a run costs a booking
+ *       record and no bins; hstubs() writes an empty histogram for each of them
+ *       at userexit(), so the output file still holds every name.  From the online
+ *       session a booking is used as its histogram: GetHist(), Draw() and Fit() make
+ *       it if need be, and it converts to a TH1*; hbookall() makes every one not
+ *       filled yet, so the directory lists them all.  hfree() deletes the booking
+ *       records once the histograms are written.
+ *
+ *       hbook2s() books a sparse 2D histogram, for the gated and diagnostic
+ *       spectra that only ever fill a few of their bins.  Its bins are kept in
+ *       tiles of HTILExHTILE cells, each allocated when one of its cells is first
+ *       filled, behind a table with one pointer per tile.  The TH2F is made from
+ *       the tiles by hdensify() at userexit(), just before it is written, so the
+ *       spectrum is not in the output directory while the sort runs.
+ *
+ *       hbook1i()/hbook2i() book an integer-count histogram (a TH1I/TH2I) for the
+ *       raw spectra, which are only ever filled with whole ADC channels and unit
+ *       weights.  Its counts are exact past the 2^24 at which a float bin stops
+ *       incrementing.  On an axis whose low edge is a whole channel and whose bins
+ *       are a power of two of channels wide (see hshift()), a fill is the increment
+ *       of one count, at the bin the channel shifted right gives; any other axis is
+ *       binned as TAxis::FindBin() would.  The fill keeps no sums, so ROOT computes
+ *       the statistics of a count histogram from its bins.  Without HELIOS_THREADS
+ *       the TH1I/TH2I is made by the booking and filled in place, so it can be
+ *       watched while the sort runs; its entries are counted by the booking, and
+ *       set on the histogram by hentries(), which hdensify() and hsnapshot() call.
+ *
+ *       An online sort can instead double-buffer its count histograms
+ *       (hdoublebuffer()): each gets two banks of bins, and the sort fills one
+ *       while the other is left alone.  hsnapshot(), from another thread, flips
+ *       the bank being filled, then adds the one it froze into the TH1I/TH2I (and
+ *       the shared-memory copy, see helios_shm.h) and clears it; hreset() flips and
+ *       throws the frozen bank and the histograms' contents away.  The sort marks
+ *       each event with hbegin()/hend(), and the flip is one compare-and-swap of
+ *       the bank number made only between events, so a snapshot holds whole events
+ *       and the sort never waits: it goes straight on into the other bank.  The
+ *       histograms are then written only by the snapshots, never by the sort.
+ *
+ *       The shards of hbook1()/hbook2() and the tiles of hbook2s() bin a value
+ *       passed as an Int_t the same way on a channel-aligned axis, so a fill of
+ *       raw channels (or of a detector number on a row axis) takes a subtract,
+ *       a shift and a compare per axis instead of a floating-point division.
+ *
+ *       When a sort is built with -DHELIOS_THREADS and run by helios_offline_sort,
+ *       the histograms are booked once, by userentry(), and are never filled
+ *       directly.  Instead every sort thread (the one that ran userentry()
+ *       included) fills a private shard of each histogram: a bare array of bin
+ *       contents laid out as the histogram's own (tiled for a sparse booking),
+ *       plus the fill statistics, in memory of its own aligned and padded to whole
+ *       cache lines, so no two threads ever write to the same line.  A fill takes
+ *       no lock and makes no atomic update.  A shard's bins are allocated by its
+ *       first fill.  hmerge() adds a thread's shards into the TH1F/TH2F objects,
+ *       creating any not filled before, so the output file and the macros reading
+ *       it see ordinary histograms.
+ *
+ *       Whichever way a histogram is filled, it ends with the bins, sum of squared
+ *       weights, statistics and entries TH1::Fill() would have left.
+ *
+ * Usage:
+ *       HTLS H2F *hEX[24];                       //booking, or its shard when HELIOS_THREADS
+ *       HTLS H2S *hEX2x[24];                     //sparse booking
+ *       HTLS H2I *hADC[7];                       //integer-count booking
+ *       hEX[a]=hbook2(name,title,nx,x0,x1,ny,y0,y1);
+ *       hEX2x[a]=hbook2s(name,title,nx,x0,x1,ny,y0,y1);
+ *       hADC[a]=hbook2i(name,title,1024,0,4096,16,0,16);
+ *       hEX[a]->Fill(x,e);                       //as TH2F::Fill()
+ *       hADC[a]->Fill(raw,chan);                 //whole channels only
+ *       hmaster=hlist;                           //in userentry(), after booking
+ *       hmerge();                                //in usermerge(), and in userexit():
+ *       hdensify();                              //  before Write()
+ *       hstubs();
+ *       hfree();                                 //after the file is closed
+ */
+#ifndef HELIOS_HIST_H
+#define HELIOS_HIST_H
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include "TString.h"
+#include "TDirectory.h"
+#include "TH1.h"
+#include "TH2.h"
+
+#ifdef HELIOS_THREADS
+#define HTLS __thread //one copy per sort thread
+#else
+#define HTLS
+#endif
+
+#define HCACHELINE 64 //bytes
+#define HTILE      16 //cells along each side of a sparse histogram's tiles
+
+#define HDENSE  0 //kinds of booking: TH1F/TH2F from hbook1()/hbook2()
+#define HSPARSE 1 //tiled, from hbook2s()
+#define HCOUNT  2 //TH1I/TH2I from hbook1i()/hbook2i()
+
+/* Zeroed memory starting on a cache line and rounded up to whole lines */
+inline void *halloc(size_t size)
+{
+  size=(size+HCACHELINE-1)/HCACHELINE*HCACHELINE;
+  void *p=0;
+  if(posix_memalign(&p,HCACHELINE,size)) return 0;
+  memset(p,0,size);
+  return p;
+}
+
+/* The bin of v on an axis of n equal bins from v0 to v1, as TAxis::FindBin() */
+inline Int_t hfindbin(Double_t v,Double_t v0,Double_t v1,Int_t n)
+{
+  if(v<v0) return 0;
+  if(!(v<v1)) return n+1; //NaN too
+  return 1+Int_t(n*(v-v0)/(v1-v0));
+}
+
+/* If the axis of n bins from v0 to v1 starts on a whole channel and its bins are
+ * 2^shift channels wide, shift; otherwise -1.
+ */
+inline Int_t hshift(Int_t n,Double_t v0,Double_t v1)
+{
+  if(n<1||v0!=Double_t(Int_t(v0))) return -1;
+  for(Int_t shift=0;shift<16;shift++)
+    if(v1-v0==Double_t(n)*(1<<shift)) return shift;
+  return -1;
+}
+
+/* An axis binned for whole channels */
+struct HChan {
+  Int_t n;                //bins
+  Int_t c0;               //low edge, when shift>=0
+  Int_t shift;            //log2 of the bin width in channels; -1 if not channel aligned
+  Double_t v0,v1;
+};
+
+inline void hchaninit(HChan &a,Int_t n,Double_t v0,Double_t v1)
+{
+  a.n=n;
+  a.v0=v0;
+  a.v1=v1;
+  a.shift=hshift(n,v0,v1);
+  a.c0=(a.shift<0) ? 0 : Int_t(v0);
+}
+
+/* The bin of channel c, as TAxis::FindBin() */
+inline Int_t hchanbin(const HChan &a,Int_t c)
+{
+  if(a.shift<0) return hfindbin(c,a.v0,a.v1,a.n);
+  UInt_t i=UInt_t(c-a.c0)>>a.shift; //below c0 wraps to far above n
+  if(i<UInt_t(a.n)) return i+1;
+  return (c<a.c0) ? 0 : a.n+1;
+}
+
+/* The bin of a fill's value.  Which is used is decided by the type of the value when
+ * the fill is compiled, so a fill with whole channels on a channel-aligned axis is
+ * binned by a shift and a floating-point fill pays nothing for the test.
+ */
+inline Int_t hbin(const HChan &a,Int_t v)
+{
+  return hchanbin(a,v);
+}
+
+inline Int_t hbin(const HChan &a,Float_t v)
+{
+  return hfindbin(v,a.v0,a.v1,a.n);
+}
+
+inline Int_t hbin(const HChan &a,Double_t v)
+{
+  return hfindbin(v,a.v0,a.v1,a.n);
+}
+
+/* Fill statistics kept outside a histogram, as TH1 keeps them */
+struct HStats {
+  Double_t entries;
+  Double_t tsumw,tsumw2,tsumwx,tsumwx2,tsumwy,tsumwy2,tsumwxy;
+};
+
+/* Counts one fill; under- and overflows are not in the sums */
+inline void hstatfill(HStats &s,Bool_t inrange,Double_t x,Double_t y,Double_t w)
+{
+  s.entries++;
+  if(!inrange) return;
+  s.tsumw+=w;
+  s.tsumw2+=w*w;
+  s.tsumwx+=w*x;
+  s.tsumwx2+=w*x*x;
+  s.tsumwy+=w*y;
+  s.tsumwy2+=w*y*y;
+  s.tsumwxy+=w*x*y;
+}
+
+/* Bins of a sparse histogram.  Cell (binx,biny), under- and overflow included as in
+ * TH1's fArray, is cell (binx%HTILE,biny%HTILE) of tile (binx/HTILE,biny/HTILE).
+ */
+struct HTiles {
+  Int_t ncx,ncy;          //cells along x and y
+  Int_t ntx,nty;          //tiles along x and y
+  Float_t **w;            //ntx*nty tiles, 0 until one of their cells is filled
+  Double_t **w2;          //squared weights, tiled as w; 0 until the first weighted fill
+  Int_t ntiles;           //tiles allocated
+};
+
+inline void htilesinit(HTiles &t,Int_t nx,Int_t ny)
+{
+  t.ncx=nx+2;
+  t.ncy=ny ? ny+2 : 1;
+  t.ntx=(t.ncx+HTILE-1)/HTILE;
+  t.nty=(t.ncy+HTILE-1)/HTILE;
+  t.w=(Float_t**)calloc(t.ntx*t.nty,sizeof(Float_t*));
+  t.w2=0;
+  t.ntiles=0;
+}
+
+/* The first weighted fill keeps squared weights from then on, starting from the
+ * contents, as TH1::Sumw2() does.
+ */
+inline void htilesumw2(HTiles &t)
+{
+  t.w2=(Double_t**)calloc(t.ntx*t.nty,sizeof(Double_t*));
+  for(Int_t k=0;k<t.ntx*t.nty;k++){
+    if(!t.w[k]) continue;
+    t.w2[k]=(Double_t*)halloc(HTILE*HTILE*sizeof(Double_t));
+    for(Int_t c=0;c<HTILE*HTILE;c++) t.w2[k][c]=t.w[k][c];
+  }
+}
+
+inline void htilefill(HTiles &t,Int_t binx,Int_t biny,Double_t w)
+{
+  Int_t k=(biny/HTILE)*t.ntx+binx/HTILE;
+  Int_t c=(biny%HTILE)*HTILE+binx%HTILE;
+  if(!t.w2&&w!=1) htilesumw2(t);
+  if(!t.w[k]){
+    t.w[k]=(Float_t*)halloc(HTILE*HTILE*sizeof(Float_t));
+    if(t.w2) t.w2[k]=(Double_t*)halloc(HTILE*HTILE*sizeof(Double_t));
+    t.ntiles++;
+  }
+  if(t.w2) t.w2[k][c]+=w*w;
+  t.w[k][c]+=Float_t(w);
+}
+
+inline void htilesfree(HTiles &t)
+{
+  for(Int_t k=0;t.w&&k<t.ntx*t.nty;k++){
+    free(t.w[k]);
+    if(t.w2) free(t.w2[k]);
+  }
+  free(t.w);
+  free(t.w2);
+  t.w=0;
+  t.w2=0;
+  t.ntiles=0;
+}
+
+/* Adds bins and statistics gathered outside histogram h into it: either ncells
+ * dense cells (bins, and sumw2 if weighted) or the tiles t.
+ */
+inline void hadd(TH1 *h,const HStats &st,Bool_t twod,Int_t ncells,const Float_t *bins,
+		 const Double_t *sumw2,const HTiles *t)
+{
+  Double_t stats[7];
+  h->GetStats(stats); //before the bins change, so ROOT does not recompute them
+  stats[0]+=st.tsumw;
+  stats[1]+=st.tsumw2;
+  stats[2]+=st.tsumwx;
+  stats[3]+=st.tsumwx2;
+  if(twod){
+    stats[4]+=st.tsumwy;
+    stats[5]+=st.tsumwy2;
+    stats[6]+=st.tsumwxy;
+  }
+  Double_t *w2=0;
+  if((t ? t->w2!=0 : sumw2!=0)||h->GetSumw2N()){
+    if(!h->GetSumw2N()) h->Sumw2(); //from the contents so far
+    w2=h->GetSumw2()->GetArray();
+  }
+  Float_t *a=twod ? ((TH2F*)h)->GetArray() : ((TH1F*)h)->GetArray();
+  if(!t){
+    for(Int_t i=0;i<ncells;i++) a[i]+=bins[i];
+    if(w2) for(Int_t i=0;i<ncells;i++) w2[i]+=(sumw2 ? sumw2[i] : bins[i]);
+  }
+  else{
+    for(Int_t ty=0;ty<t->nty;ty++)
+      for(Int_t tx=0;tx<t->ntx;tx++){
+	Int_t k=ty*t->ntx+tx;
+	if(!t->w[k]) continue;
+	for(Int_t cy=0;cy<HTILE&&ty*HTILE+cy<t->ncy;cy++)
+	  for(Int_t cx=0;cx<HTILE&&tx*HTILE+cx<t->ncx;cx++){
+	    Int_t cell=(ty*HTILE+cy)*t->ncx+tx*HTILE+cx;
+	    Int_t c=cy*HTILE+cx;
+	    a[cell]+=t->w[k][c];
+	    if(w2) w2[cell]+=(t->w2 ? t->w2[k][c] : t->w[k][c]);
+	  }
+      }
+  }
+  h->PutStats(stats);
+  h->SetEntries(h->GetEntries()+st.entries);
+}
+
+/* Adds counts of unit-weight fills, entries of them, into an integer-count histogram */
+inline void haddcounts(TH1 *h,Bool_t twod,Int_t ncells,const UInt_t *counts,Double_t entries)
+{
+  Int_t *a=twod ? ((TH2I*)h)->GetArray() : ((TH1I*)h)->GetArray();
+  for(Int_t i=0;i<ncells;i++) a[i]+=counts[i];
+  if(h->GetSumw2N()){
+    Double_t *w2=h->GetSumw2()->GetArray();
+    for(Int_t i=0;i<ncells;i++) w2[i]+=counts[i];
+  }
+  h->SetEntries(h->GetEntries()+entries);
+}
+
+/* A booked histogram, created on first use */
+struct HBook {
+  TString name,title;
+  Int_t nx,ny;            //bins; ny=0 for a 1D histogram
+  Double_t x0,x1,y0,y1;
+  Int_t kind;             //HDENSE, HSPARSE or HCOUNT
+  TDirectory *dir;        //current directory when booked
+  TH1 *h;                 //0 until created
+  HBook *next;            //next booking of the same thread
+};
+
+HTLS HBook *hlist;        //bookings of this thread, in booking order
+HTLS HBook **hlisttail;
+HBook *hmaster;           //hlist of the thread that ran userentry(); written by userexit()
+
+inline void hsetbook(HBook &b,const char *name,const char *title,Int_t nx,Double_t x0,Double_t x1,
+		     Int_t ny,Double_t y0,Double_t y1,Int_t kind)
+{
+  b.name=name;
+  b.title=title;
+  b.nx=nx;
+  b.x0=x0;
+  b.x1=x1;
+  b.ny=ny;
+  b.y0=y0;
+  b.y1=y1;
+  b.kind=kind;
+  b.dir=gDirectory;
+  b.h=0;
+  b.next=0;
+  if(!hlisttail) hlisttail=&hlist;
+  *hlisttail=&b;
+  hlisttail=&b.next;
+}
+
+/* Creates the booking's histogram if it does not exist yet */
+inline TH1 *hcreate(HBook &b)
+{
+  if(b.h) return b.h;
+  if(b.kind==HCOUNT){
+    if(b.ny) b.h=new TH2I(b.name,b.title,b.nx,b.x0,b.x1,b.ny,b.y0,b.y1);
+    else b.h=new TH1I(b.name,b.title,b.nx,b.x0,b.x1);
+  }
+  else if(b.ny) b.h=new TH2F(b.name,b.title,b.nx,b.x0,b.x1,b.ny,b.y0,b.y1);
+  else b.h=new TH1F(b.name,b.title,b.nx,b.x0,b.x1);
+  b.h->SetDirectory(b.dir);
+  return b.h;
+}
+
+/* Writes an empty histogram for every booking of userentry() that was never
+ * filled, one at a time, and frees it again.  Returns the number written.
+ */
+inline Int_t hstubs()
+{
+  Int_t nstubs=0;
+  for(HBook *b=hmaster;b;b=b->next){
+    if(b->h) continue;
+    hcreate(*b);
+    b->dir->WriteTObject(b->h);
+    delete b->h;
+    b->h=0;
+    nstubs++;
+  }
+  if(nstubs) printf("%d empty histograms written as stubs\n",nstubs);
+  return nstubs;
+}
+
+#ifndef HELIOS_THREADS
+
+#include <pthread.h>
+#include <sched.h>
+
+#define HBUSY 2           //hstate: the sort is in an event
+
+Bool_t hdouble;           //count fills go to the banks, see hdoublebuffer()
+UInt_t hstate;            //bank being filled, 0 or 1, and HBUSY
+Int_t hbank;              //bank being filled, as the fills of an event see it
+UInt_t *hseq;             //seqlock of the shared-memory copy, 0 if not served
+pthread_mutex_t hsnaplock=PTHREAD_MUTEX_INITIALIZER; //one snapshot or reset at a time
+
+/* Seqlock of the shared-memory copy: odd while its contents change as a whole */
+inline void hseqbegin(UInt_t *seq)
+{
+  __atomic_store_n(seq,*seq+1,__ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+inline void hseqend(UInt_t *seq)
+{
+  __atomic_store_n(seq,*seq+1,__ATOMIC_RELEASE);
+}
+
+/* The histogram is made by its first fill, or by the first use of it from the session:
+ * GetHist(), Draw() and Fit() book it, and it converts to a TH1*.
+ */
+struct HLazy : HBook {
+  TH1 *GetHist()
+  {
+    return h ? h : hcreate(*this);
+  }
+  operator TH1*()
+  {
+    return GetHist();
+  }
+  void Draw(Option_t *option="")
+  {
+    GetHist()->Draw(option);
+  }
+  Int_t Fit(const char *formula,Option_t *option="",Option_t *goption="",Double_t xmin=0,
+	    Double_t xmax=0)
+  {
+    return GetHist()->Fit(formula,option,goption,xmin,xmax);
+  }
+};
+
+struct HLazy1 : HLazy {
+  void Fill(Double_t x,Double_t w=1)
+  {
+    if(!h) hcreate(*this);
+    h->Fill(x,w);
+  }
+};
+
+struct HLazy2 : HLazy {
+  void Fill(Double_t x,Double_t y,Double_t w=1)
+  {
+    if(!h) hcreate(*this);
+    ((TH2F*)h)->Fill(x,y,w);
+  }
+};
+
+struct HSparse2 : HBook {
+  HChan ax,ay;
+  HTiles tiles;
+  HStats st;
+  /* As TH2::Fill(x,y,w) */
+  template<class X,class Y> void Fill(X x,Y y,Double_t w=1)
+  {
+    Int_t binx=hbin(ax,x);
+    Int_t biny=hbin(ay,y);
+    htilefill(tiles,binx,biny,w);
+    hstatfill(st,binx>0&&binx<=nx&&biny>0&&biny<=ny,x,y,w);
+  }
+};
+
+/* The histogram is made by the booking; a fill adds one to its bin in place, and to
+ * the bin of its copy in shared memory when it is served (see helios_shm.h), or to
+ * the bank being filled when double-buffered.
+ */
+struct HCount : HBook {
+  Int_t *a;               //the TH1I's or TH2I's bins
+  Int_t *ma;              //bins of the shared-memory copy, 0 if not served
+  Long64_t *mentries;     //entries of the shared-memory copy
+  UInt_t *bank[2];        //banks of a double-buffered histogram
+  Long64_t nbank[2];      //fills in each bank
+  Long64_t nfill;         //fills made in place, the histogram's entries after hentries()
+  void count(Int_t cell)
+  {
+    if(hdouble){
+      bank[hbank][cell]++;
+      nbank[hbank]++;
+      return;
+    }
+    a[cell]++;
+    nfill++;
+    if(ma){
+      ma[cell]++;
+      (*mentries)++;
+    }
+  }
+};
+
+struct HCount1 : HCount {
+  HChan ax;
+  void Fill(Int_t x)
+  {
+    count(hchanbin(ax,x));
+  }
+};
+
+struct HCount2 : HCount {
+  HChan ax,ay;
+  void Fill(Int_t x,Int_t y)
+  {
+    count(hchanbin(ay,y)*(nx+2)+hchanbin(ax,x));
+  }
+};
+
+typedef HLazy1 H1F;
+typedef HLazy2 H2F;
+typedef HSparse2 H2S;
+typedef HCount1 H1I;
+typedef HCount2 H2I;
+
+inline H1F *hbook1(const char *name,const char *title,Int_t nx,Double_t x0,Double_t x1)
+{
+  H1F *b=new H1F;
+  hsetbook(*b,name,title,nx,x0,x1,0,0,0,HDENSE);
+  return b;
+}
+
+inline H2F *hbook2(const char *name,const char *title,Int_t nx,Double_t x0,Double_t x1,
+		   Int_t ny,Double_t y0,Double_t y1)
+{
+  H2F *b=new H2F;
+  hsetbook(*b,name,title,nx,x0,x1,ny,y0,y1,HDENSE);
+  return b;
+}
+
+inline H2S *hbook2s(const char *name,const char *title,Int_t nx,Double_t x0,Double_t x1,
+		    Int_t ny,Double_t y0,Double_t y1)
+{
+  H2S *b=new H2S;
+  hsetbook(*b,name,title,nx,x0,x1,ny,y0,y1,HSPARSE);
+  hchaninit(b->ax,nx,x0,x1);
+  hchaninit(b->ay,ny,y0,y1);
+  htilesinit(b->tiles,nx,ny);
+  memset(&b->st,0,sizeof(b->st));
+  return b;
+}
+
+inline H1I *hbook1i(const char *name,const char *title,Int_t nx,Double_t x0,Double_t x1)
+{
+  H1I *b=new H1I;
+  hsetbook(*b,name,title,nx,x0,x1,0,0,0,HCOUNT);
+  hchaninit(b->ax,nx,x0,x1);
+  b->a=((TH1I*)hcreate(*b))->GetArray();
+  b->ma=0;
+  b->mentries=0;
+  b->bank[0]=b->bank[1]=0;
+  b->nfill=0;
+  return b;
+}
+
+inline H2I *hbook2i(const char *name,const char *title,Int_t nx,Double_t x0,Double_t x1,
+		    Int_t ny,Double_t y0,Double_t y1)
+{
+  H2I *b=new H2I;
+  hsetbook(*b,name,title,nx,x0,x1,ny,y0,y1,HCOUNT);
+  hchaninit(b->ax,nx,x0,x1);
+  hchaninit(b->ay,ny,y0,y1);
+  b->a=((TH2I*)hcreate(*b))->GetArray();
+  b->ma=0;
+  b->mentries=0;
+  b->bank[0]=b->bank[1]=0;
+  b->nfill=0;
+  return b;
+}
+
+/* Nothing to add: every fill went straight into the histograms */
+inline Int_t hmerge()
+{
+  return 0;
+}
+
+/* Books every histogram of userentry() not filled yet, so the session's directory lists
+ * them all.  Costs the memory the lazy booking saves.  Returns the number booked.
+ */
+inline Int_t hbookall()
+{
+  Int_t n=0;
+  for(HBook *b=hmaster;b;b=b->next){
+    if(b->h||b->kind==HSPARSE) continue; //a sparse booking is made dense at userexit()
+    hcreate(*b);
+    n++;
+  }
+  return n;
+}
+
+/* Deletes the booking records of userentry(), after the histograms are written; the
+ * histograms themselves belong to their directory.
+ */
+inline void hfree()
+{
+  while(hmaster){
+    HBook *b=hmaster;
+    hmaster=b->next;
+    if(b->kind==HSPARSE){
+      htilesfree(((HSparse2*)b)->tiles);
+      delete (HSparse2*)b;
+    }
+    else if(b->kind==HCOUNT){
+      HCount *c=(HCount*)b;
+      free(c->bank[0]);
+      free(c->bank[1]);
+      if(b->ny) delete (HCount2*)b;
+      else delete (HCount1*)b;
+    }
+    else if(b->ny) delete (HLazy2*)b;
+    else delete (HLazy1*)b;
+  }
+  hlist=0;
+  hlisttail=0;
+  hdouble=kFALSE;
+}
+
+inline Int_t hcells(const HBook *b)
+{
+  return (b->nx+2)*(b->ny ? b->ny+2 : 1);
+}
+
+/* Double-buffers the count histograms booked by userentry().  Call after setting
+ * hmaster.
+ */
+inline void hdoublebuffer()
+{
+  for(HBook *b=hmaster;b;b=b->next){
+    if(b->kind!=HCOUNT) continue;
+    HCount *c=(HCount*)b;
+    for(Int_t k=0;k<2;k++){
+      c->bank[k]=(UInt_t*)halloc(hcells(b)*sizeof(UInt_t));
+      c->nbank[k]=0;
+    }
+  }
+  hstate=0;
+  hbank=0;
+  hdouble=kTRUE;
+}
+
+/* Marks the start and end of an event, in the sort thread */
+inline void hbegin()
+{
+  hbank=__atomic_fetch_or(&hstate,HBUSY,__ATOMIC_ACQUIRE)&1;
+}
+
+inline void hend()
+{
+  __atomic_fetch_and(&hstate,~(UInt_t)HBUSY,__ATOMIC_RELEASE);
+}
+
+/* Flips the bank being filled between two events.  Returns the bank frozen.  Not
+ * from the sort thread inside an event, which would wait on itself.
+ */
+inline Int_t hflip()
+{
+  for(;;){
+    UInt_t s=__atomic_load_n(&hstate,__ATOMIC_ACQUIRE);
+    if(s&HBUSY){
+      sched_yield(); //an event takes microseconds
+      continue;
+    }
+    if(__atomic_compare_exchange_n(&hstate,&s,s^1,kFALSE,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+      return s&1;
+  }
+}
+
+/* Sets the entries of the count histograms filled in place, for the session or before
+ * Write().  Returns the number of histograms with any.
+ */
+inline Int_t hentries()
+{
+  Int_t n=0;
+  for(HBook *b=hmaster;b;b=b->next){
+    if(b->kind!=HCOUNT) continue;
+    HCount *c=(HCount*)b;
+    if(!c->nfill) continue;
+    b->h->SetEntries(c->nfill);
+    n++;
+  }
+  return n;
+}
+
+/* Adds the fills since the last snapshot into the histograms and their shared-memory
+ * copy, or, not double-buffered, sets the entries of the histograms filled in place.
+ * Returns the number of fills added.
+ */
+inline Long64_t hsnapshot()
+{
+  if(!hdouble){
+    hentries();
+    return 0;
+  }
+  pthread_mutex_lock(&hsnaplock);
+  Int_t k=hflip();
+  Long64_t n=0;
+  if(hseq) hseqbegin(hseq);
+  for(HBook *b=hmaster;b;b=b->next){
+    if(b->kind!=HCOUNT) continue;
+    HCount *c=(HCount*)b;
+    if(!c->nbank[k]) continue;
+    Int_t ncells=hcells(b);
+    UInt_t *f=c->bank[k];
+    for(Int_t i=0;i<ncells;i++) c->a[i]+=f[i];
+    if(c->ma){
+      for(Int_t i=0;i<ncells;i++) c->ma[i]+=f[i];
+      *c->mentries+=c->nbank[k];
+    }
+    b->h->SetEntries(b->h->GetEntries()+c->nbank[k]);
+    memset(f,0,ncells*sizeof(UInt_t));
+    n+=c->nbank[k];
+    c->nbank[k]=0;
+  }
+  if(hseq) hseqend(hseq);
+  pthread_mutex_unlock(&hsnaplock);
+  return n;
+}
+
+/* Empties the histograms and their shared-memory copy.  The fills of the events after
+ * the flip are kept, for the next snapshot.
+ */
+inline void hreset()
+{
+  if(!hdouble) return;
+  pthread_mutex_lock(&hsnaplock);
+  Int_t k=hflip();
+  if(hseq) hseqbegin(hseq);
+  for(HBook *b=hmaster;b;b=b->next){
+    if(b->kind!=HCOUNT) continue;
+    HCount *c=(HCount*)b;
+    Int_t ncells=hcells(b);
+    memset(c->bank[k],0,ncells*sizeof(UInt_t));
+    c->nbank[k]=0;
+    memset(c->a,0,ncells*sizeof(Int_t));
+    c->nfill=0;
+    b->h->SetEntries(0);
+    if(c->ma){
+      memset(c->ma,0,ncells*sizeof(Int_t));
+      *c->mentries=0;
+    }
+  }
+  if(hseq) hseqend(hseq);
+  pthread_mutex_unlock(&hsnaplock);
+}
+
+/* Makes the TH2F of each filled sparse booking from its tiles, and frees them, and sets
+ * the entries of the count histograms.  Returns the number made.
+ */
+inline Int_t hdensify()
+{
+  Int_t n=0;
+  hentries();
+  for(HBook *b=hmaster;b;b=b->next){
+    if(b->kind!=HSPARSE) continue;
+    HSparse2 *s=(HSparse2*)b;
+    if(!s->st.entries) continue;
+    hadd(hcreate(*s),s->st,kTRUE,0,0,0,&s->tiles);
+    htilesfree(s->tiles);
+    memset(&s->st,0,sizeof(s->st));
+    n++;
+  }
+  return n;
+}
+
+#else
+
+/* One thread's fills of one histogram.  The cells are those of TH1's fArray,
+ * under- and overflow included, cell = biny*(nx+2)+binx; a sparse booking's
+ * are tiled.
+ */
+struct HShard {
+  HBook *book;            //booking of userentry(); 0 if it could not be matched
+  Int_t nx,ny;            //bins; ny=0 for a 1D histogram
+  Double_t x0,x1,y0,y1;
+  Int_t ncells;
+  Float_t *bins;          //0 until the first fill
+  Double_t *sumw2;        //squared weights per cell, 0 until the first weighted fill
+  HTiles *tiles;          //bins of a sparse booking, instead of bins and sumw2
+  HChan ax,ay;            //axes, for hbin()
+  UInt_t *counts;         //bins of an integer-count booking, instead of bins; 0 until the first fill
+  HStats st;
+  HShard *next;           //this thread's next shard, in booking order
+};
+
+HTLS HShard *hshards;     //this thread's shards, in booking order
+HTLS HShard **hshardtail;
+HTLS Int_t hbooked;       //histograms booked so far by this thread
+
+inline void hsumw2(HShard &s)
+{
+  s.sumw2=(Double_t*)halloc(s.ncells*sizeof(Double_t));
+  for(Int_t i=0;i<s.ncells;i++) s.sumw2[i]=s.bins[i]; //as TH1::Sumw2()
+}
+
+/* Dense shards fill one cell of the bins array */
+inline void hcellfill(HShard &s,Int_t bin,Double_t w)
+{
+  if(!s.bins) s.bins=(Float_t*)halloc(s.ncells*sizeof(Float_t));
+  if(!s.sumw2&&w!=1) hsumw2(s);
+  if(s.sumw2) s.sumw2[bin]+=w*w;
+  s.bins[bin]+=Float_t(w);
+}
+
+struct HFill1 : HShard {
+  /* As TH1::Fill(x,w) */
+  template<class X> void Fill(X x,Double_t w=1)
+  {
+    Int_t bin=hbin(ax,x);
+    hcellfill(*this,bin,w);
+    hstatfill(st,bin>0&&bin<=nx,x,0,w);
+  }
+};
+
+struct HFill2 : HShard {
+  /* As TH2::Fill(x,y,w) */
+  template<class X,class Y> void Fill(X x,Y y,Double_t w=1)
+  {
+    Int_t binx=hbin(ax,x);
+    Int_t biny=hbin(ay,y);
+    hcellfill(*this,biny*(nx+2)+binx,w);
+    hstatfill(st,binx>0&&binx<=nx&&biny>0&&biny<=ny,x,y,w);
+  }
+};
+
+struct HFillS : HShard {
+  /* As TH2::Fill(x,y,w), into tiles */
+  template<class X,class Y> void Fill(X x,Y y,Double_t w=1)
+  {
+    Int_t binx=hbin(ax,x);
+    Int_t biny=hbin(ay,y);
+    htilefill(*tiles,binx,biny,w);
+    hstatfill(st,binx>0&&binx<=nx&&biny>0&&biny<=ny,x,y,w);
+  }
+};
+
+inline void hcount(HShard &s,Int_t bin)
+{
+  if(!s.counts) s.counts=(UInt_t*)halloc(s.ncells*sizeof(UInt_t));
+  s.counts[bin]++;
+  s.st.entries++;
+}
+
+struct HCountFill1 : HShard {
+  /* As TH1I::Fill(x) for a whole channel x, less the sums */
+  void Fill(Int_t x)
+  {
+    hcount(*this,hchanbin(ax,x));
+  }
+};
+
+struct HCountFill2 : HShard {
+  /* As TH2I::Fill(x,y) for whole channels, less the sums */
+  void Fill(Int_t x,Int_t y)
+  {
+    hcount(*this,hchanbin(ay,y)*(nx+2)+hchanbin(ax,x));
+  }
+};
+
+typedef HFill1 H1F;
+typedef HFill2 H2F;
+typedef HFillS H2S;
+typedef HCountFill1 H1I;
+typedef HCountFill2 H2I;
+
+/* Makes this thread's shard for its next booking.  The thread that runs userentry()
+ * makes the booking itself; any other thread finds it in hmaster by booking order.
+ */
+inline HShard *hshard(const char *name,const char *title,Int_t nx,Double_t x0,Double_t x1,
+		      Int_t ny,Double_t y0,Double_t y1,Int_t kind)
+{
+  HShard *s=(HShard*)halloc(sizeof(HShard));
+  if(!hmaster){
+    s->book=new HBook;
+    hsetbook(*s->book,name,title,nx,x0,x1,ny,y0,y1,kind);
+  }
+  else{
+    HBook *b=hmaster;
+    for(Int_t n=0;b&&n<hbooked;n++) b=b->next;
+    if(b&&!strcmp(b->name,name)) s->book=b;
+    else printf("hbook: %s does not match booking %d of userentry().  Its fills are dropped.\n",name,hbooked);
+  }
+  hbooked++;
+  s->nx=nx;
+  s->ny=ny;
+  s->x0=x0;
+  s->x1=x1;
+  s->y0=y0;
+  s->y1=y1;
+  s->ncells=(nx+2)*(ny ? ny+2 : 1);
+  if(kind==HSPARSE){
+    s->tiles=new HTiles;
+    htilesinit(*s->tiles,nx,ny);
+  }
+  hchaninit(s->ax,nx,x0,x1);
+  hchaninit(s->ay,ny,y0,y1);
+  if(!hshardtail) hshardtail=&hshards;
+  *hshardtail=s;
+  hshardtail=&s->next;
+  return s;
+}
+
+inline H1F *hbook1(const char *name,const char *title,Int_t nx,Double_t x0,Double_t x1)
+{
+  return (H1F*)hshard(name,title,nx,x0,x1,0,0,0,HDENSE);
+}
+
+inline H2F *hbook2(const char *name,const char *title,Int_t nx,Double_t x0,Double_t x1,
+		   Int_t ny,Double_t y0,Double_t y1)
+{
+  return (H2F*)hshard(name,title,nx,x0,x1,ny,y0,y1,HDENSE);
+}
+
+inline H2S *hbook2s(const char *name,const char *title,Int_t nx,Double_t x0,Double_t x1,
+		    Int_t ny,Double_t y0,Double_t y1)
+{
+  return (H2S*)hshard(name,title,nx,x0,x1,ny,y0,y1,HSPARSE);
+}
+
+inline H1I *hbook1i(const char *name,const char *title,Int_t nx,Double_t x0,Double_t x1)
+{
+  return (H1I*)hshard(name,title,nx,x0,x1,0,0,0,HCOUNT);
+}
+
+inline H2I *hbook2i(const char *name,const char *title,Int_t nx,Double_t x0,Double_t x1,
+		    Int_t ny,Double_t y0,Double_t y1)
+{
+  return (H2I*)hshard(name,title,nx,x0,x1,ny,y0,y1,HCOUNT);
+}
+
+/* Adds this thread's fills into the histograms booked by userentry(), creating
+ * those filled for the first time, and frees the shards' bins.  A worker's shards
+ * are freed too; those of the thread that ran userentry() go on filling.  Call with
+ * the other threads stopped or serialised (usermerge() runs under
+ * helios_offline_sort's lock).  Returns the number of shards added.
+ */
+inline Int_t hmerge()
+{
+  Bool_t master=(hlist&&hlist==hmaster);
+  Int_t nmerged=0;
+  HShard *s=hshards;
+  while(s){
+    HShard *next=s->next;
+    if(s->book&&s->st.entries){
+      if(s->counts) haddcounts(hcreate(*s->book),s->ny!=0,s->ncells,s->counts,s->st.entries);
+      else hadd(hcreate(*s->book),s->st,s->ny!=0,s->ncells,s->bins,s->sumw2,s->tiles);
+      nmerged++;
+    }
+    free(s->bins);
+    free(s->sumw2);
+    free(s->counts);
+    s->bins=0;
+    s->sumw2=0;
+    s->counts=0;
+    memset(&s->st,0,sizeof(s->st));
+    if(s->tiles){
+      htilesfree(*s->tiles);
+      if(master) htilesinit(*s->tiles,s->nx,s->ny);
+      else delete s->tiles;
+    }
+    if(!master) free(s);
+    s=next;
+  }
+  if(!master){
+    hshards=0;
+    hshardtail=0;
+    hbooked=0;
+  }
+  return nmerged;
+}
+
+/* Sparse bookings were made dense when their shards were merged */
+inline Int_t hdensify()
+{
+  return 0;
+}
+
+/* Deletes the booking records of userentry(), after the histograms are written */
+inline void hfree()
+{
+  for(HShard *s=hshards;s;s=s->next) s->book=0;
+  while(hmaster){
+    HBook *b=hmaster;
+    hmaster=b->next;
+    delete b;
+  }
+  hlist=0;
+  hlisttail=0;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,454 @@
+/* Program: helios_hitcache.h
+ * Purpose:
+ *       Cache of the unpacked array hits of a run, so the calibration passes after
+ *       the first (DoCal levels 1 to 4) read only the hits instead of the raw
+ *       events.  A hit is kept as its detector and raw E, XF and XN channels, an
+ *       event as its TAC channel and number of hits; events with no hit past the
+ *       thresholds are not kept.
+ *
+ *       The file is a header record followed by chunks of up to HCHITS hits, laid
+ *       out like the records of an event file (first 32-bit word the length in
+ *       bytes), so helios_evfile.h maps and walks it.  A chunk holds its events and
+ *       hits in columns: hits per event (a byte), TAC, detector (a byte), E, XF, XN,
+ *       the 12-bit columns packed two channels to three bytes.  That is 5.5 bytes a
+ *       hit and 2.5 an event.  The header records the thresholds and detector mask
+ *       the hits were selected with, and a checksum of the channel map, so a cache
+ *       made with other settings is not mistaken for this sort's hits.  It also names
+ *       the event files the hits came from, with their size and modification time, as
+ *       helios_offline_sort gives them to hcsource(); a cache made by daphne names none.
+ *       The header is written again by hcfinish() at the end of a sort that saw the
+ *       run's stop, with the events and hits written and the completion mark, so a
+ *       cache left by a crashed or stopped sort is never taken for a whole one.
+ *       hcmatch() refuses a cache without the mark, or one of whose event files is
+ *       still there but has changed.
+ *
+ *       Each sort thread fills its own HCHits and writes it as one chunk, in one
+ *       fwrite(), when full; chunks from different threads may interleave, but
+ *       every chunk is whole and holds whole events.
+ *
+ * Usage:
+ *       hcsource(argv[i]);                       //helios_offline_sort, per file, before userentry()
+ *       HCHeader hc;
+ *       hcsetheader(hc,lowthr,minTime,mask,wiring);
+ *       TString name=hcname(base);               //run.hits, or base.hits under daphne
+ *       if(hcstale(name,hc))
+ *         FILE *fp=hccreate(name,hc);            //first sort of the run
+ *       HCHits *w=hcnew();
+ *       hcevent(*w,fp,tac,n,det,e,xf,xn);        //per event, its hits past the thresholds
+ *       hcflush(*w,fp);                          //at the end of the thread
+ *       hcfinish(fp,hc);                         //at the end of the run, once flushed
+ *
+ *       later passes, per record of the mapped file (see helios_evfile.h):
+ *       if(hcisheader(rec)) ok=!hcmatch(rec,hc); //the first: settings the same?
+ *       else hcdecode(rec,*w);                   //a chunk, into w
+ */
+#ifndef HELIOS_HITCACHE_H
+#define HELIOS_HITCACHE_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+#include "Rtypes.h"
+#include "TString.h"
+
+#define HCMAGIC 0x31434848 //"HHC1", second word of a hit cache's header record
+#define HCCHUNK 0x4b434848 //"HHCK", second word of each chunk
+#define HCHITS  4096       //hits per chunk
+#define HCDONE  0x454e4f44 //"DONE", the completion mark
+#define HCSOURCES 16       //event files named in the header
+#define HCNAME  240        //bytes of a file name kept, its end if longer
+#define HCDETS  24         //detectors, a bit each in the mask; NDET of helios_unpack.h
+
+struct HCSource {
+  char name[HCNAME];
+  Long64_t size;
+  Long64_t mtime;
+};
+
+struct HCHeader {
+  UInt_t len;             //bytes, as an event record's length word
+  UInt_t magic;
+  Int_t lowthr,minTime;   //thresholds the hits passed
+  UInt_t mask;            //detectors included, bit per detector
+  UInt_t wiring;          //checksum of the channel map
+  UInt_t done;            //HCDONE once the run was sorted to its stop, 0 before
+  Int_t nsource;          //event files the hits came from, 0 if not known
+  Long64_t nevents,nhits; //written, set with the mark
+  HCSource source[HCSOURCES];
+};
+
+struct HCInputs {
+  HCSource source[HCSOURCES]; //event files of this sort, given to hcsource()
+  Int_t nsource;              //-1 if there were too many to name
+  Int_t ncache;               //hit caches given to hcsource()
+  char cache[HCNAME];         //the first of them
+  Long64_t nevents,nhits;     //written to the cache so far, by all threads
+};
+
+/* The inputs of this sort: one copy in the program, shared by the driver and the sort */
+inline HCInputs &hcinputs()
+{
+  static HCInputs in;
+  return in;
+}
+
+struct HCChunk {
+  UInt_t len;
+  UInt_t magic;
+  UInt_t nevents,nhits;
+};
+
+/* The hits of one chunk, unpacked */
+struct HCHits {
+  Int_t nevents,nhits;
+  UChar_t nhit[HCHITS];   //hits of each event
+  UShort_t tac[HCHITS];   //TAC channel of each event
+  UChar_t det[HCHITS];    //detector 0-23 of each hit
+  UShort_t e[HCHITS],xf[HCHITS],xn[HCHITS];
+  Long64_t nbytes;        //written so far
+};
+
+/* Bytes of n 12-bit channels packed two to three bytes */
+inline Int_t hcpacked(Int_t n)
+{
+  return (3*n+1)/2;
+}
+
+inline UChar_t *hcpack12(UChar_t *p,const UShort_t *v,Int_t n)
+{
+  Int_t k=0;
+  for(;k+1<n;k+=2){
+    p[0]=v[k];
+    p[1]=(v[k]>>8)|(v[k+1]<<4);
+    p[2]=v[k+1]>>4;
+    p+=3;
+  }
+  if(k<n){
+    p[0]=v[k];
+    p[1]=v[k]>>8;
+    p+=2;
+  }
+  return p;
+}
+
+inline const UChar_t *hcunpack12(const UChar_t *p,UShort_t *v,Int_t n)
+{
+  Int_t k=0;
+  for(;k+1<n;k+=2){
+    v[k]=p[0]|((p[1]&0xf)<<8);
+    v[k+1]=(p[1]>>4)|(p[2]<<4);
+    p+=3;
+  }
+  if(k<n){
+    v[k]=p[0]|((p[1]&0xf)<<8);
+    p+=2;
+  }
+  return p;
+}
+
+/* Length of a chunk, padded to whole words */
+inline UInt_t hcchunklen(Int_t nevents,Int_t nhits)
+{
+  UInt_t len=sizeof(HCChunk)+nevents+hcpacked(nevents)+nhits+3*hcpacked(nhits);
+  return (len+3)&~3u;
+}
+
+inline void hcsetheader(HCHeader &hc,Int_t lowthr,Int_t minTime,UInt_t mask,UInt_t wiring)
+{
+  memset(&hc,0,sizeof(hc));
+  hc.len=sizeof(HCHeader);
+  hc.magic=HCMAGIC;
+  hc.lowthr=lowthr;
+  hc.minTime=minTime;
+  hc.mask=mask;
+  hc.wiring=wiring;
+  hc.nsource=hcinputs().nsource;
+  memcpy(hc.source,hcinputs().source,sizeof(hc.source));
+}
+
+/* Size and modification time of a file, as the header keeps them.  Returns 1 if it is
+ * not there.
+ */
+inline Int_t hcstat(const char *name,HCSource &src)
+{
+  struct stat st;
+  memset(&src,0,sizeof(src));
+  Int_t n=strlen(name);
+  strncpy(src.name,n<HCNAME ? name : name+n-(HCNAME-1),HCNAME-1);
+  if(stat(name,&st)) return 1;
+  src.size=st.st_size;
+  src.mtime=st.st_mtime;
+  return 0;
+}
+
+/* Names an input file of the sort, before userentry().  A hit cache is counted, and
+ * the first kept as hcinputs().cache, but not named in the header.  Returns 1 if there
+ * is no room to name it, and the cache then names none.
+ */
+inline Int_t hcsource(const char *name)
+{
+  HCInputs &in=hcinputs();
+  FILE *fp=fopen(name,"rb");
+  UInt_t w[2]={0,0};
+  if(fp){
+    if(fread(w,sizeof(w),1,fp)!=1) w[1]=0;
+    fclose(fp);
+  }
+  if(w[1]==HCMAGIC){
+    if(!in.ncache++) strncpy(in.cache,name,HCNAME-1);
+    return 0;
+  }
+  if(in.nsource<0) return 1;
+  if(in.nsource==HCSOURCES){
+    printf("More than %d event files: the hit cache will not name them\n",HCSOURCES);
+    in.nsource=-1;
+    return 1;
+  }
+  hcstat(name,in.source[in.nsource++]);
+  return 0;
+}
+
+/* Name of the cache of the files given to hcsource(): the first one's, without its
+ * directory and extension, with .hits; base.hits if none was given.
+ */
+inline TString hcname(const TString &base)
+{
+  const HCInputs &in=hcinputs();
+  if(in.nsource<=0) return base+".hits";
+  const char *file=strrchr(in.source[0].name,'/');
+  char run[HCNAME];
+  strcpy(run,file ? file+1 : in.source[0].name);
+  char *dot=strrchr(run,'.');
+  if(dot&&dot>run) *dot=0;
+  TString name=run;
+  name+=".hits";
+  return name;
+}
+
+/* Checks that the files named in a header are, where still there, as they were.
+ * Returns 0 if so, after saying which is not otherwise.
+ */
+inline Int_t hcsourcesmatch(const HCHeader &h)
+{
+  for(Int_t i=0;i<h.nsource&&i<HCSOURCES;i++){
+    HCSource now;
+    if(hcstat(h.source[i].name,now)) continue; //moved or archived
+    if(now.size!=h.source[i].size||now.mtime!=h.source[i].mtime){
+      printf("Hit cache made from %s, which has changed since.  Resort the raw events.\n",
+	     h.source[i].name);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Decides whether the cache of this sort's events must be written: it is not there, not
+ * whole, or made with other settings or from other files.  A sort that names no files,
+ * as under daphne, keeps a whole cache made with its settings.  Returns 0 if the cache
+ * there will do, after saying why not otherwise.
+ */
+inline Int_t hcstale(const char *name,const HCHeader &hc)
+{
+  FILE *fp=fopen(name,"rb");
+  if(!fp) return 1;
+  HCHeader h;
+  Bool_t read=(fread(&h,sizeof(h),1,fp)==1);
+  fclose(fp);
+  if(!read||h.magic!=HCMAGIC||h.len!=sizeof(h)) printf("Hit cache %s is not one of this sort's\n",name);
+  else if(h.done!=HCDONE) printf("Hit cache %s was not finished\n",name);
+  else if(h.lowthr!=hc.lowthr||h.minTime!=hc.minTime||h.mask!=hc.mask||h.wiring!=hc.wiring)
+    printf("Hit cache %s was made with other settings\n",name);
+  else if(hc.nsource<=0) return 0; //nothing to check the events against
+  else if(h.nsource!=hc.nsource)
+    printf("Hit cache %s may be of other events\n",name);
+  else{
+    for(Int_t i=0;i<h.nsource;i++)
+      if(strcmp(h.source[i].name,hc.source[i].name)||h.source[i].size!=hc.source[i].size||
+	 h.source[i].mtime!=hc.source[i].mtime){
+	printf("Hit cache %s is of other events\n",name);
+	return 1;
+      }
+    return 0;
+  }
+  return 1;
+}
+
+/* A checksum of n ints, for the channel map */
+inline UInt_t hcchecksum(const Int_t *v,Int_t n)
+{
+  UInt_t sum=2166136261u; //FNV-1a
+  for(Int_t i=0;i<n;i++){
+    sum^=(UInt_t)v[i];
+    sum*=16777619u;
+  }
+  return sum;
+}
+
+/* Creates a cache and writes its header.  Returns 0 if it cannot be created. */
+inline FILE *hccreate(const char *name,const HCHeader &hc)
+{
+  FILE *fp=fopen(name,"wb");
+  if(!fp){
+    printf("Cannot create hit cache \"%s\"\n",name);
+    return 0;
+  }
+  fwrite(&hc,sizeof(hc),1,fp);
+  return fp;
+}
+
+inline HCHits *hcnew()
+{
+  HCHits *w=new HCHits;
+  w->nevents=w->nhits=0;
+  w->nbytes=0;
+  return w;
+}
+
+/* Writes the hits held as one chunk and empties w */
+inline void hcflush(HCHits &w,FILE *fp)
+{
+  if(!w.nevents) return;
+  UInt_t len=hcchunklen(w.nevents,w.nhits);
+  UChar_t *rec=(UChar_t*)calloc(len,1);
+  HCChunk c={len,HCCHUNK,(UInt_t)w.nevents,(UInt_t)w.nhits};
+  memcpy(rec,&c,sizeof(c));
+  UChar_t *p=rec+sizeof(c);
+  memcpy(p,w.nhit,w.nevents);
+  p+=w.nevents;
+  p=hcpack12(p,w.tac,w.nevents);
+  memcpy(p,w.det,w.nhits);
+  p+=w.nhits;
+  p=hcpack12(p,w.e,w.nhits);
+  p=hcpack12(p,w.xf,w.nhits);
+  p=hcpack12(p,w.xn,w.nhits);
+  if(fp) fwrite(rec,len,1,fp); //one call, so a chunk is never split by another thread's
+  free(rec);
+  __atomic_fetch_add(&hcinputs().nevents,w.nevents,__ATOMIC_RELAXED);
+  __atomic_fetch_add(&hcinputs().nhits,w.nhits,__ATOMIC_RELAXED);
+  w.nbytes+=len;
+  w.nevents=w.nhits=0;
+}
+
+/* Marks a cache whole, with the events and hits written, once every thread's chunk is
+ * flushed: the header is written again over the first.
+ */
+inline void hcfinish(FILE *fp,const HCHeader &hc)
+{
+  HCHeader h=hc;
+  h.done=HCDONE;
+  h.nevents=hcinputs().nevents;
+  h.nhits=hcinputs().nhits;
+  long end=ftell(fp);
+  fseek(fp,0,SEEK_SET);
+  fwrite(&h,sizeof(h),1,fp);
+  fseek(fp,end,SEEK_SET);
+}
+
+/* Adds an event of n hits (n at most NDET), writing the chunk first if they would not fit */
+inline void hcevent(HCHits &w,FILE *fp,Int_t tac,Int_t n,const UChar_t *det,
+		    const UShort_t *e,const UShort_t *xf,const UShort_t *xn)
+{
+  if(w.nhits+n>HCHITS) hcflush(w,fp);
+  w.nhit[w.nevents]=n;
+  w.tac[w.nevents]=tac;
+  w.nevents++;
+  memcpy(w.det+w.nhits,det,n);
+  memcpy(w.e+w.nhits,e,n*sizeof(UShort_t));
+  memcpy(w.xf+w.nhits,xf,n*sizeof(UShort_t));
+  memcpy(w.xn+w.nhits,xn,n*sizeof(UShort_t));
+  w.nhits+=n;
+}
+
+inline UInt_t hcmagic(const void *rec)
+{
+  UInt_t magic;
+  memcpy(&magic,(const char*)rec+sizeof(UInt_t),sizeof(magic));
+  return magic;
+}
+
+inline Bool_t hcisheader(const void *rec)
+{
+  return hcmagic(rec)==HCMAGIC;
+}
+
+/* Checks a cache's header record against the settings of this sort.  Returns 0 if the
+ * cache holds the hits this sort would select, after saying why not otherwise.
+ */
+inline Int_t hcmatch(const void *rec,const HCHeader &hc)
+{
+  HCHeader h;
+  if(!hcisheader(rec)){
+    printf("Not a hit cache.\n");
+    return 1;
+  }
+  if(((const HCHeader*)rec)->len!=sizeof(h)){
+    printf("Hit cache from an older sort, without the record of its run.  Resort the raw events.\n");
+    return 1;
+  }
+  memcpy(&h,rec,sizeof(h));
+  if(h.done!=HCDONE){
+    printf("Hit cache not finished: its sort crashed or was stopped.  Resort the raw events.\n");
+    return 1;
+  }
+  if(h.lowthr!=hc.lowthr||h.minTime!=hc.minTime){
+    printf("Hit cache made with thresholds %d,%d; this sort uses %d,%d.  Resort the raw events.\n",
+	   h.lowthr,h.minTime,hc.lowthr,hc.minTime);
+    return 1;
+  }
+  if((h.mask&hc.mask)!=hc.mask){
+    printf("Hit cache made with detector mask %06x, without some of %06x.  Resort the raw events.\n",
+	   h.mask,hc.mask);
+    return 1;
+  }
+  if(h.wiring!=hc.wiring){
+    printf("Hit cache made with another channel map.  Resort the raw events.\n");
+    return 1;
+  }
+  if(hcsourcesmatch(h)) return 1;
+  if(h.nsource>0) printf("Hit cache of %s%s: %lld events, %lld hits\n",h.source[0].name,
+			 h.nsource>1 ? " and more" : "",h.nevents,h.nhits);
+  else printf("Hit cache made online, its event files not named: %lld events, %lld hits\n",
+	      h.nevents,h.nhits);
+  return 0;
+}
+
+/* Unpacks a chunk into w.  Returns 0 if rec is a whole chunk whose events' hits add up
+ * to its hits, at most HCDETS an event, all of detectors below HCDETS, so they may
+ * index the sort's tables.
+ */
+inline Int_t hcdecode(const void *rec,HCHits &w)
+{
+  HCChunk c;
+  memcpy(&c,rec,sizeof(c));
+  Bool_t bad=(c.magic!=HCCHUNK||c.nevents>HCHITS||c.nhits>HCHITS||
+	      c.len<hcchunklen(c.nevents,c.nhits));
+  if(!bad){
+    w.nevents=c.nevents;
+    w.nhits=c.nhits;
+    const UChar_t *p=(const UChar_t*)rec+sizeof(c);
+    memcpy(w.nhit,p,w.nevents);
+    p+=w.nevents;
+    p=hcunpack12(p,w.tac,w.nevents);
+    memcpy(w.det,p,w.nhits);
+    p+=w.nhits;
+    p=hcunpack12(p,w.e,w.nhits);
+    p=hcunpack12(p,w.xf,w.nhits);
+    p=hcunpack12(p,w.xn,w.nhits);
+    Int_t n=0;
+    for(Int_t k=0;k<w.nevents;k++){
+      n+=w.nhit[k];
+      if(w.nhit[k]>HCDETS) bad=kTRUE; //a detector hit twice
+    }
+    if(n!=w.nhits) bad=kTRUE;
+    for(Int_t j=0;j<w.nhits&&!bad;j++) bad=(w.det[j]>=HCDETS);
+  }
+  if(bad){
+    printf("Bad hit cache chunk.  Skipped.\n");
+    w.nevents=w.nhits=0;
+    return 1;
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,81 @@
+/* Program: helios_kin.h
+ * Purpose:
+ *       Non-relativistic HELIOS kinematics for a light particle detected on the
+ *       array, from its lab energy e (MeV) and its position Z (mm) along the
+ *       magnet axis.  The unit conversions and products of the physical
+ *       constants are folded once by kinbuild(), so kinematics() costs one
+ *       sqrt(), one acos() and two divisions per hit.
+ *
+ * Usage:
+ *       KinConst Kin;
+ *       kinbuild(Kin,mass,MeV,Vcm,Tcyc,slopeEcm,intercepts[0],29.984/28.976); //in userentry()
+ *       KinHit k;
+ *       kinematics(Kin,e,Z,k);                                               //per hit
+ *
+ *       With u=Z/Tcyc the lab velocity along the axis, the CoM velocity is
+ *       V0^2=V^2+Vcm^2-2*Vcm*u and cos(180-theta)=(u-Vcm)/V0.  The "non-recursive"
+ *       form (V^2-V0^2-Vcm^2)/(2*V0*Vcm) the sorts used for theta reduces to the
+ *       same expression, so theta is evaluated once.
+ */
+#ifndef HELIOS_KIN_H
+#define HELIOS_KIN_H
+
+#include <cmath>
+
+struct KinConst {
+  Float_t slopeEcm;  //slope of the kinematic lines in hEZ, MeV/mm
+  Float_t invslope;  //1/slopeEcm
+  Float_t b;         //ground-state intercept of the kinematic line, MeV
+  Float_t Qscale;    //(b-E) to excitation energy
+  Float_t kV2;       //lab V^2 per MeV, (m/s)^2
+  Float_t Vcm,Vcm2;  //centre-of-mass velocity, m/s
+  Float_t ku;        //axial lab velocity per mm of Z, m/s
+  Float_t kEcm;      //MeV per (m/s)^2, 1/2*mass/MeV
+  Float_t Tcyc;      //cyclotron period, ns
+  Float_t deg;       //degrees per radian
+};
+
+struct KinHit {
+  Float_t E;     //energy at 90deg in the lab, MeV
+  Float_t Q;     //excitation energy, MeV
+  Float_t Z0;    //beam-axis intercept of the kinematic line through (Z,e), mm
+  Float_t TOF;   //time of flight, ns
+  Float_t V0;    //velocity in the CoM frame, m/s
+  Float_t Ecm;   //1/2*m*(V0^2-Vcm^2), MeV
+  Float_t theta; //CoM angle, degrees
+};
+
+inline void kinbuild(KinConst &k,Float_t mass,Float_t MeV,Float_t Vcm,Float_t Tcyc,
+		     Float_t slopeEcm,Float_t b,Float_t Qscale)
+{
+  k.slopeEcm=slopeEcm;
+  k.invslope=1/slopeEcm;
+  k.b=b;
+  k.Qscale=Qscale;
+  k.kV2=2*MeV/mass;
+  k.Vcm=Vcm;
+  k.Vcm2=Vcm*Vcm;
+  k.ku=1/(1000*Tcyc*1E-9);
+  k.kEcm=1/2.0*mass/MeV;
+  k.Tcyc=Tcyc;
+  k.deg=180/(4.0*atan(1.0));
+}
+
+/* Evaluates the kinematics of one hit.  A negative energy has no lab velocity and
+ * gives NaN for V0, Ecm and theta, as sqrt() of it did before the constants were folded.
+ */
+inline void kinematics(const KinConst &k,Float_t e,Float_t Z,KinHit &h)
+{
+  h.E=e-k.slopeEcm*Z;
+  h.Q=(k.b-h.E)*k.Qscale;
+  h.Z0=(e-k.b)*k.invslope;
+  h.TOF=k.Tcyc*Z/h.Z0;
+
+  Float_t u=Z*k.ku;
+  Float_t V02=(e<0) ? NAN : e*k.kV2+k.Vcm2-2*k.Vcm*u;
+  h.V0=sqrt(V02);
+  h.Ecm=k.kEcm*(h.V0*h.V0-k.Vcm2); //NaN with V0 when V0^2<0
+  h.theta=180-acos((u-k.Vcm)/h.V0)*k.deg;
+}
+
+#endif
@@ -0,0 +1,343 @@
+/* Program: helios_microbench.cxx
+ * Purpose:
+ *       Stand-alone timing of the hot spots in the HELIOS sort programs, run
+ *       outside daphne so changes to the per-event code can be compared on the
+ *       same input.
+ *
+ * Build:
+ *       g++ -O2 -march=native -o helios_microbench helios_microbench.cxx `root-config --cflags --libs`
+ *
+ * Usage:
+ *       helios_microbench hitpattern [hitpattern.dat]
+ *           old cntbit() (TMath::Power per bit) against the popcount/bit-scan
+ *           walk in helios_unpack.h.  hitpattern.dat is written by a sort built
+ *           with -DHELIOS_DUMPHITS ("adc pattern" per line, pattern in hex); with
+ *           no file a synthetic pattern set is generated.
+ *
+ *       helios_microbench kinematics
+ *           per-hit energy correction, weighting polynomial and kinematics of
+ *           helios_sort_Si28.cxx, as written with pow()/sqrt()/acos() on every hit
+ *           against the folded constants and fused kernel of helios_kin.h, on
+ *           synthetic hits spread over the array.
+ *
+ *       helios_microbench gate
+ *           exact polygon test of a dense EZ gate (a band along the ground-state
+ *           kinematic line) against the rasterised lookup of helios_cuts.h, on
+ *           an EZ distribution of smeared kinematic lines and flat background.
+ *           Every hit is checked to get the same answer from both.
+ *
+ *       helios_microbench chanbin
+ *           binning and filling of raw 12-bit channels on the hADC axes (1024 bins over
+ *           0..4096, 16 rows) by the TAxis::FindBin() arithmetic against the
+ *           shift of helios_hist.h for a channel-aligned axis.  Every channel is
+ *           checked to land in the same bin.
+ */
+
+// Header Files
+using namespace std;
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include "TH2.h"
+#include "TMath.h"
+#include "helios_unpack.h"
+#include "helios_kin.h"
+#include "helios_cuts.h"
+#include "helios_hist.h"
+
+Int_t nRepeat=20; //passes over the pattern set per timing
+
+/* timer in ns since an arbitrary start */
+Double_t nsnow()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+/* cntbit() as it was in the sort files before helios_unpack.h */
+Int_t cntbit_old(Int_t word)
+{
+  Int_t nbits=0;
+  for (Int_t ibit=0; ibit<16; ibit++) {
+    if (word & (Int_t) TMath::Power(2,ibit)) {nbits++;}
+  }
+  return nbits;
+}
+
+/* Reads recorded hit patterns, or makes a synthetic set in which each of the
+ * 16 channels fires with the occupancy of a typical array event.
+ */
+Int_t loadpatterns(const char *file,vector<UInt_t> &words)
+{
+  if(file){
+    FILE *in=fopen(file,"r");
+    if(!in){
+      printf("Cannot open hit pattern file \"%s\"\n",file);
+      return 1;
+    }
+    Int_t nadc;
+    UInt_t pattern;
+    while(fscanf(in,"%d %x",&nadc,&pattern)==2) words.push_back(pattern);
+    fclose(in);
+    printf("Read %d recorded hit patterns from %s\n",(Int_t)words.size(),file);
+  }
+  else{
+    srand(12345);
+    for(Int_t n=0;n<1000000;n++){
+      UInt_t pattern=0;
+      for(Int_t chan=0;chan<NCHAN;chan++)
+	if(rand()%100<12) pattern|=(1<<chan);
+      words.push_back(pattern);
+    }
+    printf("Generated %d synthetic hit patterns (12%% channel occupancy)\n",(Int_t)words.size());
+  }
+  return words.empty();
+}
+
+int benchhitpattern(const char *file)
+{
+  vector<UInt_t> words;
+  if(loadpatterns(file,words)) return 1;
+  Int_t nwords=words.size();
+
+  Long64_t nhits=0;
+  for(Int_t n=0;n<nwords;n++) nhits+=cntbit(words[n]);
+  printf("Mean multiplicity: %5.2f hits per ADC\n",(Double_t)nhits/nwords);
+
+  //Counting only
+  Long64_t sum=0;
+  Double_t t0=nsnow();
+  for(Int_t r=0;r<nRepeat;r++)
+    for(Int_t n=0;n<nwords;n++) sum+=cntbit_old(words[n]);
+  Double_t told=(nsnow()-t0)/nRepeat/nwords;
+  t0=nsnow();
+  for(Int_t r=0;r<nRepeat;r++)
+    for(Int_t n=0;n<nwords;n++) sum-=cntbit(words[n]);
+  Double_t tnew=(nsnow()-t0)/nRepeat/nwords;
+  printf("count   old cntbit(): %7.2f ns/word   popcount: %7.2f ns/word   (x%.1f)%s\n",
+	 told,tnew,told/tnew,sum ? "  MISMATCH" : "");
+
+  //Counting plus visiting each hit channel, as in the userdecode() hit loop
+  Long64_t chold=0,chnew=0;
+  t0=nsnow();
+  for(Int_t r=0;r<nRepeat;r++)
+    for(Int_t n=0;n<nwords;n++){
+      Int_t nh=cntbit_old(words[n]);
+      for(Int_t ibit=0,i=0;i<nh&&ibit<16;ibit++)
+	if(words[n] & (Int_t) TMath::Power(2,ibit)){chold+=ibit;i++;}
+    }
+  told=(nsnow()-t0)/nRepeat/nhits;
+  t0=nsnow();
+  for(Int_t r=0;r<nRepeat;r++)
+    for(Int_t n=0;n<nwords;n++){
+      UInt_t pattern=words[n];
+      while(pattern) chnew+=nextbit(pattern);
+    }
+  tnew=(nsnow()-t0)/nRepeat/nhits;
+  printf("walk    old cntbit(): %7.2f ns/hit    bit-scan: %7.2f ns/hit    (x%.1f)%s\n",
+	 told,tnew,told/tnew,chold!=chnew ? "  MISMATCH" : "");
+  return 0;
+}
+
+//Si28 set-up used by the kinematics benchmark
+Float_t MeV=1.602E-13;
+Float_t mass=1*1.673E-27;
+Float_t Vcm=3.174E7;
+Float_t Tcyc=34.246;
+Float_t slopeEcm=((mass*Vcm)/(Tcyc*1E-9))/MeV/1000+.000413;
+Float_t b0=11.672;
+Float_t ex19=0.8,ex20=-1.6;  //hEX X-Profile fit, p1 and p2
+Float_t effic[10]={950,120,-340,60,25,-8,1.5,-0.2,0.01,0.0005};
+Float_t p0av=900;
+
+struct KinOld {Float_t e,weight,E,Q,Z0,TOF,V0,Ecm,theta,theta2;};
+
+/* The per-hit block as it was in helios_sort_Si28.cxx userdecode() */
+void kinematics_old(Float_t e,Float_t x,Float_t Z,KinOld &k)
+{
+  Float_t pi=4.0*atan(1.0);
+  e=e-ex20*pow(x+(ex19/(2*ex20)),2);
+  Float_t weight=0;
+  for(Int_t j=0;j<10;j++) weight=weight+effic[j]*pow(x,j);
+  k.weight=(p0av/weight)*((Float_t)3/4);
+  k.E=e-slopeEcm*Z;
+  k.Q=(b0-k.E)*(29.984/28.976);
+  Float_t V=sqrt(2*e*MeV/mass);
+  k.Z0=(e-b0)/slopeEcm;
+  k.TOF=Tcyc*Z/k.Z0;
+  k.V0=sqrt((V*V)+(Vcm*Vcm)-(2*Vcm*(Z/1000)/(Tcyc*1E-9)));
+  k.Ecm=(1/2.0*mass*(k.V0*k.V0-Vcm*Vcm))/MeV;
+  k.theta =180-(acos((V*V-k.V0*k.V0-Vcm*Vcm)/(2*k.V0*Vcm)) )/pi*180;
+  k.theta2=180-(acos(((Z /1000)/(Tcyc*1E-9)-Vcm)/k.V0 ))/pi*180;
+  k.e=e;
+}
+
+int benchkinematics()
+{
+  Int_t nhits=1000000;
+  vector<Float_t> es(nhits),xs(nhits),Zs(nhits);
+  srand(12345);
+  for(Int_t n=0;n<nhits;n++){
+    xs[n]=rand()/(Double_t)RAND_MAX;
+    Zs[n]=-560+rand()/(Double_t)RAND_MAX*350+50*xs[n];
+    es[n]=b0+slopeEcm*Zs[n]-rand()/(Double_t)RAND_MAX*5; //between the ground state and 5 MeV
+  }
+
+  KinConst kc;
+  kinbuild(kc,mass,MeV,Vcm,Tcyc,slopeEcm,b0,29.984/28.976);
+  Float_t exvertex=ex19/(2*ex20);
+  Double_t poly[10];
+  for(Int_t j=0;j<10;j++) poly[j]=effic[j];
+  Float_t wnorm=p0av*((Float_t)3/4);
+
+  KinOld ko;
+  KinHit kn;
+  Double_t sumold=0,sumnew=0,maxdiff=0;
+  Double_t t0=nsnow();
+  for(Int_t r=0;r<nRepeat;r++)
+    for(Int_t n=0;n<nhits;n++){
+      kinematics_old(es[n],xs[n],Zs[n],ko);
+      if(ko.theta==ko.theta) sumold+=ko.E+ko.Q+ko.TOF+ko.Ecm+ko.theta+ko.theta2+ko.weight;
+    }
+  Double_t told=(nsnow()-t0)/nRepeat/nhits;
+  t0=nsnow();
+  for(Int_t r=0;r<nRepeat;r++)
+    for(Int_t n=0;n<nhits;n++){
+      Float_t x=xs[n],dx=x+exvertex;
+      Float_t e=es[n]-ex20*dx*dx;
+      Double_t p=poly[9];
+      for(Int_t j=8;j>=0;j--) p=p*x+poly[j];
+      Float_t weight=wnorm/p;
+      kinematics(kc,e,Zs[n],kn);
+      if(kn.theta==kn.theta) sumnew+=kn.E+kn.Q+kn.TOF+kn.Ecm+kn.theta+kn.theta+weight;
+    }
+  Double_t tnew=(nsnow()-t0)/nRepeat/nhits;
+
+  //agreement, hit by hit; hits off the kinematic cone give NaN angles in both
+  Int_t nnan=0;
+  for(Int_t n=0;n<nhits;n++){
+    kinematics_old(es[n],xs[n],Zs[n],ko);
+    Float_t x=xs[n],dx=x+exvertex;
+    kinematics(kc,es[n]-ex20*dx*dx,Zs[n],kn);
+    if(kn.theta!=kn.theta||ko.theta!=ko.theta){
+      nnan+=((kn.theta!=kn.theta)!=(ko.theta!=ko.theta)); //NaN in only one of the two
+      continue;
+    }
+    Double_t d=fabs(kn.Ecm-ko.Ecm);
+    if(fabs(kn.theta-ko.theta)>d) d=fabs(kn.theta-ko.theta);
+    if(fabs(kn.theta-ko.theta2)>d) d=fabs(kn.theta-ko.theta2);
+    if(fabs(kn.Q-ko.Q)>d) d=fabs(kn.Q-ko.Q);
+    if(d>maxdiff) maxdiff=d;
+  }
+  printf("kinematics  old: %7.2f ns/hit   folded: %7.2f ns/hit   (x%.1f)\n",told,tnew,told/tnew);
+  printf("            largest difference in Q, Ecm (MeV) or theta (deg): %.2g   (checksums %.6g %.6g)%s\n",
+	 maxdiff,sumold,sumnew,nnan ? "  NaN MISMATCH" : "");
+  return 0;
+}
+
+int benchgate()
+{
+  //a 60-point band +/-0.25 MeV about the ground-state line, edges wavy as when drawn by hand
+  Int_t nside=30;
+  Double_t gx[60],gy[60];
+  for(Int_t k=0;k<nside;k++){
+    Double_t z=-580+400.0*k/(nside-1);
+    gx[k]=z;
+    gy[k]=b0+slopeEcm*z+0.25+0.03*sin(k*1.7);
+    gx[2*nside-1-k]=z;
+    gy[2*nside-1-k]=b0+slopeEcm*z-0.25-0.03*cos(k*2.3);
+  }
+  Gate exact,raster;
+  gatesetpoints(exact,"cEZ",2*nside,gx,gy);
+  gatesetpoints(raster,"cEZ",2*nside,gx,gy);
+  gateraster(raster,512,-1000,0,512,0,12); //hEZ binning of the 3a and O19 sorts
+
+  //hits: ground state and three excited states smeared by 80 keV, plus 20% flat background
+  Int_t nhits=1000000;
+  Float_t states[4]={0,1.273,2.028,3.067};
+  vector<Float_t> zs(nhits),es(nhits);
+  srand(12345);
+  for(Int_t n=0;n<nhits;n++){
+    Double_t r=rand()/(Double_t)RAND_MAX;
+    zs[n]=-580+400*(rand()/(Double_t)RAND_MAX);
+    if(r<0.2) es[n]=12*(rand()/(Double_t)RAND_MAX);
+    else{
+      Double_t g=0;
+      for(Int_t k=0;k<12;k++) g+=rand()/(Double_t)RAND_MAX;
+      es[n]=b0+slopeEcm*zs[n]-states[rand()%4]+0.08*(g-6);
+    }
+  }
+
+  Long64_t nold=0,nnew=0;
+  Double_t t0=nsnow();
+  for(Int_t r=0;r<nRepeat;r++)
+    for(Int_t n=0;n<nhits;n++) nold+=gateinside(exact,zs[n],es[n]);
+  Double_t told=(nsnow()-t0)/nRepeat/nhits;
+  t0=nsnow();
+  for(Int_t r=0;r<nRepeat;r++)
+    for(Int_t n=0;n<nhits;n++) nnew+=gateinside(raster,zs[n],es[n]);
+  Double_t tnew=(nsnow()-t0)/nRepeat/nhits;
+
+  Int_t nmismatch=0;
+  for(Int_t n=0;n<nhits;n++)
+    nmismatch+=(gateinside(exact,zs[n],es[n])!=gateinside(raster,zs[n],es[n]));
+  printf("gate        polygon: %7.2f ns/hit   raster: %7.2f ns/hit   (x%.1f)   %.1f%% inside, %d mismatches%s\n",
+	 told,tnew,told/tnew,100.0*nold/nRepeat/nhits,nmismatch,nold!=nnew ? "  MISMATCH" : "");
+  return 0;
+}
+
+int benchchanbin()
+{
+  HChan ax,ay;
+  hchaninit(ax,1024,0,4096);
+  hchaninit(ay,16,0,16);
+
+  //raw words as unpackarray() sees them: a 12-bit channel and a 4-bit ADC channel,
+  //few enough to stay in cache as one event's hits do
+  Int_t nhits=16384;
+  vector<Int_t> raw(nhits),chan(nhits);
+  srand(12345);
+  for(Int_t n=0;n<nhits;n++){
+    raw[n]=rand()&0xfff;
+    chan[n]=rand()&0xf;
+  }
+
+  //each bin pair is a cell of the hADC fill, as the fill in the sort increments it
+  Int_t nrep=nRepeat*50;
+  Int_t ncells=1026*18;
+  vector<UInt_t> cold(ncells),cnew(ncells);
+  Double_t t0=nsnow();
+  for(Int_t r=0;r<nrep;r++)
+    for(Int_t n=0;n<nhits;n++)
+      cold[hfindbin(chan[n],ay.v0,ay.v1,ay.n)*1026+hfindbin(raw[n],ax.v0,ax.v1,ax.n)]++;
+  Double_t told=(nsnow()-t0)/nrep/nhits;
+  t0=nsnow();
+  for(Int_t r=0;r<nrep;r++)
+    for(Int_t n=0;n<nhits;n++)
+      cnew[hchanbin(ay,chan[n])*1026+hchanbin(ax,raw[n])]++;
+  Double_t tnew=(nsnow()-t0)/nrep/nhits;
+
+  Int_t nmismatch=0;
+  for(Int_t c=-100;c<5000;c++)
+    nmismatch+=(hchanbin(ax,c)!=hfindbin(c,0,4096,1024))+(hchanbin(ay,c)!=hfindbin(c,0,16,16));
+  printf("chanbin     FindBin: %7.2f ns/hit   shift: %7.2f ns/hit   (x%.1f)   %d mismatches%s\n",
+	 told,tnew,told/tnew,nmismatch,cold!=cnew ? "  MISMATCH" : "");
+  return 0;
+}
+
+int main(int argc,char **argv)
+{
+  if(argc<2){
+    printf("Usage: %s hitpattern [hitpattern.dat] | kinematics | gate | chanbin\n",argv[0]);
+    return 1;
+  }
+  if(!strcmp(argv[1],"hitpattern")) return benchhitpattern(argc>2 ? argv[2] : 0);
+  if(!strcmp(argv[1],"kinematics")) return benchkinematics();
+  if(!strcmp(argv[1],"gate")) return benchgate();
+  if(!strcmp(argv[1],"chanbin")) return benchchanbin();
+  printf("Unknown benchmark \"%s\"\n",argv[1]);
+  return 1;
+}
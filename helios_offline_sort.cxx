@@ -0,0 +1,329 @@
+/* Program: helios_offline_sort.cxx
+ * Purpose:
+ *       Stand-alone driver that sorts recorded event files through a sort's
+ *       userentry()/userfunc()/userexit() on several cores.  The files are mapped
+ *       (see helios_evfile.h) and triggered events are handed out, as pointers to
+ *       their records in the mapping, in batches, round robin, to worker threads
+ *       which each fill
+ *       private shards of the histograms (see helios_hist.h); the shards are added
+ *       into the histograms booked by userentry() when the run stops.  Sync and stop
+ *       events are handled on the main thread in file order, so scaler output is
+ *       the same as in daphne.
+ *
+ *       The sort must be built with -DHELIOS_THREADS and provide
+ *           int userthread();  //book this thread's histograms (see helios_hist.h)
+ *           int usermerge();   //add them into the master set
+ *       as helios_sort_Si28.cxx does.  Built also with -DHELIOS_BATCH, a worker hands each
+ *       batch to the sort's
+ *           int userbatch(const ScarletEvntHdr **h,Int_t n);  //sort n triggered events
+ *       in one call instead of calling userfunc() per event.  Built with -DHELIOS_HITCACHE,
+ *       a file that is a hit cache (see helios_hitcache.h) is sorted by handing its
+ *       chunks out the same way to the sort's
+ *           int userhits(const ScarletEvntHdr **h,Int_t n);   //sort n cache records
+ *       which is first called on the main thread with the cache's header alone and
+ *       returns non-zero if the cache does not fit the sort, which skips the file.
+ *       The files are given to hcsource() before userentry(), so a cache the sort
+ *       writes is named after the run and records the event files it came from.
+ *
+ * Build:
+ *       g++ -O2 -DHELIOS_THREADS -o helios_offline_Si28 helios_offline_sort.cxx helios_sort_Si28.cxx \
+ *           `root-config --cflags --libs` -lScarletEvnt -lpthread
+ *       or, for the block calibration (vectorised at -O3 for the host's instruction set),
+ *       g++ -O3 -march=native -DHELIOS_THREADS -DHELIOS_BATCH -DHELIOS_HITCACHE -o helios_offline_Si28 ...
+ *
+ * Usage:
+ *       helios_offline_Si28 [-j nthreads] [-H] [-R] run.evt|run.hits [...]
+ *           -j 0 sorts on the main thread only, as daphne does.
+ *           -H asks for huge pages behind the mapped files.
+ *           -R reads the files instead of mapping them; events are then copied
+ *              into their batches.
+ */
+
+// Header Files
+using namespace std;
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <pthread.h>
+#include "daphuserfunc.h"
+#include "ScarletEvnt.h"
+#include "TROOT.h"
+#include "helios_evfile.h"
+#include "helios_hitcache.h"
+
+int userthread();
+int usermerge();
+#ifdef HELIOS_BATCH
+int userbatch(const struct ScarletEvntHdr **h,Int_t n);
+#endif
+#ifdef HELIOS_HITCACHE
+int userhits(const struct ScarletEvntHdr **h,Int_t n);
+#endif
+
+#define BATCHEVENTS 256     //triggered events per batch
+#define BATCHBYTES  (1<<18) //bytes reserved per batch of copied events; a longer event gets a batch of its own
+#define QUEUEDEPTH  8       //batches waiting per worker before the reader blocks
+
+struct Batch {
+  const ScarletEvntHdr *hdr[BATCHEVENTS]; //the events, in file order
+  char *data;   //copies of events from a file that is read, back to back; 0 if none
+  UInt_t size;
+  UInt_t used;
+  Int_t nevents;
+  Bool_t hits;  //records of a hit cache, not events
+  Batch *next;
+};
+
+struct Worker {
+  pthread_t tid;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  Batch *head,*tail;
+  Int_t depth;   //batches queued
+  Int_t done;    //no more batches after the queued ones
+  Long64_t nevents;
+};
+
+Int_t nWorkers=0;
+Worker *workers;
+Int_t running=0;   //workers started and not yet joined
+Int_t nextworker=0;
+Batch *filling=0;  //batch being built by the reader
+pthread_mutex_t sortlock=PTHREAD_MUTEX_INITIALIZER; //serialises userthread()/usermerge()
+
+Batch *newbatch()
+{
+  Batch *b=new Batch;
+  b->data=0;
+  b->size=0;
+  b->used=0;
+  b->nevents=0;
+  b->hits=kFALSE;
+  b->next=0;
+  return b;
+}
+
+void freebatch(Batch *b)
+{
+  free(b->data);
+  delete b;
+}
+
+/* Worker thread: books its histograms, sorts batches until told to stop, then
+ * merges into the master set.
+ */
+void *sortworker(void *arg)
+{
+  Worker *w=(Worker*)arg;
+  pthread_mutex_lock(&sortlock);
+  userthread();
+  pthread_mutex_unlock(&sortlock);
+
+  for(;;){
+    pthread_mutex_lock(&w->lock);
+    while(!w->head&&!w->done) pthread_cond_wait(&w->cond,&w->lock);
+    Batch *b=w->head;
+    if(b){
+      w->head=b->next;
+      if(!w->head) w->tail=0;
+      w->depth--;
+      pthread_cond_signal(&w->cond); //room for the reader
+    }
+    pthread_mutex_unlock(&w->lock);
+    if(!b) break;
+
+#ifdef HELIOS_HITCACHE
+    if(b->hits) userhits(b->hdr,b->nevents);
+    else
+#endif
+#ifdef HELIOS_BATCH
+    userbatch(b->hdr,b->nevents);
+#else
+    for(Int_t n=0;n<b->nevents;n++) userfunc(b->hdr[n]);
+#endif
+    w->nevents+=b->nevents;
+    freebatch(b);
+  }
+
+  pthread_mutex_lock(&sortlock);
+  usermerge();
+  pthread_mutex_unlock(&sortlock);
+  return 0;
+}
+
+void startworkers()
+{
+  for(Int_t n=0;n<nWorkers;n++){
+    Worker *w=&workers[n];
+    pthread_mutex_init(&w->lock,0);
+    pthread_cond_init(&w->cond,0);
+    w->head=w->tail=0;
+    w->depth=0;
+    w->done=0;
+    pthread_create(&w->tid,0,sortworker,w);
+  }
+  running=1;
+}
+
+/* Queues a batch on the next worker, waiting while its queue is full */
+void sendbatch(Batch *b)
+{
+  Worker *w=&workers[nextworker];
+  nextworker=(nextworker+1)%nWorkers;
+  pthread_mutex_lock(&w->lock);
+  while(w->depth>=QUEUEDEPTH) pthread_cond_wait(&w->cond,&w->lock);
+  if(w->tail) w->tail->next=b;
+  else w->head=b;
+  w->tail=b;
+  w->depth++;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+}
+
+/* Sends the partly filled batch, lets the workers finish their queues and waits
+ * for them to merge.  Afterwards the master histograms hold every event so far.
+ */
+void stopworkers()
+{
+  if(!running) return;
+  if(filling&&filling->nevents) sendbatch(filling);
+  else if(filling) freebatch(filling);
+  filling=0;
+  for(Int_t n=0;n<nWorkers;n++){
+    Worker *w=&workers[n];
+    pthread_mutex_lock(&w->lock);
+    w->done=1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+  }
+  for(Int_t n=0;n<nWorkers;n++){
+    pthread_join(workers[n].tid,0);
+    pthread_mutex_destroy(&workers[n].lock);
+    pthread_cond_destroy(&workers[n].cond);
+  }
+  running=0;
+}
+
+/* Adds a triggered event to the current batch, sending the batch when full.  An
+ * event from a mapped file stays where it is; one from a file that is read is
+ * only valid until the next is read, so it is copied.
+ */
+void dispatch(const ScarletEvntHdr *h,Bool_t copy,Bool_t hits)
+{
+  UInt_t len=evntlength(h);
+  if(!running) startworkers();
+  if(filling&&(filling->nevents>=BATCHEVENTS||filling->hits!=hits||
+	       (copy&&filling->data&&filling->used+len>filling->size))){
+    sendbatch(filling);
+    filling=0;
+  }
+  if(!filling){
+    filling=newbatch();
+    filling->hits=hits;
+  }
+  if(copy){
+    if(!filling->data){
+      filling->size=len>BATCHBYTES ? len : BATCHBYTES;
+      filling->data=(char*)malloc(filling->size);
+    }
+    memcpy(filling->data+filling->used,h,len);
+    h=reinterpret_cast<const ScarletEvntHdr*>(filling->data+filling->used);
+    filling->used+=len;
+  }
+  filling->hdr[filling->nevents++]=h;
+}
+
+Double_t secnow()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+int main(int argc,char **argv)
+{
+  nWorkers=sysconf(_SC_NPROCESSORS_ONLN)-1; //the main thread reads the file
+  Int_t opt,evflags=0;
+  while((opt=getopt(argc,argv,"j:HR"))!=-1){
+    if(opt=='j') nWorkers=atoi(optarg);
+    else if(opt=='H') evflags|=EVHUGE;
+    else if(opt=='R') evflags|=EVREAD;
+    else{
+      printf("Usage: %s [-j nthreads] [-H] [-R] run.evt [run.evt ...]\n",argv[0]);
+      return 1;
+    }
+  }
+  if(optind>=argc){
+    printf("Usage: %s [-j nthreads] [-H] [-R] run.evt [run.evt ...]\n",argv[0]);
+    return 1;
+  }
+  if(nWorkers<0) nWorkers=0;
+  workers=new Worker[nWorkers>0 ? nWorkers : 1];
+  for(Int_t n=0;n<nWorkers;n++) workers[n].nevents=0;
+
+  if(nWorkers) ROOT::EnableThreadSafety();
+  for(Int_t arg=optind;arg<argc;arg++) hcsource(argv[arg]); //named in the hit cache a sort writes
+  if(userentry()){
+    printf("userentry() failed.  Nothing sorted.\n");
+    return 1;
+  }
+  printf("Sorting with %d worker thread%s\n",nWorkers,nWorkers==1 ? "" : "s");
+
+  Double_t t0=secnow();
+  Long64_t nevents=0,nbytes=0,ntriggered=0;
+  ScarletEvnt event;
+  EvFile *files=new EvFile[argc];
+  Int_t nfiles=0;
+  for(Int_t arg=optind;arg<argc;arg++){
+    EvFile &ev=files[nfiles];
+    if(evopen(ev,argv[arg],evflags)) continue;
+    nfiles++;
+    Bool_t copy=(ev.map==0);
+#ifdef HELIOS_HITCACHE
+    Bool_t hits=kFALSE; //the file is a hit cache
+#endif
+    const ScarletEvntHdr *h;
+    while((h=evnext(ev))){
+#ifdef HELIOS_HITCACHE
+      if(ev.nevents==1&&hcisheader(h)){
+	if(userhits(&h,1)) break;
+	printf("%s is a hit cache\n",argv[arg]);
+	hits=kTRUE;
+	continue;
+      }
+      if(hits){
+	if(nWorkers) dispatch(h,copy,kTRUE);
+	else userhits(&h,1);
+	continue;
+      }
+#endif
+      event=h;
+      if(event.eventtype()==SE_TYPE_TRIGGERED){
+	ntriggered++;
+	if(nWorkers){
+	  dispatch(h,copy,kFALSE);
+	  continue;
+	}
+      }
+      else if(event.eventtype()==SE_TYPE_STOP) stopworkers(); //run totals complete before the stop
+      userfunc(h);
+    }
+    nevents+=ev.nevents;
+    nbytes+=ev.nbytes;
+    if(copy) evclose(ev);
+  }
+  stopworkers();
+  for(Int_t n=0;n<nfiles;n++) evclose(files[n]); //mapped files stay open until the workers are done with them
+  delete[] files;
+  Double_t t=secnow()-t0;
+
+  printf("%lld events (%lld triggered), %.1f MB in %.2f s: %.0f events/s, %.1f MB/s\n",
+	 nevents,ntriggered,nbytes/1e6,t,nevents/t,nbytes/1e6/t);
+  for(Int_t n=0;n<nWorkers;n++)
+    printf("  thread %2d: %lld events\n",n,workers[n].nevents);
+  userexit();
+  delete[] workers;
+  return 0;
+}
@@ -0,0 +1,189 @@
+/* Program: helios_prof.h
+ * Purpose:
+ *       Hot-path timing of a sort: where the time of userdecode() and scalers() goes,
+ *       between unpacking, calibration, kinematics, gate tests and histogram filling.
+ *       Compiled in only with -DHELIOS_PROF; otherwise the macros below are empty and
+ *       the sort is as it was.
+ *
+ *       PROF(s) starts a scoped timer on stage s: the time stamp counter is read when
+ *       it is made and when it goes out of scope, and the cycles between are added to
+ *       the stage, with one call.  A stage is a number below PROFMAX named once with
+ *       profname(); stages may nest, so a stage's time includes any inside it.
+ *       PROFEVENT(type) times a whole event by its SCARLET type, and PROFDET(i) a hit
+ *       of detector i.  The counters are per sort thread (HTLS) and need no lock;
+ *       profmerge() adds a thread's into the totals, from usermerge() and userexit().
+ *
+ *       profreport() prints cycles and nanoseconds per call and each stage's share of
+ *       the event time.  Cycles are turned into time with the counter's rate, measured
+ *       against the monotonic clock between profinit() and the report.  A reading costs
+ *       some 20 cycles, which shows in the stages timed per hit.
+ *
+ * Usage:
+ *       #define PR_UNPACK 0                     //the sort's stages
+ *       profname(PR_UNPACK,"unpack");           //in userentry(), after profinit()
+ *       { PROF(PR_UNPACK); ... }                //times the block; one timer to a line
+ *       PROFEVENT(event.eventtype());           //at the top of userfunc()
+ *       PROFDET(i);                             //in the loop over the hits
+ *       profreport();                           //at SE_TYPE_STOP; threaded, in userexit() instead
+ */
+#ifndef HELIOS_PROF_H
+#define HELIOS_PROF_H
+
+#include "Rtypes.h"
+
+#ifdef HELIOS_PROF
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include "ScarletEvnt.h"
+#include "helios_hist.h"
+#if defined(__x86_64__)||defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define PROFMAX   16 //stages
+#define PROFOTHER 0  //event types timed: by proftype() from the SE_TYPE_ constants
+#define PROFTRIG  1
+#define PROFSYNC  2
+#define PROFSTOP  3
+#define PROFSTART 4
+#define PROFTYPES 5
+#define PROFDETS  24 //detectors
+
+struct ProfCount {
+  ULong64_t cycles,calls;
+};
+
+struct ProfData {
+  ProfCount stage[PROFMAX];
+  ProfCount type[PROFTYPES];
+  ProfCount det[PROFDETS];
+};
+
+HTLS ProfData Prof;           //this thread's counters
+ProfData ProfTotal;           //merged by profmerge()
+const char *ProfName[PROFMAX];
+ULong64_t ProfTsc0;           //counter and clock at profinit()
+Double_t ProfSec0;
+
+inline ULong64_t proftsc()
+{
+#if defined(__x86_64__)||defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (ULong64_t)ts.tv_sec*1000000000ull+ts.tv_nsec; //nanoseconds as cycles
+#endif
+}
+
+inline Double_t profclock()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec+1e-9*ts.tv_nsec;
+}
+
+struct ProfTimer {
+  ProfCount &c;
+  ULong64_t t0;
+  ProfTimer(ProfCount &c) : c(c), t0(proftsc()) {}
+  ~ProfTimer()
+  {
+    c.cycles+=proftsc()-t0;
+    c.calls++;
+  }
+};
+
+inline ProfCount &proftype(Int_t type)
+{
+  switch(type){
+  case SE_TYPE_TRIGGERED: return Prof.type[PROFTRIG];
+  case SE_TYPE_SYNC:      return Prof.type[PROFSYNC];
+  case SE_TYPE_STOP:      return Prof.type[PROFSTOP];
+  case SE_TYPE_START:     return Prof.type[PROFSTART];
+  default:                return Prof.type[PROFOTHER];
+  }
+}
+
+inline void profinit()
+{
+  memset(&Prof,0,sizeof(Prof));
+  memset(&ProfTotal,0,sizeof(ProfTotal));
+  memset(ProfName,0,sizeof(ProfName));
+  ProfTsc0=proftsc();
+  ProfSec0=profclock();
+}
+
+inline void profname(Int_t s,const char *name)
+{
+  if(s>=0&&s<PROFMAX) ProfName[s]=name;
+}
+
+inline void profadd(ProfCount *to,ProfCount *from,Int_t n)
+{
+  for(Int_t i=0;i<n;i++){
+    to[i].cycles+=from[i].cycles;
+    to[i].calls+=from[i].calls;
+    from[i].cycles=from[i].calls=0;
+  }
+}
+
+/* Adds this thread's counters into the totals and clears them; one thread at a time */
+inline void profmerge()
+{
+  profadd(ProfTotal.stage,Prof.stage,PROFMAX);
+  profadd(ProfTotal.type,Prof.type,PROFTYPES);
+  profadd(ProfTotal.det,Prof.det,PROFDETS);
+}
+
+inline void profline(const char *name,const ProfCount &c,Double_t ns,ULong64_t total)
+{
+  if(!c.calls) return;
+  printf("  %-14s %12llu calls %10.1f cycles %9.1f ns/call %6.1f%%\n",name,c.calls,
+	 (Double_t)c.cycles/c.calls,c.cycles*ns/c.calls,total ? 100.*c.cycles/total : 0.);
+}
+
+/* Prints the totals and this thread's counters, which are merged first */
+inline void profreport()
+{
+  static const char *types[PROFTYPES]={"other","triggered","sync","stop","start"};
+  profmerge();
+  Double_t sec=profclock()-ProfSec0;
+  ULong64_t tsc=proftsc()-ProfTsc0;
+  Double_t ns=tsc ? 1e9*sec/tsc : 0; //per cycle
+  ULong64_t total=0;
+  for(Int_t t=0;t<PROFTYPES;t++) total+=ProfTotal.type[t].cycles;
+  printf("Sort profile (%.2f GHz counter, %% of the time in events):\n",ns ? 1/ns : 0.);
+  printf(" by event type:\n");
+  for(Int_t t=0;t<PROFTYPES;t++) profline(types[t],ProfTotal.type[t],ns,total);
+  printf(" by stage:\n");
+  for(Int_t s=0;s<PROFMAX;s++) if(ProfName[s]) profline(ProfName[s],ProfTotal.stage[s],ns,total);
+  printf(" by detector (calls are hits):\n");
+  for(Int_t i=0;i<PROFDETS;i++){
+    char name[16];
+    snprintf(name,sizeof(name),"detector %d",i+1);
+    profline(name,ProfTotal.det[i],ns,total);
+  }
+}
+
+#define PROFCAT2(a,b) a##b
+#define PROFCAT(a,b) PROFCAT2(a,b)
+#define PROF(s)         ProfTimer PROFCAT(proftimer,__LINE__)(Prof.stage[s])
+#define PROFEVENT(type) ProfTimer PROFCAT(proftimer,__LINE__)(proftype(type))
+#define PROFDET(i)      ProfTimer PROFCAT(proftimer,__LINE__)(Prof.det[i])
+
+#else
+
+#define PROF(s)
+#define PROFEVENT(type)
+#define PROFDET(i)
+inline void profinit() {}
+inline void profname(Int_t,const char*) {}
+inline void profmerge() {}
+inline void profreport() {}
+
+#endif
+
+#endif
@@ -0,0 +1,388 @@
+/* Program: helios_scaler.h
+ * Purpose:
+ *       Scaler output off the sort thread.  scalers() used to open scalers.dat, print
+ *       the totals and rates and close it on every sync event, and stat() scalers.zap
+ *       after a stop, all in the thread that sorts the events; on a busy file server
+ *       that stalls the sort.  Now the sort thread only copies the sync event's counts
+ *       into a queue and returns.  A writer thread takes them off the queue, keeps the
+ *       totals, and writes the file.
+ *
+ *       The queue is a ring of SCQUEUE records with one writer (the sort thread) and
+ *       one reader (the writer thread), so it needs no lock: each side owns its own
+ *       index and publishes it with a release store.  A semaphore is posted for each
+ *       record, so the writer thread sleeps while there is nothing to write.  When the
+ *       queue is full the sort does not wait: the record is held back, and the counts
+ *       of any more sync events before there is room are added into it, so it goes on
+ *       the queue later covering all their time.  Only the file updates of the events
+ *       held back are lost, never their counts.
+ *
+ *       scalers.dat keeps its format (time, time difference, then total and rate per
+ *       channel), and is replaced whole: it is written to scalers.dat.tmp and renamed,
+ *       so a reader never sees half a file.  Each record is also appended as one line
+ *       to scalers.hist (time, time difference, then total and rate per channel, rates
+ *       in counts per time unit as floating point), the history of the run.
+ *
+ *       The writer thread also keeps the last SCHIST records in memory, a ring of
+ *       snapshots (time, time difference, counts and totals per channel), which the
+ *       online session can query while the sort runs and after it stops: the rate of
+ *       a channel, its moving average over the last n snapshots (counts over time, so
+ *       a short interval does not weigh as much as a long one), and the live fraction
+ *       from a pair of channels, live triggers over free triggers.  The ring is
+ *       guarded by a mutex, taken by the writer thread and the queries only, never by
+ *       the sort thread.  At userexit() the ring can be written to the ROOT file as a
+ *       TTree, and any channel's rates made into a TGraph.
+ *
+ * Usage:
+ *       ScalerWriter Scaler;                            //file scope
+ *       scopen(Scaler,NSCALERS,totals);                 //in userentry()
+ *       scpush(Scaler,p,stopped);                       //per sync event, p its body
+ *       scclose(Scaler);                                //in userexit()
+ *       scexport(Scaler);                               //optional, before f->Write()
+ *
+ *       from the online session:
+ *       scprint(Scaler,10);                             //rates of the last 10 snapshots
+ *       scrate(Scaler,3); scaverage(Scaler,3,60);       //channel 3 now, and over 60 snapshots
+ *       scsetlive(Scaler,5,4); sclive(Scaler,60);       //live fraction, channel 5 over 4
+ *       TGraph *g=scgraph(Scaler,3); g->Draw("al");
+ */
+#ifndef HELIOS_SCALER_H
+#define HELIOS_SCALER_H
+
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/stat.h>
+#include "Rtypes.h"
+#include "TGraph.h"
+#include "TTree.h"
+
+#define SCQUEUE  64   //records the queue holds; a power of 2
+#define SCMAXCH  18   //most scaler channels
+#define SCHIST   8192 //snapshots kept in memory; a day of sync events a few seconds apart
+
+struct ScalerRec {
+  UInt_t ttotal,tdiff;
+  UInt_t counts[SCMAXCH];
+  Bool_t stopped;           //first sync event after a stop: check for scalers.zap
+};
+
+struct ScalerSnap {
+  UInt_t ttotal,tdiff;
+  UInt_t counts[SCMAXCH];   //in tdiff
+  Double_t totals[SCMAXCH];
+};
+
+struct ScalerWriter {
+  Int_t nch;
+  Float_t *totals;          //the sort's totals, kept by the writer thread
+  const char *name;         //scalers.dat
+  const char *history;      //scalers.hist
+  FILE *hist;
+  ScalerRec q[SCQUEUE];
+  UInt_t head;              //records pushed; written by the sort thread only
+  UInt_t tail;              //records written; by the writer thread only
+  ScalerRec held;           //held back from a full queue; the sort thread's
+  Bool_t holding;
+  UInt_t dropped;           //records held back, so never written on their own
+  Bool_t stop;
+  Bool_t open;              //between scopen() and scclose()
+  Bool_t running;           //the writer thread was started
+  sem_t ready;              //posted per record, and to stop
+  pthread_t tid;
+  ScalerSnap *snaps;        //the last SCHIST snapshots, oldest overwritten
+  Long64_t nsnap;           //snapshots taken; the latest is snaps[(nsnap-1)%SCHIST]
+  Int_t livech,freech;      //channels counting live and free triggers, -1 if none
+  pthread_mutex_t lock;     //held to change or read snaps
+};
+
+/* Writes one record: totals updated, scalers.dat replaced, a line of history */
+inline void scwrite(ScalerWriter &w,const ScalerRec &r)
+{
+  if(r.stopped){
+    struct stat st;
+    if(stat("scalers.zap",&st)==0)
+      for(Int_t i=0;i<w.nch;i++) w.totals[i]=0;
+  }
+  for(Int_t i=0;i<w.nch;i++) w.totals[i]+=r.counts[i];
+
+  char tmp[256];
+  snprintf(tmp,sizeof(tmp),"%s.tmp",w.name);
+  FILE *sf=fopen(tmp,"w");
+  if(sf){
+    fprintf(sf,"%u %u\n",r.ttotal,r.tdiff);
+    for(Int_t i=0;i<w.nch;i++)
+      fprintf(sf,"%.0f %u\n",w.totals[i],r.tdiff!=0 ? r.counts[i]/r.tdiff : 0);
+    if(fclose(sf)==0) rename(tmp,w.name);
+  }
+
+  pthread_mutex_lock(&w.lock);
+  ScalerSnap &snap=w.snaps[w.nsnap%SCHIST];
+  snap.ttotal=r.ttotal;
+  snap.tdiff=r.tdiff;
+  for(Int_t i=0;i<w.nch;i++){
+    snap.counts[i]=r.counts[i];
+    snap.totals[i]=w.totals[i];
+  }
+  w.nsnap++;
+  pthread_mutex_unlock(&w.lock);
+
+  if(w.hist){
+    fprintf(w.hist,"%u %u",r.ttotal,r.tdiff);
+    for(Int_t i=0;i<w.nch;i++)
+      fprintf(w.hist," %.0f %.4g",w.totals[i],r.tdiff!=0 ? (Double_t)r.counts[i]/r.tdiff : 0.);
+    fprintf(w.hist,"\n");
+    fflush(w.hist);
+  }
+}
+
+inline void *scworker(void *arg)
+{
+  ScalerWriter &w=*(ScalerWriter*)arg;
+  for(;;){
+    while(sem_wait(&w.ready)!=0); //interrupted by a signal
+    UInt_t t=w.tail;
+    if(t==__atomic_load_n(&w.head,__ATOMIC_ACQUIRE)){
+      if(__atomic_load_n(&w.stop,__ATOMIC_ACQUIRE)) break;
+      continue;
+    }
+    scwrite(w,w.q[t%SCQUEUE]);
+    __atomic_store_n(&w.tail,t+1,__ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+/* Puts a record on the queue, which has room, or writes it if there is no writer thread */
+inline void scqueue(ScalerWriter &w,const ScalerRec &r)
+{
+  if(!w.running){
+    scwrite(w,r);
+    return;
+  }
+  UInt_t h=w.head;
+  w.q[h%SCQUEUE]=r;
+  __atomic_store_n(&w.head,h+1,__ATOMIC_RELEASE);
+  sem_post(&w.ready);
+}
+
+/* Queues the counts of a sync event whose body starts at p */
+inline void scpush(ScalerWriter &w,const unsigned int *p,Bool_t stopped)
+{
+  ScalerRec r;
+  r.ttotal=*p++;
+  r.tdiff=*p++;
+  for(Int_t i=0;i<w.nch;i++) r.counts[i]=*p++ & 0x00ffffff;
+  r.stopped=stopped;
+  Bool_t room=!w.running||w.head-__atomic_load_n(&w.tail,__ATOMIC_ACQUIRE)<SCQUEUE;
+  if(w.holding&&room){ //the held record first, in order
+    scqueue(w,w.held);
+    w.holding=kFALSE;
+    room=!w.running||w.head-__atomic_load_n(&w.tail,__ATOMIC_ACQUIRE)<SCQUEUE;
+  }
+  if(room){
+    scqueue(w,r);
+    return;
+  }
+  w.dropped++;
+  if(!w.holding){
+    w.held=r;
+    w.holding=kTRUE;
+    return;
+  }
+  w.held.ttotal=r.ttotal; //the held record now ends where this one does
+  w.held.tdiff+=r.tdiff;
+  for(Int_t i=0;i<w.nch;i++) w.held.counts[i]+=r.counts[i];
+  w.held.stopped|=r.stopped;
+}
+
+/* Writes what is queued and stops the writer thread */
+inline void scclose(ScalerWriter &w)
+{
+  if(!w.open) return;
+  if(w.running){
+    __atomic_store_n(&w.stop,kTRUE,__ATOMIC_RELEASE);
+    sem_post(&w.ready);
+    pthread_join(w.tid,0);
+    w.running=kFALSE;
+  }
+  if(w.holding) scwrite(w,w.held); //the thread is gone, so the totals are this thread's
+  w.holding=kFALSE;
+  sem_destroy(&w.ready);
+  if(w.dropped) printf("Scalers: %u sync events held back on a full queue, their counts written with later ones\n",
+		       w.dropped);
+  if(w.hist) fclose(w.hist);
+  w.hist=0;
+  w.open=kFALSE;
+}
+
+/* Starts the writer thread for nch channels, totals kept in the sort's array.  If the
+ * thread cannot be started, scpush() writes the records itself.
+ */
+inline void scopen(ScalerWriter &w,Int_t nch,Float_t *totals,
+		   const char *name="scalers.dat",const char *history="scalers.hist")
+{
+  scclose(w); //a writer left from the last sort
+  w.nch=nch<SCMAXCH ? nch : SCMAXCH;
+  w.totals=totals;
+  w.name=name;
+  w.history=history;
+  w.hist=fopen(history,"a");
+  w.head=w.tail=0;
+  w.dropped=0;
+  w.holding=kFALSE;
+  w.stop=kFALSE;
+  if(!w.snaps){ //kept from sort to sort, so the last run's history is there until the next starts
+    w.snaps=new ScalerSnap[SCHIST];
+    w.livech=w.freech=-1;
+    pthread_mutex_init(&w.lock,0);
+  }
+  w.nsnap=0;
+  w.open=kTRUE;
+  sem_init(&w.ready,0,0);
+  w.running=(pthread_create(&w.tid,0,scworker,&w)==0);
+  if(!w.running) printf("Scaler writer thread not started; scalers are written by the sort.\n");
+}
+
+/* Sets the channels counting live (accepted) and free (all) triggers, for sclive() */
+inline void scsetlive(ScalerWriter &w,Int_t live,Int_t free)
+{
+  w.livech=live;
+  w.freech=free;
+}
+
+/* Snapshots held, at most SCHIST */
+inline Int_t scsize(ScalerWriter &w)
+{
+  if(!w.snaps) return 0;
+  pthread_mutex_lock(&w.lock);
+  Int_t n=w.nsnap<SCHIST ? (Int_t)w.nsnap : SCHIST;
+  pthread_mutex_unlock(&w.lock);
+  return n;
+}
+
+/* Copies the snapshot taken ago sync events before the latest (0 the latest) to s.
+ * Returns 0 if it is held.
+ */
+inline Int_t scget(ScalerWriter &w,Int_t ago,ScalerSnap &s)
+{
+  if(!w.snaps||ago<0) return 1;
+  pthread_mutex_lock(&w.lock);
+  Int_t ok=(ago<w.nsnap&&ago<SCHIST);
+  if(ok) s=w.snaps[(w.nsnap-1-ago)%SCHIST];
+  pthread_mutex_unlock(&w.lock);
+  return !ok;
+}
+
+/* Sums the counts of channel ch and the time over the last n snapshots.  Returns the
+ * number of snapshots summed.
+ */
+inline Int_t scsum(ScalerWriter &w,Int_t ch,Int_t n,Double_t &counts,Double_t &time)
+{
+  counts=time=0;
+  if(!w.snaps||ch<0||ch>=w.nch) return 0;
+  pthread_mutex_lock(&w.lock);
+  if(n>w.nsnap) n=w.nsnap;
+  if(n>SCHIST) n=SCHIST;
+  for(Int_t k=0;k<n;k++){
+    const ScalerSnap &s=w.snaps[(w.nsnap-1-k)%SCHIST];
+    counts+=s.counts[ch];
+    time+=s.tdiff;
+  }
+  pthread_mutex_unlock(&w.lock);
+  return n;
+}
+
+/* Rate of channel ch over the last n snapshots, counts per time unit of the scaler
+ * clock; n=1 is the latest rate.  0 if there is no time to divide by.
+ */
+inline Double_t scaverage(ScalerWriter &w,Int_t ch,Int_t n)
+{
+  Double_t counts,time;
+  scsum(w,ch,n,counts,time);
+  return time>0 ? counts/time : 0;
+}
+
+inline Double_t scrate(ScalerWriter &w,Int_t ch)
+{
+  return scaverage(w,ch,1);
+}
+
+/* Live fraction over the last n snapshots: live triggers over free triggers, from the
+ * channels set by scsetlive().  The dead-time fraction is 1 less this.  -1 if the
+ * channels are not set or counted nothing.
+ */
+inline Double_t sclive(ScalerWriter &w,Int_t n)
+{
+  Double_t live,free,time;
+  scsum(w,w.livech,n,live,time);
+  scsum(w,w.freech,n,free,time);
+  return free>0 ? live/free : -1;
+}
+
+/* Prints the rates of every channel in the last n snapshots, oldest first */
+inline void scprint(ScalerWriter &w,Int_t n)
+{
+  Int_t held=scsize(w);
+  if(n>held) n=held;
+  for(Int_t k=n-1;k>=0;k--){
+    ScalerSnap s;
+    if(scget(w,k,s)) continue;
+    printf("%10u %5u",s.ttotal,s.tdiff);
+    for(Int_t i=0;i<w.nch;i++) printf(" %9.2f",s.tdiff ? (Double_t)s.counts[i]/s.tdiff : 0.);
+    printf("\n");
+  }
+  if(w.livech>=0&&w.freech>=0&&n>0) printf("Live fraction over %d: %.4f\n",n,sclive(w,n));
+}
+
+/* A graph of the rate of channel ch against time, over the snapshots held */
+inline TGraph *scgraph(ScalerWriter &w,Int_t ch)
+{
+  Int_t n=scsize(w);
+  TGraph *g=new TGraph(n);
+  for(Int_t k=0;k<n;k++){
+    ScalerSnap s;
+    if(scget(w,n-1-k,s)) break;
+    g->SetPoint(k,s.ttotal,s.tdiff ? (Double_t)s.counts[ch]/s.tdiff : 0.);
+  }
+  TString name="gScaler";
+  name+=ch;
+  g->SetName(name);
+  g->SetTitle(name);
+  return g;
+}
+
+/* Makes tree "scalers" of the snapshots held, one entry each, in the current directory,
+ * which writes it with the rest of its objects
+ */
+inline void scexport(ScalerWriter &w)
+{
+  Int_t n=scsize(w);
+  if(!n) return;
+  ScalerSnap s;
+  Float_t rate[SCMAXCH];
+  TString leaf;
+  TTree *t=new TTree("scalers","Scaler snapshots");
+  t->Branch("ttotal",&s.ttotal,"ttotal/i");
+  t->Branch("tdiff",&s.tdiff,"tdiff/i");
+  leaf="counts[";
+  leaf+=w.nch;
+  leaf+="]/i";
+  t->Branch("counts",s.counts,leaf);
+  leaf="totals[";
+  leaf+=w.nch;
+  leaf+="]/D";
+  t->Branch("totals",s.totals,leaf);
+  leaf="rate[";
+  leaf+=w.nch;
+  leaf+="]/F";
+  t->Branch("rate",rate,leaf);
+  for(Int_t k=n-1;k>=0;k--){
+    if(scget(w,k,s)) continue;
+    for(Int_t i=0;i<w.nch;i++) rate[i]=s.tdiff ? (Float_t)s.counts[i]/s.tdiff : 0;
+    t->Fill();
+  }
+  t->ResetBranchAddresses(); //they are this function's
+  printf("Scalers: %d snapshots in tree \"scalers\"\n",n);
+}
+
+#endif
@@ -0,0 +1,320 @@
+/* Program: helios_shm.h
+ * Purpose:
+ *       Live spectra of an online sort in POSIX shared memory, so viewers in other
+ *       processes can look at them at any rate without going through the sort's
+ *       ROOT session, and the sort is never paused to redraw.  hshmserve() lays
+ *       out a segment holding a copy of every integer-count histogram booked by
+ *       userentry() (hbook1i()/hbook2i(), see helios_hist.h): a directory of the
+ *       histograms, then the bins of each, cell for cell as the TH1I/TH2I's, on
+ *       cache lines of their own.  From then on each fill also adds one to the
+ *       bin of the copy, and to its entries.
+ *
+ *       The header carries a version of the layout and a sequence number, a
+ *       seqlock: the server makes it odd while it changes the layout or the
+ *       contents as a whole (serving, clearing, closing) and even again after.
+ *       A viewer reads the number, copies what it wants, and reads it again; if it
+ *       was odd or has changed, the copy may be torn and is taken again.  Single
+ *       fills do not move the number, so a copy is as of some moment during the
+ *       copy, each bin read whole.  A new sort replaces the segment with a new one
+ *       under the same name, and the old one is marked done, so a viewer that
+ *       finds the segment done attaches again.
+ *
+ *       When the histograms are double-buffered (hdoublebuffer()), the fills do
+ *       not go to the copy: a thread started by hshmserve() takes a snapshot every
+ *       period seconds (hsnapshot()), adding the events since the last into the
+ *       histograms and the copy inside one odd stretch of the seqlock, so a copy a
+ *       viewer makes holds the same whole events in every histogram.
+ *
+ *       Link with -lrt where shm_open() is not in the C library.
+ *
+ * Usage:
+ *       HShmServer Shm;                          //file scope of the sort
+ *       hshmserve(Shm,"/helios_H007");           //in userentry(), after booking
+ *                                                //  (and after hdoublebuffer(), if used)
+ *       hshmclose(Shm);                          //in userexit()
+ *
+ *       in a viewer:
+ *       HShmView v;
+ *       if(hshmattach(v,"/helios_H007")) return 1;
+ *       Int_t i=hshmfind(v,"hEDE0");
+ *       TH1 *h=hshmhist(v,i);                    //a TH1I/TH2I copy, or 0
+ *       switch(hshmread(v,i,h)){                 //to refresh it
+ *       case HSHMTORN: ...                       //  the server was busy: try again later
+ *       case HSHMGONE: ...                       //  the sort has moved on: attach again
+ *       }
+ *       hshmdetach(v);
+ */
+#ifndef HELIOS_SHM_H
+#define HELIOS_SHM_H
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "Rtypes.h"
+#include "TH1.h"
+#include "TH2.h"
+#include "helios_hist.h"
+
+#ifdef HELIOS_THREADS
+#error "helios_shm.h serves the histograms of an online sort, built without HELIOS_THREADS"
+#endif
+
+#define HSHMMAGIC   0x4d485348 //"HSHM"
+#define HSHMVERSION 1          //layout of the segment
+#define HSHMRETRY   1000       //copies a viewer tries before giving up
+#define HSHMOK      0          //hshmread(): a whole copy of the live segment
+#define HSHMTORN    1          //  no whole copy, the server busy throughout: try again
+#define HSHMGONE    2          //  a whole copy, of a segment the sort is done with
+#define HSHMNOHIST  3          //  no such histogram
+
+/* One histogram of the segment */
+struct HShmHist {
+  char name[32];
+  char title[64];
+  Int_t nx,ny;            //bins; ny=0 for a 1D histogram
+  Double_t x0,x1,y0,y1;
+  Long64_t offset;        //of the bins, from the start of the segment
+  Int_t ncells;           //bins, under- and overflow included
+  Int_t pad;
+  Long64_t entries;
+};
+
+struct HShmHeader {
+  UInt_t magic;
+  UInt_t version;
+  UInt_t seq;             //odd while the layout or contents change
+  Int_t live;             //0 once the sort has finished with the segment
+  Long64_t size;          //bytes
+  Int_t nhist;
+  Int_t pid;              //of the sort
+  //nhist HShmHist follow, then the bins
+};
+
+struct HShmServer {
+  char name[64];
+  char *base;             //0 when not serving
+  size_t size;
+  HShmHeader *hdr;
+  Double_t period;        //seconds between snapshots of double-buffered histograms
+  Bool_t publishing;      //the snapshot thread is running
+  Bool_t stop;
+  pthread_t tid;
+};
+
+struct HShmView {
+  char *base;
+  size_t size;
+  const HShmHeader *hdr;
+};
+
+inline HShmHist *hshmdir(const HShmHeader *hdr)
+{
+  return (HShmHist*)(hdr+1);
+}
+
+/* Takes a snapshot of the double-buffered histograms every period seconds */
+inline void *hshmpublisher(void *arg)
+{
+  HShmServer &s=*(HShmServer*)arg;
+  Int_t ticks=(Int_t)(s.period*100+0.5);
+  if(ticks<1) ticks=1;
+  while(!__atomic_load_n(&s.stop,__ATOMIC_ACQUIRE)){
+    for(Int_t k=0;k<ticks&&!__atomic_load_n(&s.stop,__ATOMIC_ACQUIRE);k++) usleep(10000);
+    hsnapshot();
+  }
+  return 0;
+}
+
+/* Lays out a segment for the integer-count histograms booked by userentry(), copies
+ * their contents so far and has their fills (or snapshots, every period seconds, when
+ * double-buffered) go to it too.  Returns 0 if served.
+ */
+inline Int_t hshmserve(HShmServer &s,const char *name,Double_t period=1)
+{
+  Int_t n=0;
+  size_t size=(sizeof(HShmHeader)+HCACHELINE-1)/HCACHELINE*HCACHELINE;
+  for(HBook *b=hmaster;b;b=b->next){
+    if(b->kind!=HCOUNT) continue;
+    n++;
+    size+=sizeof(HShmHist);
+  }
+  size=(size+HCACHELINE-1)/HCACHELINE*HCACHELINE;
+  Long64_t bins=size;
+  for(HBook *b=hmaster;b;b=b->next){
+    if(b->kind!=HCOUNT) continue;
+    Int_t ncells=(b->nx+2)*(b->ny ? b->ny+2 : 1);
+    size+=(ncells*sizeof(Int_t)+HCACHELINE-1)/HCACHELINE*HCACHELINE;
+  }
+
+  strncpy(s.name,name,sizeof(s.name)-1);
+  s.name[sizeof(s.name)-1]=0;
+  s.base=0;
+  shm_unlink(name); //a viewer of the last sort keeps the old segment until it attaches again
+  int fd=shm_open(name,O_CREAT|O_RDWR,0644);
+  if(fd<0){
+    printf("Cannot create shared memory \"%s\"\n",name);
+    return 1;
+  }
+  void *p=(ftruncate(fd,size)==0) ? mmap(0,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0) : MAP_FAILED;
+  close(fd);
+  if(p==MAP_FAILED){
+    printf("Cannot map shared memory \"%s\" of %lu bytes\n",name,(unsigned long)size);
+    shm_unlink(name);
+    return 1;
+  }
+  s.base=(char*)p;
+  s.size=size;
+  s.hdr=(HShmHeader*)p;
+  HShmHeader *hdr=s.hdr;
+  hdr->seq=1; //being laid out
+  hdr->magic=HSHMMAGIC;
+  hdr->version=HSHMVERSION;
+  hdr->size=size;
+  hdr->nhist=n;
+  hdr->pid=getpid();
+  HShmHist *dir=hshmdir(hdr);
+  Int_t i=0;
+  for(HBook *b=hmaster;b;b=b->next){
+    if(b->kind!=HCOUNT) continue;
+    HShmHist &d=dir[i++];
+    HCount *c=(HCount*)b;
+    strncpy(d.name,b->name,sizeof(d.name)-1);
+    strncpy(d.title,b->title,sizeof(d.title)-1);
+    d.nx=b->nx;
+    d.ny=b->ny;
+    d.x0=b->x0;
+    d.x1=b->x1;
+    d.y0=b->y0;
+    d.y1=b->y1;
+    d.ncells=(b->nx+2)*(b->ny ? b->ny+2 : 1);
+    d.offset=bins;
+    d.entries=(Long64_t)b->h->GetEntries();
+    c->ma=(Int_t*)(s.base+bins);
+    memcpy(c->ma,c->a,d.ncells*sizeof(Int_t));
+    c->mentries=&d.entries;
+    bins+=(d.ncells*sizeof(Int_t)+HCACHELINE-1)/HCACHELINE*HCACHELINE;
+  }
+  hdr->live=1;
+  hseq=&hdr->seq;
+  hseqend(hseq);
+  printf("Serving %d histograms in shared memory %s, %.1f MB\n",n,name,size/1e6);
+  s.period=period;
+  s.stop=kFALSE;
+  s.publishing=hdouble&&pthread_create(&s.tid,0,hshmpublisher,&s)==0;
+  if(s.publishing) printf("Snapshots every %g s\n",period);
+  return 0;
+}
+
+/* Stops the fills going to the segment and marks it done; the segment itself stays,
+ * with the last contents, until the next sort replaces it.
+ */
+inline void hshmclose(HShmServer &s)
+{
+  if(!s.base) return;
+  if(s.publishing){
+    __atomic_store_n(&s.stop,kTRUE,__ATOMIC_RELEASE);
+    pthread_join(s.tid,0);
+    s.publishing=kFALSE;
+  }
+  hsnapshot(); //the events since the last
+  for(HBook *b=hmaster;b;b=b->next){
+    if(b->kind!=HCOUNT) continue;
+    ((HCount*)b)->ma=0;
+    ((HCount*)b)->mentries=0;
+  }
+  hseqbegin(hseq);
+  s.hdr->live=0;
+  hseqend(hseq);
+  hseq=0;
+  munmap(s.base,s.size);
+  s.base=0;
+}
+
+/* Maps the segment of a sort for reading.  Returns 0 if mapped. */
+inline Int_t hshmattach(HShmView &v,const char *name)
+{
+  v.base=0;
+  int fd=shm_open(name,O_RDONLY,0);
+  if(fd<0){
+    printf("No shared memory \"%s\": is the sort serving?\n",name);
+    return 1;
+  }
+  struct stat st;
+  void *p=(fstat(fd,&st)==0&&st.st_size>=(off_t)sizeof(HShmHeader)) ?
+    mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0) : MAP_FAILED;
+  close(fd);
+  if(p==MAP_FAILED) return 1;
+  const HShmHeader *hdr=(const HShmHeader*)p;
+  if(hdr->magic!=HSHMMAGIC||hdr->version!=HSHMVERSION||hdr->size>st.st_size){
+    printf("Shared memory \"%s\" is not a histogram segment of version %d\n",name,HSHMVERSION);
+    munmap(p,st.st_size);
+    return 1;
+  }
+  v.base=(char*)p;
+  v.size=st.st_size;
+  v.hdr=hdr;
+  return 0;
+}
+
+inline void hshmdetach(HShmView &v)
+{
+  if(v.base) munmap(v.base,v.size);
+  v.base=0;
+}
+
+/* Index of the histogram called name, or -1 */
+inline Int_t hshmfind(const HShmView &v,const char *name)
+{
+  const HShmHist *dir=hshmdir(v.hdr);
+  for(Int_t i=0;i<v.hdr->nhist;i++)
+    if(!strncmp(dir[i].name,name,sizeof(dir[i].name))) return i;
+  return -1;
+}
+
+/* Copies histogram i's bins and entries into h, a histogram of its binning.  Returns
+ * HSHMOK if copied whole, HSHMTORN if no whole copy could be made (h is then torn, and
+ * the read worth trying again), HSHMGONE if the copy is of a segment the sort is done
+ * with (attach again for the next sort's), HSHMNOHIST if there is no histogram i.
+ * While the server holds the sequence odd the viewer yields the processor.
+ */
+inline Int_t hshmread(const HShmView &v,Int_t i,TH1 *h)
+{
+  const HShmHeader *hdr=v.hdr;
+  if(i<0||i>=hdr->nhist) return HSHMNOHIST;
+  const HShmHist &d=hshmdir(hdr)[i];
+  Int_t *a=d.ny ? ((TH2I*)h)->GetArray() : ((TH1I*)h)->GetArray();
+  for(Int_t k=0;k<HSHMRETRY;k++){
+    UInt_t seq=__atomic_load_n(&hdr->seq,__ATOMIC_ACQUIRE);
+    if(seq&1){ //the server is laying out, clearing or snapshotting
+      sched_yield();
+      continue;
+    }
+    Int_t live=hdr->live;
+    memcpy(a,v.base+d.offset,d.ncells*sizeof(Int_t));
+    Long64_t entries=d.entries;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&hdr->seq,__ATOMIC_RELAXED)!=seq) continue;
+    h->SetEntries(entries);
+    return live ? HSHMOK : HSHMGONE;
+  }
+  return HSHMTORN;
+}
+
+/* A TH1I/TH2I copy of histogram i, or 0 if there is none */
+inline TH1 *hshmhist(const HShmView &v,Int_t i)
+{
+  if(i<0||i>=v.hdr->nhist) return 0;
+  const HShmHist &d=hshmdir(v.hdr)[i];
+  TH1 *h;
+  if(d.ny) h=new TH2I(d.name,d.title,d.nx,d.x0,d.x1,d.ny,d.y0,d.y1);
+  else h=new TH1I(d.name,d.title,d.nx,d.x0,d.x1);
+  hshmread(v,i,h);
+  return h;
+}
+
+#endif
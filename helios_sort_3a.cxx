@@ -39,11 +39,17 @@ using namespace std; //used to eliminate deprecated header file error message
 #include "TMath.h"
 #include "TDirectory.h"
 #include <fstream>
+#include "helios_unpack.h"
+#include "helios_scaler.h"
+#include "helios_cuts.h"
+#include "helios_hist.h"
 #define NSCALERS 18
 
 TFile *f,*cutfile; //used to create ROOT file
 Float_t totals[NSCALERS];
 Int_t stopped;
+ScalerWriter Scaler; //writes scalers.dat off the sort thread, see helios_scaler.h
+Bool_t DoScalerTree=kTRUE; //<--------write the scaler history to the ROOT file, tree "scalers"
 
 Bool_t bOldCal=1;
 Bool_t bPrintCal=0;
@@ -71,6 +77,21 @@ Float_t active=50.5; //Length of active area in mm
 Float_t positions[7]={offset-active/2+positions[1], //Position of Ta slits
 		      66.76,124.12,182.48,241.11,299.87,358.68};//Detector-Center Positions (from schematic)
 
+//Array Wiring: re-maps raw ADC (5x16) channels to detector (24x3) signals
+Int_t MapDet[5][16]={{ 1, 0, 5, 4, 3, 2, 1, 0, 3, 2, 1, 0, 5, 4, 3, 2},
+  		       {11,10, 9, 8, 7, 6, 5, 4, 7, 6,11,10, 9, 8, 7, 6},
+ 		       {15,14,13,12,11,10, 9, 8,17,16,15,14,13,12,17,16},
+                       {20,21,22,23,18,19,20,21,12,13,14,15,16,17,18,19},
+                       {-1,-1,-1,-1,-1,-1,-1,-1,22,23,18,19,20,21,22,23}}; //for ADC5 only channels 0-7 
+                                                                           //are used for Si signals
+
+Int_t MapSig[5][16]={{1,1,0,0,0,0,0,0,2,2,2,2,1,1,1,1}, //0->E, 1->XF, 2->XN
+                       {0,0,0,0,0,0,2,2,2,2,1,1,1,1,1,1},
+                       {0,0,0,0,2,2,2,2,1,1,1,1,1,1,0,0},
+                       {0,0,0,0,1,1,1,1,2,2,2,2,2,2,0,0},
+		       {-1,-1,-1,-1,-1,-1,-1,-1,1,1,2,2,2,2,2,2}};
+Int_t MapSlot[NADC*NCHAN]; //flat (adc,chan)->Data slot table, built by buildmap() in userentry()
+
 //Reaction Properties
 Float_t mass=(2*MeV_amu+13.1357)/MeV_amu*amu; //Mass of detected particle in kg
 Float_t Vcm=2.380E7;      //Center-of-mass velocity in m/s
@@ -112,7 +133,7 @@ TH1F *hTAC;
 
 
 /* 2-D histograms */
-TH2F *hADC[6];
+H2I *hADC[7];
 TH2F *hECSIall;
 TH2F *hXFXN[25];
 TH2F *hEDiff[24];
@@ -121,19 +142,20 @@ TH2F *hEcX[24];
 TH2F *hESum[24];
 TH2F *hDiffX[24];
 TH2F *hETAC[4];
-TH2F *hETACg[4];
+H2S *hETACg[4];
 
 //TH2F *hEDE[8];
 TH2F *hEDE1g, *hEDE2g, *hEDE3g, *hEDE4g;
 TH2F *hEDEg2[4];
-TH2F *hE, *hXN, *hXF,*hEZ,*hEZg,*hEZgg, *hEZg1,*hEZg2,*hEZg3, *hEZg4;
+TH2F *hE, *hXN, *hXF,*hEZ,*hEZg,*hEZgg;
+H2S *hEZg1,*hEZg2,*hEZg3, *hEZg4; //sparse gated spectra, see helios_hist.h
 TH2F *hRF_AR_REC,*hRF_AR_RECg,*hARREC_RFREC,*hARREC_RFAR, *hARREC_RFARg;
 TH2F *hTARREC1_RF,*hTARREC2_RF,*hTARREC3_RF,*hTARREC4_RF,*hTARRF_REC1,*hTARRF_REC2,*hTARRF_REC3,*hTARRF_REC4,*hTRECRF_AR;
 TH2F *hTARREC1_RFg,*hTARREC2_RFg,*hTARREC3_RFg,*hTARREC4_RFg;
 TH2F *hTARC;
 TH2F *hETAC_ALL,*hECSISI,*hETCSI;
-TH2F *hETACg_ALL,*hECSISIg,*hETCSIg;
-TH2F *hEarrESi;
+H2S *hETACg_ALL,*hECSISIg,*hETCSIg;
+H2S *hEarrESi;
 
 
 
@@ -169,38 +191,10 @@ Int_t readcuts(Char_t *cfn="3alpha_cuts.root"){
   return 0;
 }
 
-/* function to count the number of set bits in a 16 bit word */
-Int_t cntbit(Int_t word)
-{
-  Int_t nbits=0;
-  for (Int_t ibit=0; ibit<16; ibit++) {
-    if (word & (Int_t) TMath::Power(2,ibit)) {nbits++;}
-  }
-  return nbits;
-}
-
-Bool_t cexists(Char_t *cutname)
-{
-
-   Bool_t returnvalue=kFALSE;
-   if (gROOT->FindObjectClassName(cutname)) returnvalue=kTRUE;
-   return returnvalue;
-}
-
-
-/* function to see if x and y are within the boundries of a TCugG */
-Bool_t checkcutg(Char_t *cutname,Float_t x, Float_t y)
-{
-   Bool_t returnvalue=kFALSE;
-   if (cexists(cutname)) {
-      TCutG *gcut=(TCutG *) gROOT->GetListOfSpecials()->FindObject(cutname);
-      if (gcut->IsInside(x,y)==1) returnvalue=kTRUE;
-      return returnvalue;
-
-   } else {
-     return returnvalue;
-   }
-}
+//Gates used per hit, resolved by name from the loaded cuts in userentry()
+Gate gEZ; //cEZ
+Gate gEZ_rough; //cEZ_rough
+Bool_t RasterGates=kTRUE; //<--------look gates up on a grid of their histogram's bins
 int readcal(Char_t *calfile1="position.cal",Char_t *calfile2="energy.cal",Char_t *calfile3="ecal.cal")
 {
   Bool_t showtest=0;
@@ -739,13 +733,17 @@ int readcal(Char_t *calfile1="position.cal",Char_t *calfile2="energy.cal",Char_t
  */
 int userentry()
 {
+  buildmap(MapDet,MapSig,MapSlot); //flatten the array re-map matrices once per sort
 
  /* stopped flag for Elliot's scaler program */
   for (Int_t i=0; i<NSCALERS; i++) totals[i]=0;
   stopped = 1; 
+  scopen(Scaler,NSCALERS,totals);
 
   //File commands
   readcuts("3alpha_cuts.root"); 
+  gateresolve(gEZ,"cEZ");
+  gateresolve(gEZ_rough,"cEZ_rough");
   f = new TFile("offline.root", "recreate");
   if(bOldCal)
     //readcal("oldposition.cal","oldenergy.cal","oldecal.cal");
@@ -787,25 +785,25 @@ Int_t bin1=256;//Sets number of bins on most histograms to conveniently reduce m
 
 
   hECSIall=new TH2F("hECSIall","CsI Det. vs CsI energy",bin1,0,4096,4,0,4);
-  hEarrESi=new TH2F("hEarrESi","E(silicon) vs E(Array)",bin1,0,maxE,bin1,0,4096);
+  hEarrESi=hbook2s("hEarrESi","E(silicon) vs E(Array)",bin1,0,maxE,bin1,0,4096);
 
   hETAC_ALL=new TH2F("hETAC_ALL","TAC vs E(Si)",bin1,0,maxE,bin1,0,4096);
   hECSISI=new TH2F("hECSISI","Esum(CSI) vs E(Si)",bin1,0,maxE,bin1,0,16384);
   hETCSI=new TH2F("hETCSI","TAC vs Esum(CsI)",bin1,0,4096,bin1,0,16384);
 
-  hETACg_ALL=new TH2F("hETACg_ALL","TAC vs E(Si) (goodEZ gated)",bin1,0,maxE,bin1,0,4096);
-  hETCSIg=new TH2F("hETCSIg","TAC vs Esum(CsI) (goodEZ gated) ",bin1,0,4096,bin1,0,16384);
-  hECSISIg=new TH2F("hECSISIg","Esum(CSI) vs E(Si) (goodEZ gated)",bin1,0,maxE,bin1,0,16384);
+  hETACg_ALL=hbook2s("hETACg_ALL","TAC vs E(Si) (goodEZ gated)",bin1,0,maxE,bin1,0,4096);
+  hETCSIg=hbook2s("hETCSIg","TAC vs Esum(CsI) (goodEZ gated) ",bin1,0,4096,bin1,0,16384);
+  hECSISIg=hbook2s("hECSISIg","Esum(CSI) vs E(Si) (goodEZ gated)",bin1,0,maxE,bin1,0,16384);
 
   hETAC[0]=new TH2F("hETAC1","TAC CsI1 vs E(Si)",bin1,0,maxE,bin1,0,4096);
   hETAC[1]=new TH2F("hETAC2","TAC CsI2 vs E(Si)",bin1,0,maxE,bin1,0,4096);
   hETAC[2]=new TH2F("hETAC3","TAC CsI3 vs E(Si)",bin1,0,maxE,bin1,0,4096);
   hETAC[3]=new TH2F("hETAC4","TAC CsI4 vs E(Si)",bin1,0,maxE,bin1,0,4096);
 
-  hETACg[0]=new TH2F("hETAC1g","TAC CsI1 vs E(Si) (goodEZ)",bin1,0,maxE,bin1,0,4096);
-  hETACg[1]=new TH2F("hETAC2g","TAC CsI2 vs E(Si) (goodEZ)",bin1,0,maxE,bin1,0,4096);
-  hETACg[2]=new TH2F("hETAC3g","TAC CsI3 vs E(Si) (goodEZ)",bin1,0,maxE,bin1,0,4096);
-  hETACg[3]=new TH2F("hETAC4g","TAC CsI4 vs E(Si) (goodEZ)",bin1,0,maxE,bin1,0,4096);
+  hETACg[0]=hbook2s("hETAC1g","TAC CsI1 vs E(Si) (goodEZ)",bin1,0,maxE,bin1,0,4096);
+  hETACg[1]=hbook2s("hETAC2g","TAC CsI2 vs E(Si) (goodEZ)",bin1,0,maxE,bin1,0,4096);
+  hETACg[2]=hbook2s("hETAC3g","TAC CsI3 vs E(Si) (goodEZ)",bin1,0,maxE,bin1,0,4096);
+  hETACg[3]=hbook2s("hETAC4g","TAC CsI4 vs E(Si) (goodEZ)",bin1,0,maxE,bin1,0,4096);
   
   //  hECSI=new TH2F("hECSI1","CsI1 vs E(Si)",bin1,0,maxE,bin1,0,16384);
 
@@ -818,12 +816,16 @@ Int_t bin1=256;//Sets number of bins on most histograms to conveniently reduce m
   // hTDC=new TH2F("hTDC","hTDC",512,0,4096,16,0,16);
 
   hEZ=new TH2F("hEZ","Energy vs. Position",512,minZ,maxZ,512,0,maxE);
+  if(RasterGates){ //hEZ binning
+    gateraster(gEZ,512,minZ,maxZ,512,0,maxE);
+    gateraster(gEZ_rough,512,minZ,maxZ,512,0,maxE);
+  }
   hEZg=new TH2F("hEZg","Energy vs. Position (gated:TAC)",512,minZ,maxZ,512,0,maxE);
   hEZgg=new TH2F("hEZgg","Energy vs. Position (gated:TAC & CSI-OR)",512,minZ,maxZ,512,0,maxE);
-  hEZg1=new TH2F("hEZg1","Energy vs. Position (gated: CSI1)",512,minZ,maxZ,512,0,maxE);
-  hEZg2=new TH2F("hEZg2","Energy vs. Position (gated: CSI2)",512,minZ,maxZ,512,0,maxE);
-  hEZg3=new TH2F("hEZg3","Energy vs. Position (gated: CSI3)",512,minZ,maxZ,512,0,maxE);
-  hEZg4=new TH2F("hEZg4","Energy vs. Position (gated: CSI4)",512,minZ,maxZ,512,0,maxE);
+  hEZg1=hbook2s("hEZg1","Energy vs. Position (gated: CSI1)",512,minZ,maxZ,512,0,maxE);
+  hEZg2=hbook2s("hEZg2","Energy vs. Position (gated: CSI2)",512,minZ,maxZ,512,0,maxE);
+  hEZg3=hbook2s("hEZg3","Energy vs. Position (gated: CSI3)",512,minZ,maxZ,512,0,maxE);
+  hEZg4=hbook2s("hEZg4","Energy vs. Position (gated: CSI4)",512,minZ,maxZ,512,0,maxE);
   
 
 
@@ -832,7 +834,7 @@ Int_t bin1=256;//Sets number of bins on most histograms to conveniently reduce m
     TString title="raw ADC";
     name+=(a+1);
     title+=(a+1);
-    hADC[a]=new TH2F(name,title,1024,0,4095,17,0,17);
+    hADC[a]=hbook2i(name,title,1024,0,4096,17,0,17);
   }
 
   for(int a=0;a<25;++a){
@@ -898,42 +900,15 @@ Int_t bin1=256;//Sets number of bins on most histograms to conveniently reduce m
   }//end diag
 
 
+  hmaster=hlist; //sparse bookings, made dense by userexit()
   return 0;
 }
 
 /* function to deal with scalers, adapted from Elliot's program */
 void scalers(ScarletEvnt &e)
 {
-    /* Adapted from Kanter's scaler program
-     */
-    unsigned int *p = reinterpret_cast<unsigned int*>(e.body());
-    unsigned int ttotal, tdiff, ithscaler, ithrate;
-    FILE *sf;
-
-    /* On the first sync event after a stop, the following tests for the
-     * existence of a file called scalers.zap.  If it exists, the scaler
-     * totals are reset.
-     */
-    if (stopped) {
-        struct stat st;
-        stopped = 0;
-        if (stat("scalers.zap", &st) == 0) {
-            for (int i = 0; i < NSCALERS; ++i) totals[i] = 0.0;
-        }
-    }
-
-    if ((sf = fopen("scalers.dat", "w")) == 0) return;
-    ttotal = *p++;
-    tdiff = *p++;
-    fprintf(sf, "%u %u\n", ttotal, tdiff);
-    for (int i = 0; i < NSCALERS; ++i) {
-        ithscaler = *p++ & 0x00ffffff;
-        totals[i] += ithscaler;
-
-        ithrate = tdiff != 0 ? ithscaler/tdiff : 0;
-        fprintf(sf, "%.0f %u\n", totals[i], ithrate);
-    }
-    fclose(sf);
+  scpush(Scaler,reinterpret_cast<unsigned int*>(e.body()),stopped); //totals, zap check and file by the writer thread
+  stopped=0;
 }
 
 
@@ -979,22 +954,7 @@ int userdecode(ScarletEvnt &event) {
  
   Int_t EDE[16]={0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};  //array for CsI energies;  (0-3) {CsI1, CsI2,...}
   Int_t TAC=0;
-  Int_t nhits[5]={0,0,0,0,0};
-  Int_t Chan[5][16];
-  Int_t RawData[5][16];
-  Int_t Data[24][3];
-  Int_t MapDet[5][16]={{ 1, 0, 5, 4, 3, 2, 1, 0, 3, 2, 1, 0, 5, 4, 3, 2},
-  		       {11,10, 9, 8, 7, 6, 5, 4, 7, 6,11,10, 9, 8, 7, 6},
- 		       {15,14,13,12,11,10, 9, 8,17,16,15,14,13,12,17,16},
-                       {20,21,22,23,18,19,20,21,12,13,14,15,16,17,18,19},
-                       {-1,-1,-1,-1,-1,-1,-1,-1,22,23,18,19,20,21,22,23}}; //for ADC5 only channels 0-7 
-                                                                           //are used for Si signals
-
-  Int_t MapSig[5][16]={{1,1,0,0,0,0,0,0,2,2,2,2,1,1,1,1}, //0->E, 1->XF, 2->XN
-                       {0,0,0,0,0,0,2,2,2,2,1,1,1,1,1,1},
-                       {0,0,0,0,2,2,2,2,1,1,1,1,1,1,0,0},
-                       {0,0,0,0,1,1,1,1,2,2,2,2,2,2,0,0},
-		       {-1,-1,-1,-1,-1,-1,-1,-1,1,1,2,2,2,2,2,2}};
+  Int_t Data[NDET+1][NSIG]; //row NDET is scratch for unmapped channels
 
  Int_t Toffset[24]={1959,2033,2003,1924,2267,1912,2327,2223,
 		     2168,2096,2162,   0,2029,1910,2007,1918,
@@ -1060,30 +1020,7 @@ int userdecode(ScarletEvnt &event) {
 
    //read in ADC 1-5
   
-  for(Int_t nadc=0;nadc<5;++nadc){ //loop over ADCs 1-5
-    
-    dataword=*p1++;
-    nhits[nadc]=cntbit(dataword); //determines number of hits in ADC by counting set bits (ones) in hit register
-  
-    for(Int_t i=0;i<nhits[nadc];++i){ //loop over ADC hits, if any
-      dataword=*p1++;
-     
-      Chan[nadc][i]=((dataword & 0x0000f000)>>12);
-      RawData[nadc][i]=(dataword & 0x00000fff);
-      hADC[nadc]->Fill(RawData[nadc][i],Chan[nadc][i]);
-      
-      if(nadc>-1&&nadc<5&&i>-1&&i<16){ // Tests for sensible ADC and Channel numbers
-	if((MapDet[nadc][Chan[nadc][i]])>-1&&(MapDet[nadc][Chan[nadc][i]])<24&&
-	   (MapSig[nadc][Chan[nadc][i]])>-1&&(MapSig[nadc][Chan[nadc][i]])<3){ //Tests for sensible values in 
-
-	                                                                       //remap matrices.  Note -1 is excluded.
-	  
-	  Data[MapDet[nadc][Chan[nadc][i]]][MapSig[nadc][Chan[nadc][i]]]=RawData[nadc][i]; //Remaps RawData array
-	  
-	}
-      }
-    }
-  }
+  p1=unpackarray(p1,MapSlot,hADC,Data); //hit pattern and data words for each of ADCs 1-5
 
 
 
@@ -1168,7 +1105,7 @@ int userdecode(ScarletEvnt &event) {
 	  
  	  z=-positions[(6-(i%6))]-active/2+positions[0]+(active*x); //position in magnet in mm	  
 	  // printf("%f %f\n",z,e);
-	  if (checkcutg("cEZ",z,e)) goodEZ=kTRUE;
+	  if (gateinside(gEZ,z,e)) goodEZ=kTRUE;
 
 	hEZ->Fill(z,e);
 	if(bOffline)
@@ -1178,7 +1115,7 @@ int userdecode(ScarletEvnt &event) {
 	
 	//Define conditions (gate) 
 	
-	if (checkcutg("cEZ_rough",z,e)) {goodEZ=kTRUE;}
+	if (gateinside(gEZ_rough,z,e)) {goodEZ=kTRUE;}
 	if((TAC>=140)&&(TAC<=2500)) goodT=kTRUE;
 	if((EDE[0]>=100)&&(EDE[0]<=4000)) goodECSI1=kTRUE;
 	if((EDE[1]>=100)&&(EDE[1]<=4000)) goodECSI2=kTRUE;
@@ -1259,6 +1196,7 @@ int userfunc(const struct ScarletEvntHdr* h)
   case SE_TYPE_STOP:
     stopped=1;
     printf("received stop signal.\n");
+    unpackreport(); //channel-field cross-check from unpackarray()
     break;
   }
     return 0;
@@ -1273,10 +1211,16 @@ int userfunc(const struct ScarletEvntHdr* h)
  */
 int userexit()
 {
+  scclose(Scaler);
   cout<<"Exiting sort..."<<endl;    
+  hdensify(); //sparse spectra to TH2F, see helios_hist.h
+  hstubs();
+  f->cd();
+  if(DoScalerTree) scexport(Scaler);
   f->Write();
   f->Close();
   delete f;
+  hfree(); //the booking records, see helios_hist.h
   printf("\a"); //"Default Beep" at sort exit.
   return 0;
 }
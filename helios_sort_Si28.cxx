@@ -32,6 +32,7 @@
 using namespace std; //used to eliminate deprecated header file error message
 #include <sys/stat.h>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include "daphuserfunc.h"
 #include "ScarletEvnt.h"
@@ -42,21 +43,44 @@ using namespace std; //used to eliminate deprecated header file error message
 #include "TRandom.h"
 #include "TMath.h"
 #include "TDirectory.h"
+#include "TTree.h"
 #include <fstream>
+#ifdef HELIOS_THREADS
+#include <pthread.h>
+#endif
+#include "helios_hist.h"
+#include "helios_unpack.h"
+#include "helios_scaler.h"
+#include "helios_cuts.h"
+#include "helios_kin.h"
+#include "helios_hitcache.h"
+#include "helios_stages.h"
+#include "helios_prof.h"
 #define NSCALERS 12
+#define PR_UNPACK  0 //stages timed with -DHELIOS_PROF, see helios_prof.h
+#define PR_GAIN    1
+#define PR_ENERGY  2
+#define PR_KIN     3
+#define PR_FILL    4 //the gate tests and the tree are within it
+#define PR_GATES   5
+#define PR_TREE    6
+#define PR_SCALERS 7
 
 TFile *f; //used to create ROOT file
 TFile *cutfile;
 Float_t totals[NSCALERS];
 Int_t stopped;
+ScalerWriter Scaler; //writes scalers.dat off the sort thread, see helios_scaler.h
+Bool_t DoScalerTree=kTRUE; //<--------write the scaler history to the ROOT file, tree "scalers"
 
 //Structures and Physical Constants
 Float_t pi=4.0*atan(1.0); 
 Float_t MeV=1.602E-13; //J/Mev
 Float_t active=50; //Length of active area in mm
 char buffer [50];
-Int_t iter=0;     //used for debugging (set number of print-to-screen occurrences)
-Int_t Counts[24]; //used to monitor the counts in each detector for each run
+HTLS Int_t iter=0;     //used for debugging (set number of print-to-screen occurrences)
+HTLS Int_t Counts[24]; //used to monitor the counts in each detector for each run
+Int_t *CountsSort;     //Counts[] of the thread that ran userentry(), which usermerge() adds to
 
 //Experimental Setup
 TString deltaZ="500_alpha"; // <--------Enter nominal target-detector separation here (in mm)
@@ -90,6 +114,21 @@ Float_t slopeT=-18.01; //time dispersion in ns/channel
 		        1, 1, 1, 1, 0, 1};
    		     //19,20,21,22,23,24
 
+//Array Wiring: re-maps raw ADC (5x16) channels to detector (24x3) signals
+Int_t MapDet[5][16]={{ 1, 0, 5, 4, 3, 2, 1, 0, 3, 2, 1, 0, 5, 4, 3, 2},
+		       {11,10, 9, 8, 7, 6, 5, 4, 7, 6,11,10, 9, 8, 7, 6},
+ 		       {15,14,13,12,11,10, 9, 8,17,16,15,12,14,13,16,17},
+//		       {15,14,13,12,11,10, 9, 8,17,16,15,14,13,12,17,16},  //Note difference
+// from straight-cable wiring.
+                       {20,21,22,23,18,19,20,21,12,13,14,15,16,17,18,19},
+                       {-1,-1,-1,-1,-1,-1,-1,-1,22,23,18,19,20,21,22,23}}; //on ADC5, no 0-7
+Int_t MapSig[5][16]={{ 1, 1, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 1, 1, 1, 1},  //0->E, 1->XF, 2->XN
+                       { 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1},
+                       { 0, 0, 0, 0, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 0, 0},
+                       { 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 0, 0},
+		       {-1,-1,-1,-1,-1,-1,-1,-1, 1, 1, 2, 2, 2, 2, 2, 2}};
+Int_t MapSlot[NADC*NCHAN]; //flat (adc,chan)->Data slot table, built by buildmap() in userentry()
+
 //Calibration
 Int_t DoCal[4]={0,0,0,0};
 /*Set Calibration level: 
@@ -165,59 +204,49 @@ TString name;
 //TH2F *hist;
 
 /* 2-D histograms */
-TH2F *hADC[7];
+HTLS H2I *hADC[7];
 
-TH2F *hE,*hXN,*hXF,*hT;
+HTLS H2F *hE,*hXN,*hXF,*hT;
 
-TH2F *hXFXN[24];
-TH2F *hEDiff[24];
-TH2F *hESum[24];
+HTLS H2F *hXFXN[24];
+HTLS H2F *hEDiff[24];
+HTLS H2F *hESum[24];
 
-TH1F *hEdXF[24];
-TH1F *hEdXN[24];
+HTLS H1F *hEdXF[24];
+HTLS H1F *hEdXN[24];
 
-TH2F *hEXF[24];
-TH2F *hEXN[24];
+HTLS H2F *hEXF[24];
+HTLS H2F *hEXN[24];
 
 
-TH2F *hESums[24];
-TH2F *hESumx[24];
-TH2F *hEXxup[24];
-TH2F *hEXxdown[24];
+HTLS H2F *hESums[24];
+HTLS H2S *hESumx[24];
+HTLS H2S *hEXxup[24];
+HTLS H2S *hEXxdown[24];
 
-TH2F *hEDiffx[24];
-TH2F *hEXxleft[24];
-TH2F *hEXxright[24];
-TH2F *hEX2x[24];
+HTLS H2S *hEDiffx[24];
+HTLS H2S *hEXxleft[24];
+HTLS H2S *hEXxright[24];
+HTLS H2S *hEX2x[24];
 
-TH2F *hEX[24];
-TH2F *hEXg[24];
-TH2F *hEXag[24];
-TH2F *hEXw[24];
-TH2F *hEXx[24];
-TH2F *hET[25];
-TH2F *hEcT[25];
-TH2F *hTX[24];
+HTLS H2F *hEX[24];
+HTLS H2F *hEXg[24];
+HTLS H2S *hEXag[24];
+HTLS H2F *hEXw[24];
+HTLS H2S *hEXx[24];
+HTLS H2F *hET[25];
+HTLS H2F *hEcT[25];
+HTLS H2F *hTX[24];
 
-TH2F *hEcX[24];
+HTLS H2F *hEcX[24];
 
-TH2F *hEZ,*hEZSides,*hEcZ,*hEcmZ,*hEZg;
-TH2F *hQZ,*hQTheta;
-TH2F *hThetaZ,*hEcTheta,*hEZ0,*hETOF,*hEZw,*hEcTheta2;
+HTLS H2F *hEZ,*hEZSides,*hEcZ,*hEcmZ,*hEZg;
+HTLS H2F *hQZ,*hQTheta;
+HTLS H2F *hThetaZ,*hEcTheta,*hEZ0,*hETOF,*hEZw,*hEcTheta2;
 
 TCutG *cTime2D; 
 TCutG *cScat;
 
-/* function to count the number of set bits inTH2F a 16 bit word */
-Int_t cntbit(Int_t word)
-{
-  Int_t nbits=0;
-  for (Int_t ibit=0; ibit<16; ibit++) {
-    if (word & (Int_t) TMath::Power(2,ibit)) {nbits++;}
-  }
-  return nbits;
-}
-
 //Int_t readcuts(Char_t *cfn="time_cuts.root"){
 Int_t readcuts(Char_t *cfn) {
   cutfile=new TFile(cfn);
@@ -229,27 +258,65 @@ Int_t readcuts(Char_t *cfn) {
   return 0;
 }
 
-Bool_t cexists(Char_t *cutname)
-{
-
-   Bool_t returnvalue=kFALSE;
-   if (gROOT->FindObjectClassName(cutname)) returnvalue=kTRUE;
-   return returnvalue;
-}
-
-
-/* function to see if x and y are within the boundries of a TCugG */
-Bool_t checkcutg(Char_t *cutname,Float_t x, Float_t y)
-{
-   Bool_t returnvalue=kFALSE;
-   if (cexists(cutname)) {
-      TCutG *gcut=(TCutG *) gROOT->GetListOfSpecials()->FindObject(cutname);
-      if (gcut->IsInside(x,y)==1) returnvalue=kTRUE;
-      return returnvalue;
-   } else {
-     return returnvalue;
-   }
-}
+//Gates used per hit, resolved by name from the loaded cuts in userentry()
+Gate gTime2D; //cTime2D
+Bool_t RasterGates=kTRUE; //<--------look gates up on a grid of their histogram's bins
+
+//Define software thresholds
+const Int_t lowthr=75;  //Sets cut-off channel number in detector spectra
+const Int_t minTime=28; //Sets cut-off channel number in time spectra 
+
+//Hit cache (see helios_hitcache.h): with DoHitCache, the first sort of a run writes the
+//hits past the thresholds to run.hits, named after the run's first event file
+//(deltaZ.hits under daphne, kept while the settings are the same); helios_offline_sort
+//given that file sorts from it instead of the raw events.  Raw ADC spectra are not
+//refilled from a cache.
+Bool_t DoHitCache=kFALSE; //<--------write the hit cache when there is none for these events
+HCHeader HitCacheHdr;    //thresholds, detectors, channel map and event files of this sort's hits
+FILE *HitCacheFile;      //cache being written; 0 if none
+Bool_t HitCacheWhole;    //the run's stop was sorted, so the cache holds all of it
+HTLS HCHits *HitCache;   //this thread's chunk being written
+HTLS HCHits *HitChunk;   //chunk being read by userhits()
+
+//Calibration stages (see helios_stages.h): with DoStages, a sort from run.hits keeps the
+//output of each stage of calblock() in run.stage1 (gain-matched), .stage2
+//(energy-calibrated) and .stage3 (kinematics), and a resort of that cache recomputes
+//only from the first stage whose coefficients or levels have changed.  The gates are
+//applied afresh by every sort.
+Bool_t DoStages=kFALSE; //<--------keep the calibration stages of a hit cache sort
+#define STRAW  0       //stages: the raw hits, in the hit cache
+#define STGAIN 1       //XF, XN and x gain-matched
+#define STECAL 2       //E, T and x calibrated, Z and the weight
+#define STKIN  3       //kinematics and Q-value
+#define NSTAGES 4
+StageFile Stage[NSTAGES]; //[STGAIN] to [STKIN]; files being written have fp set
+Int_t StageFrom=STGAIN;   //first stage recomputed from the hits
+HTLS ULong64_t ChunkHash; //cache chunk whose hits are in the block
+
+//Hit tree: the calibrated hits, one entry each, in tree "hits" of deltaZ_hits.root, for
+//projections made later (TTree::Draw(), RDataFrame) without a resort.  One branch per
+//column, in baskets large enough to read quickly.
+Bool_t DoTree=kFALSE; //<--------write the hit tree
+#define TREEBASKET 256000  //bytes per basket
+#define TREEZIP    404     //compression: LZ4, level 4
+
+#define TG_EDIFF 0x01 //gate bits of a hit: goodEDiff
+#define TG_ESUM  0x02 //goodESum
+#define TG_X     0x04 //position gate
+#define TG_TIME  0x08 //time gate (cTime2D)
+#define TG_TOF   0x10 //TOF gate
+#define TG_E     0x20 //energy gate of hXFXN
+struct TreeRow {
+  Int_t i;                //detector 0-23
+  Float_t e,xf,xn,x,Z,E,Q,theta,TOF,t,weight;
+  UInt_t gates;
+};
+TFile *TreeFile;
+TTree *HitTree;
+TreeRow Row;              //the branches' buffer
+#ifdef HELIOS_THREADS
+pthread_mutex_t TreeLock=PTHREAD_MUTEX_INITIALIZER; //one thread fills HitTree at a time
+#endif
 
 
 int readcal(Char_t *calfile)
@@ -454,10 +521,82 @@ int readcal(Char_t *calfile)
   return 0;
 }
 
+/* Weighting functions:  Effic[][] holds, per detector position, a 10-term polynomial in x
+ * whose inverse is the relative efficiency weight.  buildweight() tabulates the normalized
+ * weight of each position once, when readweight() loads the file, as value and slope
+ * per bin over WXMIN<=x<WXMAX, so detweight() is one table read and an interpolation.
+ * The bins are fine enough that the tabulated weight matches the polynomial to float
+ * precision; x outside the table falls back to the polynomial.
+ */
+#define NWBIN 4096
+#define WXMIN (-0.5)
+#define WXMAX 1.5
+
+struct WeightTab {
+  Double_t effic[10];    //Effic[] polynomial of the position
+  Float_t wnorm;         //average p0, scaled by the number of detectors at the position
+  Float_t w[NWBIN][2];   //weight at the low edge of each bin, and its change across the bin
+};
+WeightTab WTab[6];
+Int_t nAtPos[7];  //detectors included at each of the 6 positions; [6] is the largest
+
+void countpositions()
+{
+  for(Int_t i=0;i<7;i++) nAtPos[i]=0;
+  for(Int_t i=0;i<24;i++)if(include[i])nAtPos[i%6]++; //Stores the # of detectors at each position
+  for(Int_t i=0;i<6;i++)if(nAtPos[i]>nAtPos[6])nAtPos[6]=nAtPos[i];  //Finds the maximum # of detectors at a given position
+}
+
+/* normalized weight at x from the polynomial itself */
+inline Float_t polyweight(const WeightTab &wt,Double_t x)
+{
+  const Double_t *p=wt.effic;
+  Double_t poly=p[9];
+  for(Int_t j=8;j>=0;j--) poly=poly*x+p[j];
+  return wt.wnorm/poly;
+}
+
+void buildweight()
+{
+  countpositions();
+  Float_t p0av=0;
+  for(Int_t i=0;i<6;i++) p0av+=Effic[i][0]/nAtPos[i]*nAtPos[6];
+  p0av=p0av/6; //average p0 value to normalize to
+  Double_t dx=(WXMAX-WXMIN)/NWBIN;
+  for(Int_t pos=0;pos<6;pos++){
+    WeightTab &wt=WTab[pos];
+    for(Int_t j=0;j<10;j++) wt.effic[j]=Effic[pos][j];
+    wt.wnorm=p0av*((Float_t)nAtPos[pos]/nAtPos[6]);
+    Double_t lo=polyweight(wt,WXMIN);
+    for(Int_t b=0;b<NWBIN;b++){
+      Double_t hi=polyweight(wt,WXMIN+(b+1)*dx);
+      wt.w[b][0]=lo;
+      wt.w[b][1]=hi-lo;
+      lo=hi;
+    }
+  }
+  printf("Weighting functions tabulated: %d bins per position over %4.1f<x<%4.1f\n",NWBIN,WXMIN,WXMAX);
+}
+
+/* Weighting function of detector i at position x, normalized to the average "p0"
+ * parameter and scaled to the number of detectors at its position.
+ */
+inline Float_t detweight(Int_t i,Float_t x)
+{
+  const WeightTab &wt=WTab[i%6];
+  Float_t u=(x-WXMIN)*(NWBIN/(WXMAX-WXMIN));
+  if(u>=0&&u<NWBIN){
+    Int_t b=(Int_t)u;
+    return wt.w[b][0]+wt.w[b][1]*(u-b);
+  }
+  return polyweight(wt,x);
+}
+
 int readweight(Char_t *calfile="calibration.cal")
 {
   ifstream infile(calfile);
   Float_t detno=0;
+  Float_t row[sizeof(ECal[0])/sizeof(ECal[0][0])]; //rows are ECal-length; the first 10 are used
   printf("Reading in Efficiency File \"%s\"\n",calfile);
   for(Int_t i=0;i<24;i++){
     infile>>detno; //First number in each row is detector number
@@ -465,8 +604,9 @@ int readweight(Char_t *calfile="calibration.cal")
       printf("Efficiency File Corrupt on line %2d!\n",i);
       userexit();
     }
-    for(Int_t j=0;j<sizeof(ECal[0])/sizeof(ECal[0][0]);j++){
-      infile>>Effic[i][j];
+    for(Int_t j=0;j<sizeof(row)/sizeof(row[0]);j++) infile>>row[j];
+    for(Int_t j=0;j<10;j++){
+      Effic[i][j]=row[j];
       if(Effic[i][0]!=0){
 	if(j==0) printf("%2d ",i+1);
 	printf("%7.0f ",Effic[i][j]); 
@@ -475,8 +615,111 @@ int readweight(Char_t *calfile="calibration.cal")
     if(Effic[i][0]!=0) cout<<endl;
   }
   infile.close();	
+  buildweight();
   return 0;
 }
+
+/* Calibration coefficients:  the DoCal[] levels and ECal[][] constants are fixed for a sort,
+ * so buildcal() resolves them once, in userentry(), into per-detector coefficients held as
+ * arrays over the detectors.  A correction that is switched off for a detector gets
+ * coefficients that leave the value unchanged (unit gain, zero offset, zero correction), so
+ * every hit of a level goes through the same arithmetic and calblock() runs each level as
+ * one branch-free loop over a block of hits, which the compiler vectorises.  Divisions are
+ * folded into products, quadratic corrections into vertices and polynomials into Horner
+ * form, so the hit loop calls no pow().  The gates test a single flag each instead of the
+ * DoCut[]/DoCal[] pair.
+ */
+struct CalCoef {
+  Float_t gf[NDET],gn[NDET];     //Position Level [1]: XF and XN gains
+  Float_t sslope[NDET],soff[NDET];//Position Level [2]: ECal[15], ECal[16]/2
+  Float_t exa[NDET],exv[NDET];   //Energy Level [1]: ECal[20], vertex ECal[19]/(2*ECal[20])
+  Float_t eoff[NDET],einv[NDET]; //Energy Level [2]: ECal[1], 1/ECal[0]
+  Float_t twcut[NDET],twa[NDET],twv[NDET]; //Time Level [1]: ECal[9], ECal[11], vertex ECal[10]/(2*ECal[11])
+  Float_t tlin[NDET];            //Time Level [2]: ECal[12]
+  Float_t tx[4][NDET];           //Time Level [3]: ECal[3]..ECal[6]
+  Float_t toff[NDET],tinv[NDET]; //Time Level [4]: ECal[8], 1/ECal[7]
+  Float_t xslope[NDET];          //Position Level [3]: ECal[13]
+  Float_t zorigin[NDET];         //Z (mm) of x=0 on the detector, offset correction included
+  Float_t qoff[NDET],qinv[NDET]; //Q-Value: ECal[18], 1/ECal[17]
+};
+CalCoef Cal;
+KinConst Kin;     //folded kinematic constants, see helios_kin.h
+
+Bool_t CalXFXN,CalEX,CalMeV,CalTime,CalTX,CalTns,CalXSlope,CalQ; //levels switched on, from DoCal[]
+Bool_t GateE,GateX,GateT,GateTOF,GateSum; //cut applied, from DoCut[] and the calibration level
+
+/* Builds the per-detector coefficients from DoCal[] and ECal[][], and the kinematic
+ * constants.  Call after readcal().
+ */
+void buildcal()
+{
+  countpositions(); //for the position summary printed by userdecode()
+  CalXFXN  =(DoCal[1]!=0);
+  CalEX    =(DoCal[0]!=0);
+  CalMeV   =(DoCal[0]>1);
+  CalTime  =(DoCal[0]>1&&DoCal[1]); //Time calibration is meaningless without energy calibration and rudimentary position calibration.
+  CalTX    =(CalTime&&DoCal[1]>2);
+  CalTns   =(CalTime&&DoCal[2]==4);
+  CalXSlope=(DoCal[1]!=0);
+  CalQ     =(DoCal[3]!=0);
+  for(Int_t i=0;i<NDET;i++){
+    const Float_t *c=ECal[i];
+    Cal.gf[i]=1;
+    Cal.gn[i]=1;
+    if(c[2]<-1) Cal.gn[i]=-c[2];
+    else if(c[2]!=-1) Cal.gf[i]=-1/c[2];
+    Cal.sslope[i]=c[15];
+    Cal.soff[i]=c[16]/2;
+    Cal.exa[i]=c[20];
+    Cal.exv[i]=c[20] ? c[19]/(2*c[20]) : 0;
+    Cal.eoff[i]=c[1];
+    Cal.einv[i]=1/c[0];
+    Cal.twcut[i]=c[9];
+    Cal.twa[i]=c[11];
+    Cal.twv[i]=c[11] ? c[10]/(2*c[11]) : 0;
+    Cal.tlin[i]=c[12];
+    for(Int_t p=0;p<4;p++) Cal.tx[p][i]=c[3+p];
+    Cal.toff[i]=c[8];
+    Cal.tinv[i]=1/c[7];
+    Cal.xslope[i]=c[13];
+    Cal.zorigin[i]=-positions[(6-(i%6))]-active/2+positions[0]-ECal[0][14]; //one global offset, first row
+    Cal.qoff[i]=c[18];
+    Cal.qinv[i]=1/c[17];
+  }
+  GateE  =(DoCut[0]!=0);
+  GateX  =(DoCut[1]!=0);
+  GateT  =(DoCut[2]!=0&&DoCal[2]>=4);
+  GateTOF=(DoCut[3]!=0&&DoCal[0]>=1);
+  GateSum=(DoCut[4]!=0&&DoCal[1]>=2);
+  kinbuild(Kin,mass,MeV,Vcm,Tcyc,slopeEcm,intercepts[0],29.984/28.976);
+  printf("Calibration built: E%d X%d T%d Q%d\n",DoCal[0],DoCal[1],CalTime ? DoCal[2] : 0,DoCal[3]);
+}
+
+/* Hit blocks:  userdecode() works in three passes over a block of hits held as arrays
+ * (structure of arrays) rather than one hit at a time.  unpackhits() decodes an event,
+ * applies the software thresholds and appends the surviving hits; calblock() runs the
+ * calibration and kinematics over the whole block, one loop per step; fillblock() then
+ * fills the histograms hit by hit, in event order.  A block holds one event for
+ * userdecode(), or many for userbatch().
+ */
+#define HITBLOCK 1024 //hits per block
+
+struct HitBlock {
+  Int_t n;
+  Int_t det[HITBLOCK];      //detector 0-23
+  Int_t evt[HITBLOCK];      //event within the block; an event's hits are consecutive
+  Float_t e[HITBLOCK],xf[HITBLOCK],xn[HITBLOCK],t[HITBLOCK];
+  Float_t ch[HITBLOCK];     //e after the position correction, before the MeV calibration
+  Float_t x0[HITBLOCK];     //x before the slope correction
+  Float_t x[HITBLOCK],Z[HITBLOCK],weight[HITBLOCK];
+  Float_t E[HITBLOCK],Q[HITBLOCK],Z0[HITBLOCK],TOF[HITBLOCK],Ecm[HITBLOCK],theta[HITBLOCK];
+  UInt_t gates[HITBLOCK];   //gates the hit passed, TG_ bits; set by fillblock()
+};
+HTLS HitBlock *Block; //allocated by userentry() and userthread()
+
+int bookhists();
+void booktree();
+
 /* The userentry() function:  Create your ROOT objects here.  ROOT objects should always be 
  * created on the heap.  That is, always allocate the objects via the new operator.  If you 
  * intend to save your histograms to a root file, create the file in userentry().  You can also 
@@ -484,10 +727,21 @@ int readweight(Char_t *calfile="calibration.cal")
  */
 int userentry()
 {
+  buildmap(MapDet,MapSig,MapSlot); //flatten the array re-map matrices once per sort
+  profinit();
+  profname(PR_UNPACK,"unpack");
+  profname(PR_GAIN,"gain match");
+  profname(PR_ENERGY,"energy cal");
+  profname(PR_KIN,"kinematics");
+  profname(PR_FILL,"fill");
+  profname(PR_GATES," gate tests");
+  profname(PR_TREE," hit tree");
+  profname(PR_SCALERS,"scalers");
   sprintf(buffer,"%d_cuts.root",separation);
   // readcuts((Char_t*)(buffer));
 
   //readcuts("time_cuts.root"); //must be called before ROOT file is defined!(?)
+  gateresolve(gTime2D,"cTime2D");
 
   //Open ROOT file
   f = new TFile((deltaZ+".root"), "recreate");
@@ -500,6 +754,7 @@ int userentry()
 /* stopped flag for Elliot's scaler program */
   for (Int_t i=0; i<NSCALERS; i++) totals[i]=0;
   stopped = 1;
+  scopen(Scaler,NSCALERS,totals);
 //Read in calibration constants
   printf("Separation = %d mm\n",separation);
   printf("Physical Constants:\n");  
@@ -585,6 +840,36 @@ int userentry()
     minZ-=ECal[0][14];
   }
 
+  buildcal();
+  if(RasterGates) gateraster(gTime2D,256,minT,maxT,256,0,maxE); //hET binning
+  bookhists();
+  Block=new HitBlock;
+  hmaster=hlist;    //worker threads of helios_offline_sort merge into this set
+
+  UInt_t mask=0;
+  for(Int_t i=0;i<24;i++) if(include[i]) mask|=1u<<i;
+  hcsetheader(HitCacheHdr,lowthr,minTime,mask,hcchecksum(MapSlot,NADC*NCHAN));
+  HitCacheWhole=kFALSE;
+  if(DoHitCache&&!hcinputs().ncache){ //not when sorting from a cache
+    TString name=hcname(deltaZ);
+    if(!hcstale(name.Data(),HitCacheHdr))
+      printf("Hit cache %s exists; give it to helios_offline_sort to sort from its hits\n",name.Data());
+    else if((HitCacheFile=hccreate(name.Data(),HitCacheHdr))){
+      printf("Writing hits to %s\n",name.Data());
+      HitCache=hcnew();
+    }
+  }
+  if(DoTree) booktree();
+  CountsSort=Counts;
+  return 0;
+}
+
+/* Books the sort histograms using the ranges set up in userentry().  Called once by
+ * userentry() for the histograms written to the ROOT file, and once more per worker
+ * thread by userthread() when the sort is run by helios_offline_sort.
+ */
+int bookhists()
+{
 Int_t bin1=256;//Sets number of bins on most histograms to conveniently reduce memory load
 
 // 2d histograms
@@ -593,39 +878,39 @@ Int_t bin1=256;//Sets number of bins on most histograms to conveniently reduce m
     TString title="Raw ADC";
     name+=(a+1);
     title+=(a+1);
-    hADC[a]=new TH2F(name,title,1024,0,4095,16,0,16);
+    hADC[a]=hbook2i(name,title,1024,0,4096,16,0,16);
   }
  
-  hE=new  TH2F("hE","Detector Energy (1-24), ungated",1024,0,maxE,24,1,25);
-  hXF=new TH2F("hXF","Detector Position (XF), ungated",1024,0,maxX,24,1,25);
-  hXN=new TH2F("hXN","Detector Position (XN), ungated",1024,0,maxX,24,1,25);
-  hT=new  TH2F("hT","Detector vs. Time, ungated",       1024,minT,maxT,24,1,25);
+  hE=hbook2("hE","Detector Energy (1-24), ungated",1024,0,maxE,24,1,25);
+  hXF=hbook2("hXF","Detector Position (XF), ungated",1024,0,maxX,24,1,25);
+  hXN=hbook2("hXN","Detector Position (XN), ungated",1024,0,maxX,24,1,25);
+  hT=hbook2("hT","Detector vs. Time, ungated",       1024,minT,maxT,24,1,25);
 
-  hEZ=new TH2F("hEZ","Energy (MeV)  vs. Position (mm), ungated",      2048,minZ,maxZ,1024,    0,   maxE);
-  hEZg=new TH2F("hEZg","Energy (MeV)  vs. Position (mm), gated on time",      2048,minZ,maxZ,1024,    0,   maxE);
-  hEZw=new TH2F("hEZw","Energy (MeV)  vs. Position (mm), Weighted", 2048,minZ,maxZ,1024,0,maxE);
-  hEZSides=new TH2F("hEZSides","Energy (MeV)  vs. Position (mm)",2048,minZ,maxZ,bin1,0,(4*maxE));
-  hEcZ=new TH2F("hEcZ","Ecm-1/2*m*Vcm^2 (MeV)  vs. Position (mm)",2048,minZ,maxZ,1024,minEc,maxEc);
+  hEZ=hbook2("hEZ","Energy (MeV)  vs. Position (mm), ungated",      2048,minZ,maxZ,1024,    0,   maxE);
+  hEZg=hbook2("hEZg","Energy (MeV)  vs. Position (mm), gated on time",      2048,minZ,maxZ,1024,    0,   maxE);
+  hEZw=hbook2("hEZw","Energy (MeV)  vs. Position (mm), Weighted", 2048,minZ,maxZ,1024,0,maxE);
+  hEZSides=hbook2("hEZSides","Energy (MeV)  vs. Position (mm)",2048,minZ,maxZ,bin1,0,(4*maxE));
+  hEcZ=hbook2("hEcZ","Ecm-1/2*m*Vcm^2 (MeV)  vs. Position (mm)",2048,minZ,maxZ,1024,minEc,maxEc);
 
-  hEcmZ=new TH2F("hEcmZ","[(Ecm from Vo) -1/2*m*Vcm^2] vs. Position (mm)",    2048,minZ,maxZ,1024,minEc,   maxEc);
+  hEcmZ=hbook2("hEcmZ","[(Ecm from Vo) -1/2*m*Vcm^2] vs. Position (mm)",    2048,minZ,maxZ,1024,minEc,   maxEc);
 
-  hEcTheta =new TH2F("hEcTheta" ,"CoM Energy (MeV) vs. CoM angle (deg)",  2048,minq,maxq,1024,minEc,maxEc);
-  hEcTheta2=new TH2F("hEcTheta2","CoM Energy (MeV) vs. CoM angle (deg)", 2048,minq,maxq,1024,minEc,maxEc);
+  hEcTheta =hbook2("hEcTheta" ,"CoM Energy (MeV) vs. CoM angle (deg)",  2048,minq,maxq,1024,minEc,maxEc);
+  hEcTheta2=hbook2("hEcTheta2","CoM Energy (MeV) vs. CoM angle (deg)", 2048,minq,maxq,1024,minEc,maxEc);
 
-  hQZ=new TH2F("hQZ","Q-Value (MeV)  vs. Position (mm)",2048,minZ,maxZ,1024,minQ,maxQ);
-  hQTheta =new TH2F("hQTheta" ,"Q-Value (MeV) vs. CoM angle (deg)",  2048,minq,maxq,1024,minQ,maxQ);
+  hQZ=hbook2("hQZ","Q-Value (MeV)  vs. Position (mm)",2048,minZ,maxZ,1024,minQ,maxQ);
+  hQTheta =hbook2("hQTheta" ,"Q-Value (MeV) vs. CoM angle (deg)",  2048,minq,maxq,1024,minQ,maxQ);
 
-  hEZ0=new TH2F("hEZ0","Measued Energy (MeV)  vs. Calculated Axis Intercept (mm)",2048,minZ,maxZ,1024,0,   maxE); 
-  hETOF=new TH2F("hETOF","Energy (MeV) vs. Reconstructed Time of Flight (ns)",            2048,0,2*Tcyc,1024,0,maxE);
+  hEZ0=hbook2("hEZ0","Measued Energy (MeV)  vs. Calculated Axis Intercept (mm)",2048,minZ,maxZ,1024,0,   maxE); 
+  hETOF=hbook2("hETOF","Energy (MeV) vs. Reconstructed Time of Flight (ns)",            2048,0,2*Tcyc,1024,0,maxE);
 
-  hThetaZ=new TH2F("hThetaZ","Position vs. CoM angle",    bin1,0,1,3*bin1,0,maxE);
+  hThetaZ=hbook2("hThetaZ","Position vs. CoM angle",    bin1,0,1,3*bin1,0,maxE);
     
   for(int a=0;a<24;++a){
     TString name="hXFXN";
     TString title="XF vs. XN detector ";
     name+=(a+1);
     title+=(a+1);
-    hXFXN[a]=new TH2F(name,title,bin1,0,maxX,bin1,-maxX/8,maxX);
+    hXFXN[a]=hbook2(name,title,bin1,0,maxX,bin1,-maxX/8,maxX);
   }
 
 for(int a=0;a<24;++a){
@@ -633,7 +918,7 @@ for(int a=0;a<24;++a){
     TString title="E vs. XF detector ";
     name+=(a+1);
     title+=(a+1);
-    hEXF[a]=new TH2F(name,title,bin1,0,maxX,bin1,0,maxX);
+    hEXF[a]=hbook2(name,title,bin1,0,maxX,bin1,0,maxX);
   }
 
 for(int a=0;a<24;++a){
@@ -641,7 +926,7 @@ for(int a=0;a<24;++a){
     TString title="E vs. XN detector ";
     name+=(a+1);
     title+=(a+1);
-    hEXN[a]=new TH2F(name,title,bin1,0,maxX,bin1,0,maxX);
+    hEXN[a]=hbook2(name,title,bin1,0,maxX,bin1,0,maxX);
   }
 
   for(int a=0;a<24;++a){
@@ -649,7 +934,7 @@ for(int a=0;a<24;++a){
     TString title="E[uncal.] vs.(XF-XN) detector ";
     name+=(a+1);
     title+=(a+1);
-    hEDiff[a]=new TH2F(name,title,bin1,-maxX,maxX,bin1,0,maxX);
+    hEDiff[a]=hbook2(name,title,bin1,-maxX,maxX,bin1,0,maxX);
   }
 
  for(int a=0;a<24;++a){
@@ -657,7 +942,7 @@ for(int a=0;a<24;++a){
     TString title="XF/E detector ";
     name+=(a+1);
     title+=(a+1);
-    hEdXF[a]=new TH1F(name,title,bin1,-scaleX,1+scaleX);
+    hEdXF[a]=hbook1(name,title,bin1,-scaleX,1+scaleX);
   }
 
  for(int a=0;a<24;++a){
@@ -665,7 +950,7 @@ for(int a=0;a<24;++a){
     TString title="XN/E detector ";
     name+=(a+1);
     title+=(a+1);
-    hEdXN[a]=new TH1F(name,title,bin1,-scaleX,1+scaleX);
+    hEdXN[a]=hbook1(name,title,bin1,-scaleX,1+scaleX);
   }
 
   for(int a=0;a<24;++a){
@@ -673,7 +958,7 @@ for(int a=0;a<24;++a){
     TString title="E[uncal.] vs.(XF-XN), Outside Range det. ";
     name+=(a+1);
     title+=(a+1);
-    hEDiffx[a]=new TH2F(name,title,bin1,-maxX,maxX,bin1,0,maxX);
+    hEDiffx[a]=hbook2s(name,title,bin1,-maxX,maxX,bin1,0,maxX);
   }
 
   for(int a=0;a<24;++a){
@@ -681,7 +966,7 @@ for(int a=0;a<24;++a){
     TString title="E[uncal.] vs. (XN+XF) det. ";
     name+=(a+1);
     title+=(a+1);
-    hESum[a]=new TH2F(name,title,3*bin1,0,maxX,3*bin1,0,maxX);
+    hESum[a]=hbook2(name,title,3*bin1,0,maxX,3*bin1,0,maxX);
   }
 
   for(int a=0;a<24;++a){
@@ -689,7 +974,7 @@ for(int a=0;a<24;++a){
     TString title="E[uncal.]-(XF+XN) vs. (XN+XF) det. ";
     name+=(a+1);
     title+=(a+1);
-    hESums[a]=new TH2F(name,title,3*bin1,0,maxX,3*bin1,-2048,1024);
+    hESums[a]=hbook2(name,title,3*bin1,0,maxX,3*bin1,-2048,1024);
   }
   
   for(int a=0;a<24;++a){
@@ -697,7 +982,7 @@ for(int a=0;a<24;++a){
     TString title="E[uncal.] vs. (XN+XF), !goodESum det. ";
     name+=(a+1);
     title+=(a+1);
-    hESumx[a]=new TH2F(name,title,3*bin1,0,maxX,3*bin1,0,maxX);
+    hESumx[a]=hbook2s(name,title,3*bin1,0,maxX,3*bin1,0,maxX);
   }
   
   for(int a=0;a<24;++a){
@@ -705,14 +990,14 @@ for(int a=0;a<24;++a){
     TString title="E vs. 1/2{1+[(XF-XN)/(XF+XN)]} det. ";
     name+=(a+1);
     title+=(a+1);
-    hEX[a]=new TH2F(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxE);
+    hEX[a]=hbook2(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxE);
   }
  for(int a=0;a<24;++a){
     TString name="hEXg";
     TString title="E vs. 1/2{1+[(XF-XN)/(XF+XN)]}, gated det. ";
     name+=(a+1);
     title+=(a+1);
-    hEXg[a]=new TH2F(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxE);
+    hEXg[a]=hbook2(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxE);
   }
 
  for(int a=0;a<24;++a){
@@ -720,7 +1005,7 @@ for(int a=0;a<24;++a){
     TString title="E vs. 1/2{1+[(XF-XN)/(XF+XN)]}, anti-gated det. ";
     name+=(a+1);
     title+=(a+1);
-    hEXag[a]=new TH2F(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxX);
+    hEXag[a]=hbook2s(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxX);
   }
 
  for(int a=0;a<24;++a){
@@ -728,7 +1013,7 @@ for(int a=0;a<24;++a){
     TString title="E vs. X (uncalibrated), !goodESum det. ";
     name+=(a+1);
     title+=(a+1);
-    hEXx[a]=new TH2F(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxX);
+    hEXx[a]=hbook2s(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxX);
   }
 
 
@@ -737,7 +1022,7 @@ for(int a=0;a<24;++a){
     TString title="E vs. X (uncalibrated), !goodEDiff det. ";
     name+=(a+1);
     title+=(a+1);
-    hEX2x[a]=new TH2F(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxX);
+    hEX2x[a]=hbook2s(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxX);
   }
 
 for(int a=0;a<24;++a){
@@ -745,7 +1030,7 @@ for(int a=0;a<24;++a){
     TString title="E vs. X (uncalibrated), Above Range det. ";
     name+=(a+1);
     title+=(a+1);
-    hEXxup[a]=new TH2F(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxX);
+    hEXxup[a]=hbook2s(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxX);
   }
 
 for(int a=0;a<24;++a){
@@ -753,7 +1038,7 @@ for(int a=0;a<24;++a){
     TString title="E[uncal] vs. X, Below Range det. ";
     name+=(a+1);
     title+=(a+1);
-    hEXxdown[a]=new TH2F(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxX);
+    hEXxdown[a]=hbook2s(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxX);
   }
 
 for(int a=0;a<24;++a){
@@ -761,7 +1046,7 @@ for(int a=0;a<24;++a){
     TString title="E vs. X (uncalibrated), Right of Range det. ";
     name+=(a+1);
     title+=(a+1);
-    hEXxright[a]=new TH2F(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxX);
+    hEXxright[a]=hbook2s(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxX);
   }
 
 for(int a=0;a<24;++a){
@@ -769,7 +1054,7 @@ for(int a=0;a<24;++a){
     TString title="E vs. X (uncalibrated), Left of Range det. ";
     name+=(a+1);
     title+=(a+1);
-    hEXxleft[a]=new TH2F(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxX);
+    hEXxleft[a]=hbook2s(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxX);
   }
 
   for(int a=0;a<25;++a){
@@ -780,7 +1065,7 @@ for(int a=0;a<24;++a){
       title+=(a+1);
     }
     else title+="all";
-    hET[a]=new TH2F(name,title,bin1,minT,maxT,bin1,0,maxE);
+    hET[a]=hbook2(name,title,bin1,minT,maxT,bin1,0,maxE);
   }
 
  for(int a=0;a<25;++a){
@@ -791,7 +1076,7 @@ for(int a=0;a<24;++a){
       title+=(a+1);
     }
     else title+="all";
-    hEcT[a]=new TH2F(name,title,bin1,minT,maxT,bin1,minEc,maxEc);
+    hEcT[a]=hbook2(name,title,bin1,minT,maxT,bin1,minEc,maxEc);
   }
 
  for(int a=0;a<24;++a){
@@ -799,7 +1084,7 @@ for(int a=0;a<24;++a){
     TString title="CoM Energy vs. X det. ";
     name+=(a+1);
     title+=(a+1);
-    hEcX[a]=new TH2F(name,title,bin1,-scaleX,1+scaleX,3*bin1,minEc,maxEc);
+    hEcX[a]=hbook2(name,title,bin1,-scaleX,1+scaleX,3*bin1,minEc,maxEc);
   }
 
   for(int a=0;a<24;++a){
@@ -807,7 +1092,7 @@ for(int a=0;a<24;++a){
     TString title="Time vs. Position det. ";
     name+=(a+1);
     title+=(a+1);
-    hTX[a]=new TH2F(name,title,bin1,-scaleX,1+scaleX,bin1,minT,maxT);
+    hTX[a]=hbook2(name,title,bin1,-scaleX,1+scaleX,bin1,minT,maxT);
   }
  
   for(int a=0;a<24;++a){
@@ -815,45 +1100,94 @@ for(int a=0;a<24;++a){
     TString title="Energy vs. Position (weighted)} det. ";
     name+=(a+1);
     title+=(a+1);
-    hEXw[a]=new TH2F(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxE);
+    hEXw[a]=hbook2(name,title,bin1,-scaleX,1+scaleX,3*bin1,0,maxE);
   }
 
   return 0;
 }
 
+/* The userthread() and usermerge() functions:  Called by helios_offline_sort (built with
+ * -DHELIOS_THREADS) at the start and end of each worker thread, one thread at a time.
+ * A worker fills its own shards of the histograms (see helios_hist.h) and its own counters,
+ * which usermerge() adds into the set booked by userentry().  daphne never calls these.
+ */
+int userthread()
+{
+  bookhists();
+  Block=new HitBlock;
+  if(HitCacheFile) HitCache=hcnew();
+  for(Int_t i=0;i<24;i++) Counts[i]=0;
+  iter=0;
+  return 0;
+}
+
+int usermerge()
+{
+  if(Counts!=CountsSort)
+    for(Int_t i=0;i<24;i++) CountsSort[i]+=Counts[i];
+  hmerge();
+  profmerge();
+  delete Block;
+  Block=0;
+  if(HitCache) hcflush(*HitCache,HitCacheFile);
+  delete HitCache;
+  delete HitChunk;
+  HitCache=HitChunk=0;
+  return 0;
+}
+
 /* function to deal with scalers, adapted from Elliot's program */
 void scalers(ScarletEvnt &e)
-{// Adapted from Kanter's scaler program
-  unsigned int *p = reinterpret_cast<unsigned int*>(e.body());
-  unsigned int ttotal, tdiff, ithscaler, ithrate;
-    FILE *sf;
-
-    /* On the first sync event after a stop, the following tests for the existence of a file
-     * called scalers.zap.  If it exists, the scaler totals are reset.
-     */
-    if(stopped){
-        struct stat st;
-        stopped=0;
-        if(stat("scalers.zap",&st)==0){
-	  for(Int_t i=0;i<NSCALERS;++i)
-	    totals[i]=0.0;
-        }
-    }
+{
+  PROF(PR_SCALERS);
+  scpush(Scaler,reinterpret_cast<unsigned int*>(e.body()),stopped); //totals, zap check and file by the writer thread
+  stopped=0;
+}
 
-    if((sf=fopen("scalers.dat","w"))==0) return;
-    ttotal=*p++;
-    tdiff=*p++;
-    fprintf(sf,"%u %u\n",ttotal,tdiff);
-    for(int i=0;i<NSCALERS;++i){
-      ithscaler=*p++ & 0x00ffffff;
-      totals[i]+=ithscaler;
-      ithrate=tdiff!=0 ? ithscaler/tdiff : 0;
-      fprintf(sf,"%.0f %u\n",totals[i],ithrate);
-    }
-    fclose(sf);
+/* Appends hit i of an event, from its raw E, XF and XN and the event's TAC channel, to b
+ * if it passes the thresholds, tagged with event number evt.  The hit's raw spectra are
+ * filled here.  Returns 1 if the hit was kept.
+ */
+Int_t addhit(HitBlock &b,Int_t evt,Int_t i,Int_t rawe,Int_t rawxf,Int_t rawxn,Int_t time)
+{
+  Float_t t=time;//required to change the raw (integer) time to foating point for calibration
+  Float_t e=rawe,xf=rawxf,xn=rawxn;
+    
+  if(i==(13-1)){
+    xn=1.368*xn;//Eneter slope and intercept of the left-hand side of hEdiff 
+    //plot with XF=0, i.e., slope of E=-XN line.
+    xf=e-xn;
+  }
+    
+  //if((e>lowthr)&&(t>minTime)&&include[i]){ //Tests energy signal against "lowthr"
+  //if((e>lowthr)&&(xn>lowthr)&&(t>minTime)&&include[i]){ //Tests two signals against "lowthr"
+  if((e>lowthr)&&(xf>lowthr)&&(xn>lowthr)&&(t>minTime)&&include[i]){ //Tests all three signals against "lowthr"
+    Counts[i]=Counts[i]+1; //Stores counts per detector
+      
+    hEdXF[i]->Fill(xf/e);
+    hEdXN[i]->Fill(xn/e);
+    hEXF[i]->Fill(xf,e);
+    hEXN[i]->Fill(xn,e);
+
+    Int_t k=b.n++;
+    b.det[k]=i;
+    b.evt[k]=evt;
+    b.e[k]=e;
+    b.xf[k]=xf;
+    b.xn[k]=xn;
+    b.t[k]=t;
+    return 1;
+  }
+  return 0;
 }
 
-int userdecode(ScarletEvnt &event){
+/* Unpacks one event and appends its hits that pass the thresholds to b, tagged with event
+ * number evt, and to this thread's hit cache chunk when one is being written.  The raw
+ * histograms are filled here.  Needs room for NDET hits.
+ */
+void unpackhits(ScarletEvnt &event,HitBlock &b,Int_t evt)
+{
+  PROF(PR_UNPACK);
   ScarletEvnt subevent1;
   Int_t dataword;
   subevent1=event[1];
@@ -868,22 +1202,7 @@ int userdecode(ScarletEvnt &event){
    * scheme (5x16) and then mapped to an array scheme (24x3).  
    */
   Int_t time;
-  Int_t nhits[5]={0,0,0,0,0};
-  Int_t Chan[5][16];
-  Int_t RawData[5][16];
-  Int_t Data[24][3];
-  Int_t MapDet[5][16]={{ 1, 0, 5, 4, 3, 2, 1, 0, 3, 2, 1, 0, 5, 4, 3, 2},
-		       {11,10, 9, 8, 7, 6, 5, 4, 7, 6,11,10, 9, 8, 7, 6},
- 		       {15,14,13,12,11,10, 9, 8,17,16,15,12,14,13,16,17},
-//		       {15,14,13,12,11,10, 9, 8,17,16,15,14,13,12,17,16},  //Note difference
-// from straight-cable wiring.
-                       {20,21,22,23,18,19,20,21,12,13,14,15,16,17,18,19},
-                       {-1,-1,-1,-1,-1,-1,-1,-1,22,23,18,19,20,21,22,23}}; //on ADC5, no 0-7
-  Int_t MapSig[5][16]={{ 1, 1, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 1, 1, 1, 1},  //0->E, 1->XF, 2->XN
-                       { 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1},
-                       { 0, 0, 0, 0, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 0, 0},
-                       { 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 0, 0},
-		       {-1,-1,-1,-1,-1,-1,-1,-1, 1, 1, 2, 2, 2, 2, 2, 2}};
+  Int_t Data[NDET+1][NSIG]; //row NDET is scratch for unmapped channels
 
   for(Int_t i=0;i<24;i++){
     Data[i][0]=0;
@@ -895,324 +1214,592 @@ int userdecode(ScarletEvnt &event){
   dataword=*p1++;
   time=(dataword & 0x00000fff);
    
-  for(Int_t nadc=0;nadc<5;nadc++){ //loop over ADCs 1-5
-    dataword=*p1++;
-    nhits[nadc]=cntbit(dataword); //determines number of hits in ADC 
-                                  //by counting set bits (ones) in hit register
-    for(Int_t i=0;i<nhits[nadc];i++){ //loop over number of ADC hits, if any
-      dataword=*p1++;
-      
-      /*Read in raw ADC data and fill ADC histograms*/
-      Chan[nadc][i]=((dataword & 0x0000f000)>>12);
-      RawData[nadc][i]=(dataword & 0x00000fff);
-      
-      hADC[nadc]->Fill(RawData[nadc][i],Chan[nadc][i]);
-      
-      /*Re-map data from raw (5x16) configuration to detector (24x3) configuration*/
-      if(nadc>-1 && // Tests for sensible ADC and Channel numbers
-	 nadc<5  &&
-	    i>-1 &&
-	    i<16 ){
-        if((MapDet[nadc][Chan[nadc][i]])>-1&& //Tests for sensible values in re-map matrices.
-	   (MapDet[nadc][Chan[nadc][i]])<24&& //Note -1 is excluded.
-	   (MapSig[nadc][Chan[nadc][i]])>-1&&
-	   (MapSig[nadc][Chan[nadc][i]])<3){  //Re-maps "RawData" array into "Data" array
-	  Data[MapDet[nadc][Chan[nadc][i]]][MapSig[nadc][Chan[nadc][i]]]=RawData[nadc][i]; 
-	}
-      }
-    }
- }
+  p1=unpackarray(p1,MapSlot,hADC,Data); //hit pattern and data words for each of ADCs 1-5
 
   //Done unpacking event, filling raw histograms, and remapping data.
-  //Filling histograms with (24x3) detector mapping  
-  Float_t t=time;//required to change the raw (integer) time to foating point for calibration
-  Float_t e=0,xf=0,xn=0,x=0,z=0;
-  Float_t E=0,XF=0,XN=0,X=0,Z=0;
-  Float_t Q=0,ch=0;
-  Float_t Ecm=0;
-  Float_t sum=0,theta=0;
-  Float_t V=0,V0=0,Z0=0;
-  Float_t TOF=Tcyc;
-  Float_t theta2=0;
- 
-  //Define software thresholds
-  Int_t lowthr=75;  //Sets cut-off channel number in detector spectra
-  Int_t minTime=28; //Sets cut-off channel number in time spectra 
- 
+  Int_t nkept=0;
+  UChar_t cdet[NDET];
+  UShort_t ce[NDET],cxf[NDET],cxn[NDET];
+  for(Int_t i=0;i<24;i++){
+    if(addhit(b,evt,i,Data[i][0],Data[i][1],Data[i][2],time)&&HitCache){
+      cdet[nkept]=i;
+      ce[nkept]=Data[i][0];
+      cxf[nkept]=Data[i][1];
+      cxn[nkept]=Data[i][2];
+      nkept++;
+    }
+  }
+  if(nkept) hcevent(*HitCache,HitCacheFile,time,nkept,cdet,ce,cxf,cxn);
+}
+
+/* The calibration kernels:  each runs one level over the n hits of a block, looking up
+ * the coefficients in Cal[] by detector.  The arrays are distinct (__restrict), which the
+ * compiler must be told before it vectorises the loops.
+ */
+//Position Calibration Levels [1],[2] - Match XF to XN, (XF+XN) to E
+void calxfxn(Int_t n,const Int_t *__restrict det,Float_t *__restrict xf,Float_t *__restrict xn)
+{
+  for(Int_t k=0;k<n;k++){
+    Int_t d=det[k];
+    xf[k]=(xf[k]*Cal.gf[d])*Cal.sslope[d]+Cal.soff[d];
+    xn[k]=(xn[k]*Cal.gn[d])*Cal.sslope[d]+Cal.soff[d];
+  }
+}
+
+void calpos(Int_t n,const Float_t *__restrict xf,const Float_t *__restrict xn,Float_t *__restrict x)
+{
+  //x=(1/2.)*(1+((2*xf-e)/e)); //position without xn
+  //x=(1/2.)*(1+((e-2*xn)/e)); //position without xf
+  for(Int_t k=0;k<n;k++)
+    x[k]=(1/2.)*(1+((xf[k]-xn[k])/(xf[k]+xn[k]))); //Position on detector with XN@x=0 and XF@x=1.  
+  //Please note at this point that the array PCBs are 
+  //wired backwards, so "X-Far" is closest to the 
+  //target and "X-Near" is further away.
+}
+
+//Energy Calibration Level [1] - Correct position-dependance of energy
+void calex(Int_t n,const Int_t *__restrict det,const Float_t *__restrict x,Float_t *__restrict e)
+{
+  for(Int_t k=0;k<n;k++){
+    Int_t d=det[k];
+    Float_t dx=x[k]+Cal.exv[d];
+    e[k]=e[k]-Cal.exa[d]*dx*dx;
+  }
+}
+
+//Energy Calibration Level [2] - Calibrate Energy in MeV
+void calemev(Int_t n,const Int_t *__restrict det,Float_t *__restrict e)
+{
+  for(Int_t k=0;k<n;k++){
+    Int_t d=det[k];
+    Float_t mev=(e[k]-Cal.eoff[d])*Cal.einv[d]; //worked out for every hit, so the loop has no branch
+    e[k]=(e[k]>0) ? mev : e[k];
+  }
+}
+
+//Time Calibration Levels [1],[2] - Time Energy-Dependance Corrections, piece-wise quadratic (walk) and linear
+void caltwalk(Int_t n,const Int_t *__restrict det,const Float_t *__restrict e,Float_t *__restrict t)
+{
+  for(Int_t k=0;k<n;k++){
+    Int_t d=det[k];
+    Float_t de=e[k]+Cal.twv[d];
+    Float_t walk=Cal.twa[d]*de*de;
+    Float_t tw=(e[k]<Cal.twcut[d]) ? t[k]-walk : t[k];
+    t[k]=tw-e[k]*Cal.tlin[d];
+  }
+}
+
+//Time Calibration Level [3] - Time Position-Dependance Correction
+void caltx(Int_t n,const Int_t *__restrict det,const Float_t *__restrict x,Float_t *__restrict t)
+{
+  for(Int_t k=0;k<n;k++){
+    Int_t d=det[k];
+    Float_t u=x[k];
+    t[k]=t[k]-(((Cal.tx[3][d]*u+Cal.tx[2][d])*u+Cal.tx[1][d])*u+Cal.tx[0][d])*u;
+  }
+}
+
+//Time Calibration Level [4] - Time Calibration
+void caltns(Int_t n,const Int_t *__restrict det,Float_t *__restrict t)
+{
+  for(Int_t k=0;k<n;k++){
+    Int_t d=det[k];
+    t[k]=(t[k]-Cal.toff[d])*Cal.tinv[d]+Tcyc;
+  }
+}
+
+//Position Calibration Level [3] - Slope Correction (Relative Calibration), about x=0.5 (XF=XN),
+//which is set by both the physical layout of the detector array and the gain matching of XF &XN
+void calxslope(Int_t n,const Int_t *__restrict det,const Float_t *__restrict x0,Float_t *__restrict x)
+{
+  for(Int_t k=0;k<n;k++) x[k]=(x0[k]-0.5)*Cal.xslope[det[k]]+0.5;
+}
+
+//Position Calibration Level [4] - Offset Correction (Absolute Calibration) is folded into
+//zorigin.  Since relative positions are fixed, only one global correction is needed.
+void calz(Int_t n,const Int_t *__restrict det,const Float_t *__restrict x,Float_t *__restrict Z)
+{
+  for(Int_t k=0;k<n;k++) Z[k]=Cal.zorigin[det[k]]+active*x[k]; //position in magnet in mm
+}
+
+void calkin(Int_t n,const Float_t *__restrict e,const Float_t *__restrict Z,
+	    Float_t *__restrict E,Float_t *__restrict Q,Float_t *__restrict Z0,
+	    Float_t *__restrict TOF,Float_t *__restrict Ecm,Float_t *__restrict theta)
+{
+  for(Int_t k=0;k<n;k++){
+    KinHit kin;
+    kinematics(Kin,e[k],Z[k],kin);
+    E[k]=kin.E;         //particle energy in MeV at 90deg in lab
+    Q[k]=kin.Q;         //excitation energy in MeV
+    Z0[k]=kin.Z0;       //beam-axis intercept for given excitation energy
+    TOF[k]=kin.TOF;     //calculated time-of-flight (TOF)
+    Ecm[k]=kin.Ecm;
+    theta[k]=kin.theta; //Center of mass angle in degrees
+  }
+}
+
+//Q-Value Calibration
+void calq(Int_t n,const Int_t *__restrict det,Float_t *__restrict Q)
+{
+  for(Int_t k=0;k<n;k++){
+    Int_t d=det[k];
+    Q[k]=(Q[k]-Cal.qoff[d])*Cal.qinv[d]; //Q-Value in MeV
+  }
+}
+
+/* The stages of the calibration, each from the outputs of the one before */
+void calgain(HitBlock &b)
+{
+  PROF(PR_GAIN);
+  const Int_t n=b.n;
+  if(CalXFXN) calxfxn(n,b.det,b.xf,b.xn);
+  calpos(n,b.xf,b.xn,b.x0);
+}
+
+void calenergy(HitBlock &b)
+{
+  PROF(PR_ENERGY);
+  const Int_t n=b.n;
+  if(CalEX) calex(n,b.det,b.x0,b.e);
+  memcpy(b.ch,b.e,n*sizeof(Float_t));
+  if(CalMeV) calemev(n,b.det,b.e);
+  if(CalTime){
+    caltwalk(n,b.det,b.e,b.t);
+    if(CalTX) caltx(n,b.det,b.x0,b.t);
+    if(CalTns) caltns(n,b.det,b.t);
+  }
+  if(CalXSlope) calxslope(n,b.det,b.x0,b.x);
+  else memcpy(b.x,b.x0,n*sizeof(Float_t));
+  calz(n,b.det,b.x,b.Z);
+  for(Int_t k=0;k<n;k++) b.weight[k]=DoWeight ? detweight(b.det[k],b.x[k]) : 1;
+}
+
+void calkinematics(HitBlock &b)
+{
+  PROF(PR_KIN);
+  const Int_t n=b.n;
+  calkin(n,b.e,b.Z,b.E,b.Q,b.Z0,b.TOF,b.Ecm,b.theta);
+  if(CalQ) calq(n,b.det,b.Q);
+}
+
+/* Calibrates the hits of a block and evaluates their kinematics, one level at a time */
+void calblock(HitBlock &b)
+{
+  calgain(b);
+  calenergy(b);
+  calkinematics(b);
+}
+
+/* The outputs of a stage, as columns of a block.  Returns the number of columns. */
+Int_t stagecols(HitBlock &b,Int_t s,Float_t **c)
+{
+  switch(s){
+  case STGAIN:
+    c[0]=b.xf; c[1]=b.xn; c[2]=b.x0;
+    return 3;
+  case STECAL:
+    c[0]=b.e; c[1]=b.ch; c[2]=b.t; c[3]=b.x; c[4]=b.Z; c[5]=b.weight;
+    return 6;
+  case STKIN:
+    c[0]=b.E; c[1]=b.Q; c[2]=b.Z0; c[3]=b.TOF; c[4]=b.Ecm; c[5]=b.theta;
+    return 6;
+  }
+  return 0;
+}
+
+/* The key of each stage: a hash of the coefficients and levels it uses, chained onto
+ * the key of the stage before.  The raw hits are those of the cache being sorted, whose
+ * header names its event files and counts its events and hits.
+ */
+void stagekeys(const HCHeader &cache,ULong64_t *key)
+{
+  ULong64_t k=sthash(STSEED,&cache,sizeof(cache));
+  key[STRAW]=k;
+  k=sthash(k,&CalXFXN,sizeof(CalXFXN));
+  k=sthash(k,Cal.gf,sizeof(Cal.gf));
+  k=sthash(k,Cal.gn,sizeof(Cal.gn));
+  k=sthash(k,Cal.sslope,sizeof(Cal.sslope));
+  k=sthash(k,Cal.soff,sizeof(Cal.soff));
+  key[STGAIN]=k;
+  Bool_t levels[]={CalEX,CalMeV,CalTime,CalTX,CalTns,CalXSlope,(Bool_t)(DoWeight!=0)};
+  k=sthash(k,levels,sizeof(levels));
+  k=sthash(k,Cal.exa,sizeof(Cal.exa));
+  k=sthash(k,Cal.exv,sizeof(Cal.exv));
+  k=sthash(k,Cal.eoff,sizeof(Cal.eoff));
+  k=sthash(k,Cal.einv,sizeof(Cal.einv));
+  k=sthash(k,Cal.twcut,sizeof(Cal.twcut));
+  k=sthash(k,Cal.twa,sizeof(Cal.twa));
+  k=sthash(k,Cal.twv,sizeof(Cal.twv));
+  k=sthash(k,Cal.tlin,sizeof(Cal.tlin));
+  k=sthash(k,Cal.tx,sizeof(Cal.tx));
+  k=sthash(k,Cal.toff,sizeof(Cal.toff));
+  k=sthash(k,Cal.tinv,sizeof(Cal.tinv));
+  k=sthash(k,&Tcyc,sizeof(Tcyc));
+  k=sthash(k,Cal.xslope,sizeof(Cal.xslope));
+  k=sthash(k,Cal.zorigin,sizeof(Cal.zorigin));
+  k=sthash(k,&active,sizeof(active));
+  if(DoWeight) k=sthash(k,WTab,sizeof(WTab));
+  key[STECAL]=k;
+  k=sthash(k,&Kin,sizeof(Kin));
+  k=sthash(k,&CalQ,sizeof(CalQ));
+  k=sthash(k,Cal.qoff,sizeof(Cal.qoff));
+  k=sthash(k,Cal.qinv,sizeof(Cal.qinv));
+  key[STKIN]=k;
+}
+
+/* Opens the stage files for a sort from a hit cache, named after the first cache given:
+ * run.stage1 to run.stage3 beside run.hits.  The stages are read from their files up
+ * to the first whose key has changed, which is recomputed with every stage after it,
+ * and their files written anew.
+ */
+void stagesopen(const HCHeader &cache)
+{
+  const char *what[NSTAGES]={"raw","gain-matched","energy-calibrated","kinematics"};
+  ULong64_t key[NSTAGES];
+  Float_t *c[STCOLS];
+  char run[HCNAME];
+  strcpy(run,hcinputs().ncache ? hcinputs().cache : deltaZ.Data());
+  char *file=strrchr(run,'/');
+  file=file ? file+1 : run;
+  char *dot=strrchr(file,'.');
+  if(dot&&dot>file) *dot=0; //the extension
+  stagekeys(cache,key);
+  StageFrom=STGAIN;
+  for(Int_t s=STGAIN;s<NSTAGES;s++){
+    TString name=run;
+    name+=".stage";
+    name+=s;
+    Int_t ncols=stagecols(*Block,s,c);
+    if(StageFrom<s) remove(name.Data()); //made from a stage now recomputed
+    if(!stopen(Stage[s],name.Data(),s,ncols,key[s])){
+      printf("Stage %d (%s): reused, %d segments\n",s,what[s],Stage[s].nseg);
+      StageFrom=s+1;
+      continue;
+    }
+    printf("Stage %d (%s): recomputed\n",s,what[s]);
+  }
+}
+
+/* Calibrates the hits of a block from a cache chunk, hits first on of chunk ChunkHash,
+ * taking the stages before StageFrom from their files where they hold the hits, and
+ * writing the stages it computes to the files being written.
+ */
+void stageblock(HitBlock &b,Int_t first)
+{
+  const Int_t n=b.n;
+  Float_t *c[STCOLS];
+  if(!n) return;
+  Int_t s=STGAIN;
+  for(;s<StageFrom;s++){
+    const Float_t *p=stfind(Stage[s],ChunkHash,first,n);
+    if(!p) break;
+    Int_t ncols=stagecols(b,s,c);
+    for(Int_t j=0;j<ncols;j++) memcpy(c[j],p+j*n,n*sizeof(Float_t));
+  }
+  if(s<=STGAIN) calgain(b);
+  if(s<=STECAL) calenergy(b);
+  if(s<=STKIN) calkinematics(b);
+  for(;s<NSTAGES;s++){
+    if(!Stage[s].fp) continue;
+    Int_t ncols=stagecols(b,s,c);
+    stwrite(Stage[s],ChunkHash,first,n,ncols,c);
+  }
+}
+
+/* Creates the hit tree and its branches, in a file of its own */
+void booktree()
+{
+  TDirectory *dir=gDirectory;
+  TreeFile=new TFile((deltaZ+"_hits.root"),"recreate","",TREEZIP);
+  HitTree=new TTree("hits","Calibrated array hits");
+  HitTree->Branch("i",&Row.i,"i/I",TREEBASKET);
+  HitTree->Branch("e",&Row.e,"e/F",TREEBASKET);
+  HitTree->Branch("xf",&Row.xf,"xf/F",TREEBASKET);
+  HitTree->Branch("xn",&Row.xn,"xn/F",TREEBASKET);
+  HitTree->Branch("x",&Row.x,"x/F",TREEBASKET);
+  HitTree->Branch("Z",&Row.Z,"Z/F",TREEBASKET);
+  HitTree->Branch("E",&Row.E,"E/F",TREEBASKET);
+  HitTree->Branch("Q",&Row.Q,"Q/F",TREEBASKET);
+  HitTree->Branch("theta",&Row.theta,"theta/F",TREEBASKET);
+  HitTree->Branch("TOF",&Row.TOF,"TOF/F",TREEBASKET);
+  HitTree->Branch("t",&Row.t,"t/F",TREEBASKET);
+  HitTree->Branch("weight",&Row.weight,"weight/F",TREEBASKET);
+  HitTree->Branch("gates",&Row.gates,"gates/i",TREEBASKET);
+  printf("Writing hit tree to %s\n",(deltaZ+"_hits.root").Data());
+  dir->cd(); //histograms stay in the sort's file
+}
+
+/* Adds the hits of a filled block to the hit tree */
+void treeblock(const HitBlock &b)
+{
+#ifdef HELIOS_THREADS
+  pthread_mutex_lock(&TreeLock);
+#endif
+  for(Int_t k=0;k<b.n;k++){
+    Row.i=b.det[k];
+    Row.e=b.e[k];
+    Row.xf=b.xf[k];
+    Row.xn=b.xn[k];
+    Row.x=b.x[k];
+    Row.Z=b.Z[k];
+    Row.E=b.E[k];
+    Row.Q=b.Q[k];
+    Row.theta=b.theta[k];
+    Row.TOF=b.TOF[k];
+    Row.t=b.t[k];
+    Row.weight=b.weight[k];
+    Row.gates=b.gates[k];
+    HitTree->Fill();
+  }
+#ifdef HELIOS_THREADS
+  pthread_mutex_unlock(&TreeLock);
+#endif
+}
+
+/* Fills the gated histograms from a calibrated block, hit by hit in event order.  The
+ * good-hit tags are per event: once a hit sets one, it holds for the event's later hits.
+ */
+void fillblock(HitBlock &b)
+{
+  PROF(PR_FILL);
   //Define tags
   Bool_t goodESum=kFALSE;
   Bool_t goodEDiff=kFALSE;
   Bool_t GoodTime=kFALSE;
   Bool_t GoodScat=kFALSE;
 
-  //Initialize weighting parameters
-  Int_t w[7]={0,0,0,0,0,0,0};
-  Float_t p0av=0;  
-  Int_t entries=0;
-  Float_t weight=1;
-  for(Int_t i=0;i<24;i++)if(include[i])w[i%6]++; //Stores the # of detectors at each position
-  for(Int_t i=0;i<6;i++)if(w[i]>w[6])w[6]=w[i];  //Finds the maximum # of detectors at a given position
-  for(Int_t i=0;i<6;i++){
-    p0av+=Effic[i][0]/w[i]*w[6];
-    entries++;
-  }
-  p0av=p0av/entries; //calculates average p0 value to normalize to
-  //      if(iter==1)printf("p0 average is %5.1f for %d entries\n",p0av,entries);
-  
-  for(Int_t i=0;i<24;i++){//Start Calibration and Histogram Fill  
-    e=Data[i][0];
-    xf=Data[i][1];
-    xn=Data[i][2];
-    
-    if(i==(13-1)){
-      xn=1.368*xn;//Eneter slope and intercept of the left-hand side of hEdiff 
-      //plot with XF=0, i.e., slope of E=-XN line.
-      xf=e-xn;
-    }
-    
-  //Begin Histogram Fill   
-    //if((e>lowthr)&&(t>minTime)&&include[i]){ //Tests energy signal against "lowthr"
-    //if((e>lowthr)&&(xn>lowthr)&&(t>minTime)&&include[i]){ //Tests two signals against "lowthr"
-    if((e>lowthr)&&(xf>lowthr)&&(xn>lowthr)&&(t>minTime)&&include[i]){ //Tests all three signals against "lowthr"
-      Counts[i]=Counts[i]+1; //Stores counts per detector
-      
-      hEdXF[i]->Fill(xf/e);
-      hEdXN[i]->Fill(xn/e);
-      hEXF[i]->Fill(xf,e);
-      hEXN[i]->Fill(xn,e);
-      
-  //Begin Calibration
-  
-
-    //Position Calibration	  
-      //Position Calibration Level [1] - Matches XF to XN
-      if(DoCal[1]){
-	if(ECal[i][2]<-1){ 
-	  xn=(-ECal[i][2])*xn;}
-	else{
-	  xf=(-1/ECal[i][2])*xf;}
-        
-      //Position Calibration Level [2] - Matches (XF+XN) to E
-	xf=(xf*ECal[i][15]+ECal[i][16]/2);
-	xn=(xn*ECal[i][15]+ECal[i][16]/2); 
-      }
-      
-      //x=(1/2.)*(1+((2*xf-e)/e)); //position without xn
-      //x=(1/2.)*(1+((e-2*xn)/e)); //position without xf
-      
-      x=(1/2.)*(1+((xf-xn)/(xf+xn))); //Position on detector with XN@x=0 and XF@x=1.  
-      //Please note at this point that the array PCBs are 
-                                          //wired backwards, so "X-Far" is closest to the 
-                                          //target and "X-Near" is further away.
-	  
-
-  //Energy Calibration
-      //Energy Calibration Level [1] - Correct position-dependance of energy
-      if(DoCal[0]&&ECal[i][20]){
-	e=e-ECal[i][20]*pow(x+(ECal[i][19]/(2*ECal[i][20])),2);
-      }
+  for(Int_t k=0;k<b.n;k++){
+    if(k==0||b.evt[k]!=b.evt[k-1]) goodESum=goodEDiff=GoodTime=GoodScat=kFALSE;
+    Int_t i=b.det[k];
+    PROFDET(i);
+    Float_t e=b.ch[k],xf=b.xf[k],xn=b.xn[k],x=b.x0[k]; //the values the gates were set on
+    Float_t sum;
 	 
-      if((e>(-(xf-xn)+(widthDiff*sigmaDiff))&&e>((xf-xn)+(widthDiff*sigmaDiff)))||DoCut[4]==0||DoCal[1]<2){
-	goodEDiff=kTRUE;
-	hEDiff[i]->Fill((xf-xn),e);
+    UInt_t gates=0;
+    if((e>(-(xf-xn)+(widthDiff*sigmaDiff))&&e>((xf-xn)+(widthDiff*sigmaDiff)))||!GateSum){
+      goodEDiff=kTRUE;
+      hEDiff[i]->Fill((xf-xn),e);
+    }
+    else{
+      hEDiffx[i]->Fill((xf-xn),e);
+      hEX2x[i]->Fill(x,e);
+      if(e<((xf-xn)+(widthDiff*sigmaDiff))){
+	hEXxleft[i]->Fill(x,e);   //Shows region excluded to left of cut
       }
       else{
-	hEDiffx[i]->Fill((xf-xn),e);
-	hEX2x[i]->Fill(x,e);
-	if(e<((xf-xn)+(widthDiff*sigmaDiff))){
-	  hEXxleft[i]->Fill(x,e);   //Shows region excluded to left of cut
-	}
-	else{
-	  hEXxright[i]->Fill(x,e);
-	}
+	hEXxright[i]->Fill(x,e);
       }
+    }
       
-      sum=e-(xf+xn);
-      hESums[i]->Fill((xf+xn),sum);
+    sum=e-(xf+xn);
+    hESums[i]->Fill((xf+xn),sum);
       
-      if((sum>(-widthSum*sigmaSum)&&sum<(8*widthSum*sigmaSum))||DoCut[4]==0||DoCal[1]<2){
-	goodESum=kTRUE;
-	hESum[i]->Fill((xf+xn),e);
+    if((sum>(-widthSum*sigmaSum)&&sum<(8*widthSum*sigmaSum))||!GateSum){
+      goodESum=kTRUE;
+      hESum[i]->Fill((xf+xn),e);
+    }
+    else{
+      hESumx[i]->Fill((xf+xn),e);
+      hEXx[i]->Fill(x,e);
+      if(sum>(widthSum*sigmaSum)){
+	hEXxup[i]->Fill(x,e);   //Shows region excluded above cut - should be empty
       }
       else{
-	hESumx[i]->Fill((xf+xn),e);
-	hEXx[i]->Fill(x,e);
-	if(sum>(widthSum*sigmaSum)){
-	  hEXxup[i]->Fill(x,e);   //Shows region excluded above cut - should be empty
-	}
-	else{
-	  hEXxdown[i]->Fill(x,e); //Shows region excluded below cut.  Should have no 
-	  //kinematic lines (detector edge structure only).
-	}
+	hEXxdown[i]->Fill(x,e); //Shows region excluded below cut.  Should have no 
+	//kinematic lines (detector edge structure only).
       }
+    }
       
   /*Fill histograms with energy gating*/
-      //      if((e>(cutE-widthE*sigmaE)&&e<(cutE+widthE*sigmaE))||(DoCut[0]==0)){ //Tests energy is in range OR no energy calibration applied
-      if((e>(cutE))||(DoCut[0]==0)){ //Tests energy is in range OR no energy calibration applied
-	//     if(e>(-(xf-xn)+(5*widthDiff*sigmaDiff))&&e>((xf-xn)+(5*widthDiff*sigmaDiff)))
-	hXFXN[i]->Fill(xn,xf);
-      }
-      
+    //      if((e>(cutE-widthE*sigmaE)&&e<(cutE+widthE*sigmaE))||(DoCut[0]==0)){ //Tests energy is in range OR no energy calibration applied
+    if((e>(cutE))||!GateE){ //Tests energy is in range OR no energy calibration applied
+      //     if(e>(-(xf-xn)+(5*widthDiff*sigmaDiff))&&e>((xf-xn)+(5*widthDiff*sigmaDiff)))
+      gates|=TG_E;
+      hXFXN[i]->Fill(xn,xf);
+    }
 
+    /* The following steps apply a rough position calibration ("scissoring") based on
+       the angular spread of the hXFXN spectra
+       if(DoCal[0]>0&&DoCal[1]>2){ 
+       sum=(xf+xn);
+       theta=atan(xf/xn);
+       theta=theta/pi*180;
+       theta=ECal[i][7]*theta+ECal[i][8]; //Applies "scissoring" calibration
+       theta=theta/180*pi;
+       xf=(sum*tan(theta))/(1+tan(theta));
+       xn=sum-xf;
+       }
+    */
 
-    //Energy Calibration
-      //Energy Calibration Level [2] - Calibrate Energy in MeV
-      ch=e;
-      if(e>0&&DoCal[0]>1){
-	e =(( e- ECal[i][1])   /ECal[i][0]); //Energy in MeV
-	/*
-	  if(DoCal[1]>1){
-	  xf=((xf-(ECal[i][1]/2))/ECal[i][0]);
-	  xn=((xn-(ECal[i][1]/2))/ECal[i][0]);
-	  }
-	*/
-      }
-	  
-    //Time Calibration:
-      if(DoCal[0]>1&&DoCal[1]){//Time calibration is meaningless without energy calibration and rudimentary position calibration.
-	//Time Calibration Level [1] - Time Energy-Dependance Correction (Walk Correction)
-	if(e<ECal[i][9])
-	  if(ECal[i][11]){ //"Piece-wise Quadratic" Correction
-	    t=t-ECal[i][11]*pow(e+(ECal[i][10]/(2*ECal[i][11])),2);
-	  }
-	
-	//Time Calibration Level [2] - Time Energy-Dependance Correction II
-	t=t-e*ECal[i][12]; //used to correct linear E-dependance of T  
-	
-	//Time Calibration Level [3] - Time Position-Dependance Correction
-	if(DoCal[1]>2){
-	  t=t-((ECal[i][3])*x+(ECal[i][4])*x*x+(ECal[i][5])*x*x*x+(ECal[i][6])*x*x*x*x);
-	}
-	  //Time Calibration Level [4] - Time Calibration
-	if((DoCal[2]==4)){
-	      t=(t-ECal[i][8])/ECal[i][7]+Tcyc;
-	}
-      }
-      
-      /* The following steps apply a rough position calibration ("scissoring") based on
-	 the angular spread of the hXFXN spectra
-	 if(DoCal[0]>0&&DoCal[1]>2){ 
-	 sum=(xf+xn);
-	 theta=atan(xf/xn);
-	 theta=theta/pi*180;
-	 theta=ECal[i][7]*theta+ECal[i][8]; //Applies "scissoring" calibration
-	 theta=theta/180*pi;
-	 xf=(sum*tan(theta))/(1+tan(theta));
-	 xn=sum-xf;
-	 }
-      */
-      
-      //Position Calibration	  
-      //Position Calibration Level [3] - Slope Correction (Relative Calibration)
-
-      if(DoCal[1]) x=(x-0.5)*ECal[i][13]+0.5; //Note: this expansion is about x=0.5 (XF=XN), which is set by both the physical layout of the detector array and the gain matching of XF &XN
-
-      z=(active*x); //position on detector in mm
-      Z=-positions[(6-(i%6))]-active/2+positions[0]+z; //position in magnet in mm
-      //Position Calibration Level [4] - Offset Correction (Absolute Calibration)
-      Z=Z-ECal[0][14]; //Since relative positions are fixed, only one global correction is 
-      //needed.  First row value is used.
-      if(iter==1){
-	printf("Overall Offset is %5.2f mm\n",ECal[0][14]);
-	printf("Ta Slits are located at: %7.2f\n", positions[0]);	   
-	for(Int_t i=0;i<6;i++){ 
-	  printf("Detector %2d Zero Position: %7.2f ",i+1,-positions[(6-(i%6))]-active/2+positions[0]+active-ECal[0][14]);
-	  printf("(%1d active detectors, %3.0f%%(rel))\n",w[i%6],(Float_t)w[i%6]/w[6]*100);
-	}
-	//printf("Maximum %1d active detectors per position.\n",w[6]);
-      }	  
-      if(DoWeight){
-	weight=0;
-	for(Int_t j=0;j<10;j++){
-	  weight=weight+Effic[(i%6)][j]*pow(x,j);
-	  //	      if (iter<10&&j==0)printf("detector %2d is in position %1.0d\n",i+1,(Int_t)Effic[(i%6)][0]);
-	}
-	weight=(p0av/weight)*((Float_t)w[i%6]/w[6]);//normalizes to average "p0" parameter, 
-	//then scales to number of detectors at the position
+    Float_t ch=e;
+    e=b.e[k];
+    x=b.x[k];
+    Float_t t=b.t[k],Z=b.Z[k],weight=b.weight[k];
+    Float_t E=b.E[k],Q=b.Q[k],Z0=b.Z0[k],TOF=b.TOF[k],Ecm=b.Ecm[k],theta=b.theta[k];
+    Float_t theta2=theta; //the "recursive" form is the same angle, see helios_kin.h
+    if(iter==1){
+      printf("Overall Offset is %5.2f mm\n",ECal[0][14]);
+      printf("Ta Slits are located at: %7.2f\n", positions[0]);	   
+      for(Int_t i=0;i<6;i++){ 
+	printf("Detector %2d Zero Position: %7.2f ",i+1,-positions[(6-(i%6))]-active/2+positions[0]+active-ECal[0][14]);
+	printf("(%1d active detectors, %3.0f%%(rel))\n",nAtPos[i%6],(Float_t)nAtPos[i%6]/nAtPos[6]*100);
       }
-      else weight=1;
-      E=e-slopeEcm*Z; //particle energy in MeV at 90deg in lab
-      Q=(intercepts[0]-E)*(29.984/28.976); //excitation energy in MeV
-      //Q-Value Calibration	  
-      if(DoCal[3]){
-	Q=((Q-ECal[i][18])/ECal[i][17]); //Q-Value in MeV
-      }
-      
-      V=sqrt(2*e*MeV/mass);//Laboratory Velocity in m/s
-      Z0=(e-intercepts[0])/slopeEcm; //beam-axis intercept for given excitation energy
-      TOF=Tcyc*Z/Z0; //calculated time-of-flight (TOF)
+      //printf("Maximum %1d active detectors per position.\n",nAtPos[6]);
+    }	  
       
-      V0 =sqrt((V*V)+(Vcm*Vcm)-(2*Vcm*(Z/1000)/(Tcyc*1E-9)));//Center of Mass Velocity in m/s
+    /*Fill histograms without gating*/
+    hE->Fill(e,i+1); 
+    hXF->Fill(xf,i+1);
+    hXN->Fill(xn,i+1);
+    hT->Fill(t,i+1);
       
-      Ecm=(1/2.0*mass*(V0*V0-Vcm*Vcm))/MeV;
-      
-      theta =180-(acos((V*V-V0*V0-Vcm*Vcm)/(2*V0*Vcm)) )/pi*180;//Center of mass angle in degrees, non-recursive
-      theta2=180-(acos(((Z /1000)/(Tcyc*1E-9)-Vcm)/V0 ))/pi*180;//Center of mass angle in degrees, recursive
-      
-      /*Fill histograms without gating*/
-      hE->Fill(e,i+1); 
-      hXF->Fill(xf,i+1);
-      hXN->Fill(xn,i+1);
-      hT->Fill(t,i+1);
-      
-      if (checkcutg("cTime2D",t,e)) GoodTime=kTRUE;
-      //      if (checkcutg("cScat",t,e)) GoodScat=kTRUE;
+    Bool_t goodX,goodTOF;
+    {
+      PROF(PR_GATES);
+      if (gateinside(gTime2D,t,e)) GoodTime=kTRUE;
+      //      if (gateinside(gScat,t,e)) GoodScat=kTRUE;
+      goodX=(x>(cutX-widthX*sigmaX)&&(x<cutX+widthX*sigmaX))||!GateX;
+      goodTOF=(TOF>(cutTOF-widthTOF*sigmaTOF)&&TOF<(cutTOF+widthTOF*sigmaTOF))||!GateTOF;
+    }
+    if(goodEDiff) gates|=TG_EDIFF;
+    if(goodESum) gates|=TG_ESUM;
+    if(goodX) gates|=TG_X;
+    if(GoodTime||!GateT) gates|=TG_TIME;
+    if(goodTOF) gates|=TG_TOF;
+    b.gates[k]=gates;
       
-         if((goodESum&&goodEDiff)||DoCut[4]==0||DoCal[1]<2){
-	   //  if((goodEDiff)||DoCut[4]==0||DoCal[1]<2){
+    if((goodESum&&goodEDiff)||!GateSum){
+      //  if((goodEDiff)||DoCut[4]==0||DoCal[1]<2){
 	
-	/*Fill histograms with position gating*/
-	if((x>(cutX-widthX*sigmaX)&&(x<cutX+widthX*sigmaX))||(DoCut[1]==0)){
+      /*Fill histograms with position gating*/
+      if(goodX){
 	  
-	  hEX[i]->Fill(x,e);
-	  hET[i]->Fill(t,e);
-	  hET[24]->Fill(t,e);
-	  hEcT[i]->Fill(t,E);
-	  hEcT[24]->Fill(t,E);
-	  hTX[i]->Fill(x,t);
-	  hEZ->Fill(Z,e);
+	hEX[i]->Fill(x,e);
+	hET[i]->Fill(t,e);
+	hET[24]->Fill(t,e);
+	hEcT[i]->Fill(t,E);
+	hEcT[24]->Fill(t,E);
+	hTX[i]->Fill(x,t);
+	hEZ->Fill(Z,e);
 	  
-	  /*Fill histograms with time gating*/
-	  // if((t>(cutT-widthT*sigmaT)&&t<(cutT+widthT*sigmaT))||(DoCut[2]==0)||DoCal[2]<4){ //Tests time is in range OR no time calibration applied   
-	  if(GoodTime||(DoCut[2]==0)||DoCal[2]<4){ //Tests time is in range OR no time calibration applied   
-	    hEXg[i]->Fill(x,e);
-	    hEZg->Fill(Z,e);
+	/*Fill histograms with time gating*/
+	// if((t>(cutT-widthT*sigmaT)&&t<(cutT+widthT*sigmaT))||(DoCut[2]==0)||DoCal[2]<4){ //Tests time is in range OR no time calibration applied   
+	if(GoodTime||!GateT){ //Tests time is in range OR no time calibration applied   
+	  hEXg[i]->Fill(x,e);
+	  hEZg->Fill(Z,e);
 	    
-	    hEXw[i]->Fill(x,e,weight);
-	    hEZw->Fill(Z,e,weight);
+	  hEXw[i]->Fill(x,e,weight);
+	  hEZw->Fill(Z,e,weight);
 	    
-	    hEZSides->Fill(Z,e+(maxE*(3-i/6)));
-	    hEcZ->Fill(Z,E);
-	    hQZ ->Fill(Z,Q,weight);
-	    hEcX[i]->Fill(x,E);
+	  hEZSides->Fill(Z,e+(maxE*(3-i/6)));
+	  hEcZ->Fill(Z,E);
+	  hQZ ->Fill(Z,Q,weight);
+	  hEcX[i]->Fill(x,E);
 	    
-	    hEcTheta ->Fill(theta,E,weight);
-	    hEcTheta2->Fill(theta2,E       );
+	  hEcTheta ->Fill(theta,E,weight);
+	  hEcTheta2->Fill(theta2,E       );
 	    
-	    hQTheta->Fill(theta,Q,weight);
+	  hQTheta->Fill(theta,Q,weight);
 	    
-	    hThetaZ->Fill(Z,theta);
-	    hEZ0->Fill(Z0,e);
+	  hThetaZ->Fill(Z,theta);
+	  hEZ0->Fill(Z0,e);
 	    
-	    hETOF->Fill(TOF,e,weight);
+	  hETOF->Fill(TOF,e,weight);
 	    
-	    if((TOF>(cutTOF-widthTOF*sigmaTOF)&&TOF<(cutTOF+widthTOF*sigmaTOF))||(DoCut[3]==0)||DoCal[0]<1){ //Tests TOFis in range OR no cut applied 
-	      hEcmZ->Fill(Z,Ecm);
+	  if(goodTOF){ //Tests TOFis in range OR no cut applied 
+	    hEcmZ->Fill(Z,Ecm);
 	      
-	    }//end TOF gate
-	  }//end Time gate
-	  else{//Fill histograms with anti-time-gating
-	    hEXag[i]->Fill(x,ch);
-	  }
-	}//end position gate
+	  }//end TOF gate
+	}//end Time gate
+	else{//Fill histograms with anti-time-gating
+	  hEXag[i]->Fill(x,ch);
+	}
+      }//end position gate
 	
-      }
-      iter++;
-    }//end fill histogram
-  }//end calibration
+    }
+    iter++;
+  }//end fill histogram
+  if(HitTree){
+    PROF(PR_TREE);
+    treeblock(b);
+  }
+}
+
+int userdecode(ScarletEvnt &event){
+  HitBlock &b=*Block;
+  b.n=0;
+  unpackhits(event,b,0);
+  calblock(b);
+  fillblock(b);
   return 0;
 }//end userdecode()
 
+/* The userbatch() function:  Sorts n triggered events at once, as userdecode() does one.
+ * Called by helios_offline_sort when built with -DHELIOS_BATCH; the hits of as many events
+ * as fit are calibrated together, so the calibration loops run over long blocks.
+ */
+int userbatch(const struct ScarletEvntHdr **h,Int_t n)
+{
+  HitBlock &b=*Block;
+  ScarletEvnt event;
+  b.n=0;
+  for(Int_t k=0;k<n;k++){
+    if(b.n>HITBLOCK-NDET){ //the next event might not fit
+      calblock(b);
+      fillblock(b);
+      b.n=0;
+    }
+    event=h[k];
+    unpackhits(event,b,k);
+  }
+  calblock(b);
+  fillblock(b);
+  return 0;
+}
+
+/* The userhits() function:  Sorts n records of a hit cache (see helios_hitcache.h) as
+ * userbatch() sorts raw events.  Called by helios_offline_sort when built with
+ * -DHELIOS_HITCACHE and given a cache: first with the header record alone, on the main
+ * thread, which is checked against this sort's thresholds and channel map, then with
+ * the chunks.  Returns 1 if the cache does not match.
+ */
+int userhits(const struct ScarletEvntHdr **h,Int_t n)
+{
+  HitBlock &b=*Block;
+  if(!HitChunk) HitChunk=new HCHits;
+  HCHits &w=*HitChunk;
+  Int_t evt=0;
+  b.n=0;
+  for(Int_t k=0;k<n;k++){
+    if(hcisheader(h[k])){
+      if(hcmatch(h[k],HitCacheHdr)) return 1;
+      if(DoStages&&!Stage[STGAIN].stage){
+	HCHeader cache;
+	memcpy(&cache,h[k],sizeof(cache));
+	stagesopen(cache);
+      }
+      continue;
+    }
+    if(hcdecode(h[k],w)) continue;
+    ChunkHash=sthash(STSEED,h[k],hcchunklen(w.nevents,w.nhits));
+    Int_t first=0; //hits of the chunk in earlier blocks
+    for(Int_t ev=0,j=0;ev<w.nevents;ev++,evt++){
+      if(b.n>HITBLOCK-NDET){ //the next event might not fit
+	stageblock(b,first);
+	fillblock(b);
+	first+=b.n;
+	b.n=0;
+      }
+      for(Int_t m=0;m<w.nhit[ev];m++,j++)
+	addhit(b,evt,w.det[j],w.e[j],w.xf[j],w.xn[j],w.tac[ev]);
+    }
+    stageblock(b,first); //a block holds the hits of one chunk, so its stages can be found
+    fillblock(b);
+    b.n=0;
+  }
+  return 0;
+}
+
 /* The userfunc() function:  This function is called per event.  The event
  * is supplied by daphne.  Unpack the event and fill your histograms here.
  */
@@ -1221,6 +1808,7 @@ int userfunc(const struct ScarletEvntHdr* h)
   Float_t CountsSum=0;
   ScarletEvnt event, subevent;
   event = h;
+  PROFEVENT(event.eventtype());
   switch (event.eventtype()) {
   case SE_TYPE_TRIGGERED:
     userdecode(event);
@@ -1234,7 +1822,12 @@ int userfunc(const struct ScarletEvntHdr* h)
     printf("Received stop signal.  ");
     for(Int_t i=0;i<24;i++)CountsSum+=Counts[i];
     printf("Run sorted.  Total counts: %1.0f\n",CountsSum);
+    HitCacheWhole=kTRUE;
+#ifndef HELIOS_THREADS
+    profreport(); //with -DHELIOS_PROF; a threaded sort reports from userexit()
+#endif
     //for(Int_t i=0;i<24;i++) printf("Detector %2d: Counts = %10d (%5.2f%%)\n",i+1,Counts[i],(Float_t)((Counts[i]/CountsSum)*100));
+    unpackreport(); //channel-field cross-check from unpackarray()
     break;
   }
   return 0;
@@ -1248,11 +1841,43 @@ int userfunc(const struct ScarletEvntHdr* h)
  */
 int userexit()
 {
+  scclose(Scaler);
   cout<<"Exiting sort..."<<endl;
   //  f->ls();
+  hmerge();   //fills of this thread's histogram shards, when built with -DHELIOS_THREADS
+#if defined(HELIOS_PROF)&&defined(HELIOS_THREADS)
+  profreport(); //the workers' counters are merged only by now
+#endif
+  hdensify(); //sparse spectra to TH2F
+  hstubs();   //spectra never filled, see helios_hist.h
+  if(HitCacheFile){
+    hcflush(*HitCache,HitCacheFile);
+    if(HitCacheWhole) hcfinish(HitCacheFile,HitCacheHdr);
+    else printf("The run's stop was not sorted: the hit cache is not marked finished\n");
+    printf("Hit cache written: %.1f MB\n",ftell(HitCacheFile)/1e6);
+    fclose(HitCacheFile);
+    HitCacheFile=0;
+    delete HitCache;
+    HitCache=0;
+  }
+  for(Int_t s=STGAIN;s<NSTAGES;s++){
+    if(Stage[s].fp) printf("Stage %d written: %.1f MB\n",s,ftell(Stage[s].fp)/1e6);
+    stclose(Stage[s]);
+  }
+  if(HitTree){
+    printf("Hit tree written: %lld hits\n",HitTree->GetEntries());
+    TreeFile->cd();
+    HitTree->Write();
+    TreeFile->Close(); //deletes the tree
+    delete TreeFile;
+    HitTree=0;
+  }
+  f->cd();
+  if(DoScalerTree) scexport(Scaler);
   f->Write();
   f->Close();
   delete f;
+  hfree(); //the booking records, see helios_hist.h
   printf("\a"); //"Default Beep" at sort exit.
   return 0;
 }
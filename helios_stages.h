@@ -0,0 +1,189 @@
+/* Program: helios_stages.h
+ * Purpose:
+ *       Stored calibration stages for a sort from a hit cache (see helios_hitcache.h),
+ *       so a resort after a change to a late calibration reuses the earlier stages
+ *       instead of recomputing them.  The calibration of a sort runs in stages,
+ *       each from the output of the one before: the raw hits (the cache itself),
+ *       gain-matched, energy-calibrated, and kinematics.  Each stage after the raw
+ *       one has a file of its outputs, and the file's header holds a key: a hash of
+ *       the stage's inputs (its coefficients and levels) chained onto the key of the
+ *       stage before.  A resort reads a stage from its file while the key matches, and
+ *       from the first stage whose key does not, recomputes it and every later stage
+ *       and writes their files anew.
+ *
+ *       A file is a header record and then segments, laid out like the records of an
+ *       event file, so helios_evfile.h maps it.  A segment holds the outputs of a run
+ *       of consecutive hits of one cache chunk, as columns of floats: the chunk is
+ *       named by a hash of its record, and the run by the index of its first hit.
+ *       Segments are written by whichever thread sorted the hits, in one fwrite()
+ *       each, so they are in no particular order; stopen() indexes them.  A segment
+ *       that is not found is recomputed and not written.
+ *
+ * Usage:
+ *       StageFile st;
+ *       ULong64_t key=sthash(prevkey,coef,sizeof(coef));   //per input of the stage
+ *       stopen(st,"run.stage2",2,ncols,key);    //0: key matched, read; 1: written anew
+ *       const Float_t *p=stfind(st,chunk,first,n);      //column c at p+c*n, or 0
+ *       stwrite(st,chunk,first,n,ncols,cols);   //when st.fp is set
+ *       stclose(st);
+ */
+#ifndef HELIOS_STAGES_H
+#define HELIOS_STAGES_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "Rtypes.h"
+#include "helios_evfile.h"
+
+#define STMAGIC 0x31545348 //"HST1", second word of a stage file's header record
+#define STSEG   0x47535348 //"HSSG", second word of each segment
+#define STSEED  14695981039346656037ull //FNV-1a offset basis, the key before any stage
+#define STCOLS  8          //most columns a stage may have
+
+struct STHeader {
+  UInt_t len;
+  UInt_t magic;
+  Int_t stage,ncols;
+  ULong64_t key;          //hash of the inputs of this stage and all before it
+};
+
+struct STSegment {
+  UInt_t len;
+  UInt_t magic;
+  ULong64_t chunk;        //hash of the cache chunk the hits are from
+  Int_t first,n;          //first hit of the run within the chunk, and hits
+};
+
+struct STIndex {
+  ULong64_t chunk;
+  Int_t first;
+  const STSegment *seg;
+};
+
+struct StageFile {
+  EvFile ev;              //the file being read, when its key matched
+  FILE *fp;               //the file being written, when it did not; 0 otherwise
+  Int_t stage,ncols;
+  ULong64_t key;
+  Int_t nseg;             //segments indexed
+  STIndex *index;         //sorted by chunk and first hit
+};
+
+/* FNV-1a of n bytes, continuing from h */
+inline ULong64_t sthash(ULong64_t h,const void *p,size_t n)
+{
+  const UChar_t *c=(const UChar_t*)p;
+  for(size_t i=0;i<n;i++){
+    h^=c[i];
+    h*=1099511628211ull;
+  }
+  return h;
+}
+
+inline int stcompare(const void *a,const void *b)
+{
+  const STIndex *x=(const STIndex*)a,*y=(const STIndex*)b;
+  if(x->chunk!=y->chunk) return x->chunk<y->chunk ? -1 : 1;
+  return x->first-y->first;
+}
+
+/* Indexes the segments of a mapped stage file.  Returns the number indexed. */
+inline Int_t stindex(StageFile &st)
+{
+  Int_t size=1024;
+  st.index=(STIndex*)malloc(size*sizeof(STIndex));
+  st.nseg=0;
+  const ScarletEvntHdr *h;
+  while((h=evnext(st.ev))){
+    const STSegment *s=(const STSegment*)h;
+    if(s->len<sizeof(*s)||s->magic!=STSEG) continue;
+    if(s->n<=0||s->len<sizeof(*s)+(UInt_t)s->n*st.ncols*sizeof(Float_t)) continue;
+    if(st.nseg==size){
+      size*=2;
+      st.index=(STIndex*)realloc(st.index,size*sizeof(STIndex));
+    }
+    STIndex &x=st.index[st.nseg++];
+    x.chunk=s->chunk;
+    x.first=s->first;
+    x.seg=s;
+  }
+  qsort(st.index,st.nseg,sizeof(STIndex),stcompare);
+  return st.nseg;
+}
+
+/* Opens the file of a stage.  If it exists with the same key and number of columns, it
+ * is mapped and indexed for reading, and 0 is returned.  Otherwise it is created with
+ * that key for writing, and 1 is returned; st.fp is 0 if it cannot be created.
+ */
+inline Int_t stopen(StageFile &st,const char *name,Int_t stage,Int_t ncols,ULong64_t key)
+{
+  st.fp=0;
+  st.stage=stage;
+  st.ncols=ncols;
+  st.key=key;
+  st.nseg=0;
+  st.index=0;
+  FILE *fp=fopen(name,"rb");
+  if(fp){
+    STHeader h;
+    Bool_t same=(fread(&h,sizeof(h),1,fp)==1&&h.magic==STMAGIC&&h.stage==stage&&
+		 h.ncols==ncols&&h.key==key);
+    fclose(fp);
+    if(same&&!evopen(st.ev,name)){
+      evnext(st.ev); //the header
+      stindex(st);
+      return 0;
+    }
+  }
+  memset(&st.ev,0,sizeof(st.ev));
+  st.fp=fopen(name,"wb");
+  if(!st.fp){
+    printf("Cannot create stage file \"%s\"\n",name);
+    return 1;
+  }
+  STHeader h={sizeof(STHeader),STMAGIC,stage,ncols,key};
+  fwrite(&h,sizeof(h),1,st.fp);
+  return 1;
+}
+
+/* The stored outputs of n hits of a chunk from hit first on, column c at p+c*n, or 0 if
+ * they are not in the file.
+ */
+inline const Float_t *stfind(const StageFile &st,ULong64_t chunk,Int_t first,Int_t n)
+{
+  if(!st.nseg) return 0;
+  STIndex x={chunk,first,0};
+  const STIndex *f=(const STIndex*)bsearch(&x,st.index,st.nseg,sizeof(STIndex),stcompare);
+  if(!f||f->seg->n!=n) return 0;
+  return (const Float_t*)(f->seg+1);
+}
+
+/* Writes the outputs of n hits of a chunk from hit first on, ncols columns, as one
+ * segment.
+ */
+inline void stwrite(StageFile &st,ULong64_t chunk,Int_t first,Int_t n,Int_t ncols,
+		    Float_t *const *cols)
+{
+  if(!st.fp||n<=0) return;
+  UInt_t len=(sizeof(STSegment)+n*ncols*sizeof(Float_t)+7)&~7u; //segments stay 8-byte aligned
+  char *rec=(char*)calloc(len,1);
+  STSegment s={len,STSEG,chunk,first,n};
+  memcpy(rec,&s,sizeof(s));
+  Float_t *p=(Float_t*)(rec+sizeof(s));
+  for(Int_t c=0;c<ncols;c++,p+=n) memcpy(p,cols[c],n*sizeof(Float_t));
+  fwrite(rec,len,1,st.fp); //one call, so a segment is never split by another thread's
+  free(rec);
+}
+
+inline void stclose(StageFile &st)
+{
+  if(st.fp) fclose(st.fp);
+  if(st.ev.map||st.ev.fp) evclose(st.ev);
+  free(st.index);
+  st.fp=0;
+  st.index=0;
+  st.nseg=0;
+}
+
+#endif
@@ -0,0 +1,113 @@
+/* Program: helios_unpack.h
+ * Purpose:
+ *       Array unpacker shared by the HELIOS sort programs.  The (5x16) ADC
+ *       re-map matrices MapDet/MapSig are flattened once, in userentry(), into
+ *       a single table of offsets into the (24x3) Data array, so the per-hit
+ *       work in userdecode() is one indexed store.
+ *
+ * Usage:
+ *       Int_t MapSlot[NADC*NCHAN];              //file scope
+ *       buildmap(MapDet,MapSig,MapSlot);        //in userentry()
+ *       Int_t Data[NDET+1][NSIG];               //in userdecode(), row NDET is scratch
+ *       p1=unpackarray(p1,MapSlot,hADC,Data);
+ *       unpackreport();                         //at SE_TYPE_STOP, lists channel mismatches
+ *
+ *       The hit register is walked with the compiler's popcount/count-trailing-zeros
+ *       builtins, which become single instructions when built with -mpopcnt -mbmi
+ *       (or -march=native).  Compile with -DHELIOS_DUMPHITS to record every hit
+ *       pattern word to hitpattern.dat for helios_microbench.
+ */
+#ifndef HELIOS_UNPACK_H
+#define HELIOS_UNPACK_H
+
+#define NADC  5  //ADCs 1-5 carry the array signals
+#define NCHAN 16 //channels per ADC
+#define NDET  24 //array detectors
+#define NSIG  3  //0->E, 1->XF, 2->XN
+
+UInt_t nBadChan[NADC]; //hits whose channel field disagrees with the hit-pattern bit
+#ifdef HELIOS_DUMPHITS
+FILE *hitdump=fopen("hitpattern.dat","w");
+#endif
+
+/* function to count the number of set bits in a 16 bit word */
+inline Int_t cntbit(Int_t word)
+{
+  return __builtin_popcount(word & 0xffff);
+}
+
+/* Returns the channel of the lowest set bit in the hit register and clears it.
+ * Call only while pattern is non-zero.
+ */
+inline Int_t nextbit(UInt_t &pattern)
+{
+  Int_t bit=__builtin_ctz(pattern);
+  pattern&=pattern-1;
+  return bit;
+}
+
+/* Builds the flat (adc,chan)->slot table.  A slot is det*NSIG+sig; channels the
+ * re-map matrices leave unmapped (-1) or map out of range are sent to the scratch
+ * row Data[NDET], which is never read, so the hit loop needs no range tests.
+ */
+inline void buildmap(const Int_t MapDet[NADC][NCHAN],const Int_t MapSig[NADC][NCHAN],Int_t *MapSlot)
+{
+  Int_t unmapped=0;
+  for(Int_t nadc=0;nadc<NADC;nadc++){
+    for(Int_t chan=0;chan<NCHAN;chan++){
+      Int_t det=MapDet[nadc][chan];
+      Int_t sig=MapSig[nadc][chan];
+      if(det>-1&&det<NDET&&sig>-1&&sig<NSIG)
+	MapSlot[nadc*NCHAN+chan]=det*NSIG+sig;
+      else{
+	MapSlot[nadc*NCHAN+chan]=NDET*NSIG; //scratch row
+	unmapped++;
+      }
+    }
+  }
+  printf("Array map built: %d of %d ADC channels unmapped\n",unmapped,NADC*NCHAN);
+}
+
+/* Reads the hit pattern and data words of ADCs 1-5 starting at p, fills the raw
+ * ADC spectra and stores each hit in Data.  Returns the word after ADC5's data.
+ * The data words follow the hit register in ascending channel order, so the
+ * channel is taken from the bit position; the (dataword & 0xf000)>>12 field is
+ * only cross-checked and mismatches are counted in nBadChan[].
+ */
+template<class H> //TH2F, or the H2F of helios_hist.h
+inline int *unpackarray(int *p,const Int_t *MapSlot,H **hADC,Int_t Data[][NSIG])
+{
+  Int_t *slot=&Data[0][0];
+  Int_t dataword,chan,raw;
+  UInt_t pattern;
+
+  for(Int_t nadc=0;nadc<NADC;nadc++){
+    const Int_t *map=MapSlot+nadc*NCHAN;
+    pattern=(*p++ & 0xffff); //one bit per channel hit
+#ifdef HELIOS_DUMPHITS
+    if(hitdump) fprintf(hitdump,"%d %04x\n",nadc,pattern);
+#endif
+    while(pattern){ //visits only the channels that fired
+      chan=nextbit(pattern);
+      dataword=*p++;
+      raw=(dataword & 0x00000fff);
+      nBadChan[nadc]+=(((dataword & 0x0000f000)>>12)!=chan);
+      hADC[nadc]->Fill(raw,chan);
+      slot[map[chan]]=raw;
+    }
+  }
+  return p;
+}
+
+/* Prints the channel cross-check totals gathered by unpackarray() and clears them.
+ */
+inline void unpackreport()
+{
+  for(Int_t nadc=0;nadc<NADC;nadc++){
+    if(nBadChan[nadc])
+      printf("ADC%d: %u hits with channel field not matching the hit pattern\n",nadc+1,nBadChan[nadc]);
+    nBadChan[nadc]=0;
+  }
+}
+
+#endif
@@ -0,0 +1,132 @@
+/* Program: helios_window.h
+ * Purpose:
+ *       Rolling-window spectra for an online sort: a TH1I/TH2I holding only the
+ *       fills of the last few intervals (sync events, by default), so a change in
+ *       the beam shows at once instead of under hours of earlier counts.  A window
+ *       keeps a ring of nslots slots, each the counts of one interval, cell for
+ *       cell as the histogram's.  A fill adds one to the histogram's bin and to the
+ *       bin of the current slot.  hwindowtick() ends the interval: the ring moves
+ *       on to its oldest slot, whose counts are taken off the histogram and
+ *       cleared, so the histogram is always the sum of the slots.  A fill is O(1);
+ *       a tick costs one pass over a slot's cells, once an interval.  Memory is
+ *       fixed at booking, nslots+1 copies of the cells, which is why windows are
+ *       usually booked coarser than the spectra they follow.
+ *
+ *       The window covers the current interval and the nslots-1 before it.  The
+ *       fills and the ticks are made by the sort thread, so they never race.
+ *
+ * Usage:
+ *       HWindow *wEDE0;                          //file scope
+ *       wEDE0=hwbook2("hEDE0w","E vs dE, last 20 syncs",128,0,4096,128,0,4096,20);
+ *       wEDE0->Fill(e,de);                       //whole channels, as an H2I
+ *       hwindowtick();                           //per sync event: every window moves on
+ */
+#ifndef HELIOS_WINDOW_H
+#define HELIOS_WINDOW_H
+
+#include <cstdlib>
+#include <cstring>
+#include "TH1.h"
+#include "TH2.h"
+#include "helios_hist.h"
+
+struct HWindow {
+  TH1 *h;                 //the window
+  Int_t *a;               //its bins
+  Int_t nx,ny,ncells;
+  HChan ax,ay;
+  Int_t nslots;
+  Int_t cur;              //slot of the current interval
+  UInt_t *slots;          //nslots*ncells counts, slot by slot
+  Long64_t *nfill;        //fills of each slot
+  HWindow *next;          //next window booked
+
+  void count(Int_t cell)
+  {
+    a[cell]++;
+    slots[cur*ncells+cell]++;
+    nfill[cur]++;
+  }
+  void Fill(Int_t x)
+  {
+    count(hchanbin(ax,x));
+  }
+  void Fill(Int_t x,Int_t y)
+  {
+    count(hchanbin(ay,y)*(nx+2)+hchanbin(ax,x));
+  }
+};
+
+HWindow *hwindows;        //windows booked, for hwindowtick()
+
+inline HWindow *hwbook(TH1 *h,Int_t nx,Double_t x0,Double_t x1,Int_t ny,Double_t y0,Double_t y1,
+		       Int_t nslots)
+{
+  HWindow *w=new HWindow;
+  w->h=h;
+  w->nx=nx;
+  w->ny=ny;
+  w->ncells=(nx+2)*(ny ? ny+2 : 1);
+  hchaninit(w->ax,nx,x0,x1);
+  hchaninit(w->ay,ny,y0,y1);
+  w->nslots=nslots<1 ? 1 : nslots;
+  w->cur=0;
+  w->slots=(UInt_t*)halloc((size_t)w->nslots*w->ncells*sizeof(UInt_t));
+  w->nfill=(Long64_t*)calloc(w->nslots,sizeof(Long64_t));
+  w->next=hwindows;
+  hwindows=w;
+  return w;
+}
+
+inline HWindow *hwbook1(const char *name,const char *title,Int_t nx,Double_t x0,Double_t x1,
+			Int_t nslots)
+{
+  TH1I *h=new TH1I(name,title,nx,x0,x1);
+  HWindow *w=hwbook(h,nx,x0,x1,0,0,0,nslots);
+  w->a=h->GetArray();
+  return w;
+}
+
+inline HWindow *hwbook2(const char *name,const char *title,Int_t nx,Double_t x0,Double_t x1,
+			Int_t ny,Double_t y0,Double_t y1,Int_t nslots)
+{
+  TH2I *h=new TH2I(name,title,nx,x0,x1,ny,y0,y1);
+  HWindow *w=hwbook(h,nx,x0,x1,ny,y0,y1,nslots);
+  w->a=h->GetArray();
+  return w;
+}
+
+/* Ends the current interval of window w: its oldest slot is taken off and reused */
+inline void hwtick(HWindow &w)
+{
+  Long64_t entries=0;
+  for(Int_t k=0;k<w.nslots;k++) entries+=w.nfill[k];
+  w.h->SetEntries(entries); //the fills of the interval just ended, with the rest
+  w.cur=(w.cur+1)%w.nslots;
+  if(!w.nfill[w.cur]) return;
+  UInt_t *s=w.slots+(size_t)w.cur*w.ncells;
+  for(Int_t i=0;i<w.ncells;i++) w.a[i]-=s[i];
+  memset(s,0,w.ncells*sizeof(UInt_t));
+  w.h->SetEntries(entries-w.nfill[w.cur]);
+  w.nfill[w.cur]=0;
+}
+
+/* Ends the current interval of every window */
+inline void hwindowtick()
+{
+  for(HWindow *w=hwindows;w;w=w->next) hwtick(*w);
+}
+
+/* Frees the windows' slots; the histograms are left, as the last windows */
+inline void hwindowfree()
+{
+  while(hwindows){
+    HWindow *w=hwindows;
+    hwindows=w->next;
+    free(w->slots);
+    free(w->nfill);
+    delete w;
+  }
+}
+
+#endif
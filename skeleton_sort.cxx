@@ -43,12 +43,18 @@ using namespace std; //used to eliminate deprecated header file error message
 #include "TMath.h"
 #include "TDirectory.h"
 #include <fstream>
+#include "helios_unpack.h"
+#include "helios_scaler.h"
+#include "helios_cuts.h"
+#include "helios_hist.h"
 #define NSCALERS 12
 
 TFile *f; //used to create ROOT file
 TFile *cutfile;
 Float_t totals[NSCALERS];
 Int_t stopped;
+ScalerWriter Scaler; //writes scalers.dat off the sort thread, see helios_scaler.h
+Bool_t DoScalerTree=kTRUE; //<--------write the scaler history to the ROOT file, tree "scalers"
 
 //Structures and Physical Constants
 Float_t pi=4.0*atan(1.0); 
@@ -84,6 +90,21 @@ Float_t slopeT=-18.01; //time dispersion in ns/channel
 		        1, 1, 1, 1, 1, 1};
    		     //19,20,21,22,23,24
 
+//Array Wiring: re-maps raw ADC (5x16) channels to detector (24x3) signals
+Int_t MapDet[5][16]={{ 1, 0, 5, 4, 3, 2, 1, 0, 3, 2, 1, 0, 5, 4, 3, 2},
+		       {11,10, 9, 8, 7, 6, 5, 4, 7, 6,11,10, 9, 8, 7, 6},
+ 		       {15,14,13,12,11,10, 9, 8,17,16,15,12,14,13,16,17},
+//		       {15,14,13,12,11,10, 9, 8,17,16,15,14,13,12,17,16},  //Note difference
+// from straight-cable wiring.
+                       {20,21,22,23,18,19,20,21,12,13,14,15,16,17,18,19},
+                       {-1,-1,-1,-1,-1,-1,-1,-1,22,23,18,19,20,21,22,23}}; //on ADC5, no 0-7
+Int_t MapSig[5][16]={{ 1, 1, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 1, 1, 1, 1},  //0->E, 1->XF, 2->XN
+                       { 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1},
+                       { 0, 0, 0, 0, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 0, 0},
+                       { 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 0, 0},
+		       {-1,-1,-1,-1,-1,-1,-1,-1, 1, 1, 2, 2, 2, 2, 2, 2}};
+Int_t MapSlot[NADC*NCHAN]; //flat (adc,chan)->Data slot table, built by buildmap() in userentry()
+
 //Calibration
 Int_t DoCal[4]={0,0,0,0};
 /*Set Calibration level: 
@@ -157,7 +178,7 @@ TString name;
 //TH2F *hist;
 
 /* 2-D histograms */
-TH2F *hADC[7];
+H2I *hADC[7];
 
 TH2F *hE,*hXN,*hXF,*hT;
 
@@ -168,16 +189,6 @@ TH2F *hEZ;
 TCutG *cTime2D; 
 TCutG *cScat;
 
-/* function to count the number of set bits inTH2F a 16 bit word */
-Int_t cntbit(Int_t word)
-{
-  Int_t nbits=0;
-  for (Int_t ibit=0; ibit<16; ibit++) {
-    if (word & (Int_t) TMath::Power(2,ibit)) {nbits++;}
-  }
-  return nbits;
-}
-
 //Int_t readcuts(Char_t *cfn="time_cuts.root"){
 Int_t readcuts(Char_t *cfn) {
   cutfile=new TFile(cfn);
@@ -189,27 +200,9 @@ Int_t readcuts(Char_t *cfn) {
   return 0;
 }
 
-Bool_t cexists(Char_t *cutname)
-{
-
-   Bool_t returnvalue=kFALSE;
-   if (gROOT->FindObjectClassName(cutname)) returnvalue=kTRUE;
-   return returnvalue;
-}
-
-
-/* function to see if x and y are within the boundries of a TCugG */
-Bool_t checkcutg(Char_t *cutname,Float_t x, Float_t y)
-{
-   Bool_t returnvalue=kFALSE;
-   if (cexists(cutname)) {
-      TCutG *gcut=(TCutG *) gROOT->GetListOfSpecials()->FindObject(cutname);
-      if (gcut->IsInside(x,y)==1) returnvalue=kTRUE;
-      return returnvalue;
-   } else {
-     return returnvalue;
-   }
-}
+//Gates used per hit, resolved by name from the loaded cuts in userentry()
+Gate gTime2D; //cTime2D
+Bool_t RasterGates=kTRUE; //<--------look gates up on a grid of their histogram's bins
 
 
 int readcal(Char_t *calfile)
@@ -422,10 +415,12 @@ int readcal(Char_t *calfile)
  */
 int userentry()
 {
+  buildmap(MapDet,MapSig,MapSlot); //flatten the array re-map matrices once per sort
   sprintf(buffer,"%d_cuts.root",separation);
   // readcuts((Char_t*)(buffer));
 
   //readcuts("time_cuts.root"); //must be called before ROOT file is defined!(?)
+  gateresolve(gTime2D,"cTime2D");
 
   //Open ROOT file
   f = new TFile((deltaZ+".root"), "recreate");
@@ -438,6 +433,7 @@ int userentry()
 /* stopped flag for Elliot's scaler program */
   for (Int_t i=0; i<NSCALERS; i++) totals[i]=0;
   stopped = 1;
+  scopen(Scaler,NSCALERS,totals);
 //Read in calibration constants
   printf("Separation = %d mm\n",separation);
   printf("Physical Constants:\n");  
@@ -518,6 +514,7 @@ int userentry()
   }
 
 Int_t bin1=256;//Sets number of bins on most histograms to conveniently reduce memory load
+  if(RasterGates) gateraster(gTime2D,bin1,minT,maxT,bin1,0,maxE); //E vs. T plane, binned as hET in the other sorts
 
 // 2d histograms
   for(int a=0;a<5;++a){
@@ -525,8 +522,9 @@ Int_t bin1=256;//Sets number of bins on most histograms to conveniently reduce m
     TString title="Raw ADC";
     name+=(a+1);
     title+=(a+1);
-    hADC[a]=new TH2F(name,title,1024,0,4095,16,0,16);
+    hADC[a]=hbook2i(name,title,1024,0,4096,16,0,16);
   }
+  hmaster=hlist; //count bookings, freed by userexit()
  
   hE=new  TH2F("hE","Detector Energy (1-24), ungated",1024,0,maxE,24,1,25);
   hXF=new TH2F("hXF","Detector Position (XF), ungated",1024,0,maxX,24,1,25);
@@ -555,34 +553,9 @@ Int_t bin1=256;//Sets number of bins on most histograms to conveniently reduce m
 
 /* function to deal with scalers, adapted from Elliot's program */
 void scalers(ScarletEvnt &e)
-{// Adapted from Kanter's scaler program
-  unsigned int *p = reinterpret_cast<unsigned int*>(e.body());
-  unsigned int ttotal, tdiff, ithscaler, ithrate;
-    FILE *sf;
-
-    /* On the first sync event after a stop, the following tests for the existence of a file
-     * called scalers.zap.  If it exists, the scaler totals are reset.
-     */
-    if(stopped){
-        struct stat st;
-        stopped=0;
-        if(stat("scalers.zap",&st)==0){
-	  for(Int_t i=0;i<NSCALERS;++i)
-	    totals[i]=0.0;
-        }
-    }
-
-    if((sf=fopen("scalers.dat","w"))==0) return;
-    ttotal=*p++;
-    tdiff=*p++;
-    fprintf(sf,"%u %u\n",ttotal,tdiff);
-    for(int i=0;i<NSCALERS;++i){
-      ithscaler=*p++ & 0x00ffffff;
-      totals[i]+=ithscaler;
-      ithrate=tdiff!=0 ? ithscaler/tdiff : 0;
-      fprintf(sf,"%.0f %u\n",totals[i],ithrate);
-    }
-    fclose(sf);
+{
+  scpush(Scaler,reinterpret_cast<unsigned int*>(e.body()),stopped); //totals, zap check and file by the writer thread
+  stopped=0;
 }
 
 int userdecode(ScarletEvnt &event){
@@ -600,22 +573,7 @@ int userdecode(ScarletEvnt &event){
    * scheme (5x16) and then mapped to an array scheme (24x3).  
    */
   Int_t time;
-  Int_t nhits[5]={0,0,0,0,0};
-  Int_t Chan[5][16];
-  Int_t RawData[5][16];
-  Int_t Data[24][3];
-  Int_t MapDet[5][16]={{ 1, 0, 5, 4, 3, 2, 1, 0, 3, 2, 1, 0, 5, 4, 3, 2},
-		       {11,10, 9, 8, 7, 6, 5, 4, 7, 6,11,10, 9, 8, 7, 6},
- 		       {15,14,13,12,11,10, 9, 8,17,16,15,12,14,13,16,17},
-//		       {15,14,13,12,11,10, 9, 8,17,16,15,14,13,12,17,16},  //Note difference
-// from straight-cable wiring.
-                       {20,21,22,23,18,19,20,21,12,13,14,15,16,17,18,19},
-                       {-1,-1,-1,-1,-1,-1,-1,-1,22,23,18,19,20,21,22,23}}; //on ADC5, no 0-7
-  Int_t MapSig[5][16]={{ 1, 1, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 1, 1, 1, 1},  //0->E, 1->XF, 2->XN
-                       { 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1},
-                       { 0, 0, 0, 0, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 0, 0},
-                       { 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 0, 0},
-		       {-1,-1,-1,-1,-1,-1,-1,-1, 1, 1, 2, 2, 2, 2, 2, 2}};
+  Int_t Data[NDET+1][NSIG]; //row NDET is scratch for unmapped channels
 
   for(Int_t i=0;i<24;i++){
     Data[i][0]=0;
@@ -627,33 +585,7 @@ int userdecode(ScarletEvnt &event){
   dataword=*p1++;
   time=(dataword & 0x00000fff);
    
-  for(Int_t nadc=0;nadc<5;nadc++){ //loop over ADCs 1-5
-    dataword=*p1++;
-    nhits[nadc]=cntbit(dataword); //determines number of hits in ADC 
-                                  //by counting set bits (ones) in hit register
-    for(Int_t i=0;i<nhits[nadc];i++){ //loop over number of ADC hits, if any
-      dataword=*p1++;
-      
-      /*Read in raw ADC data and fill ADC histograms*/
-      Chan[nadc][i]=((dataword & 0x0000f000)>>12);
-      RawData[nadc][i]=(dataword & 0x00000fff);
-      
-      hADC[nadc]->Fill(RawData[nadc][i],Chan[nadc][i]);
-      
-      /*Re-map data from raw (5x16) configuration to detector (24x3) configuration*/
-      if(nadc>-1 && // Tests for sensible ADC and Channel numbers
-	 nadc<5  &&
-	    i>-1 &&
-	    i<16 ){
-        if((MapDet[nadc][Chan[nadc][i]])>-1&& //Tests for sensible values in re-map matrices.
-	   (MapDet[nadc][Chan[nadc][i]])<24&& //Note -1 is excluded.
-	   (MapSig[nadc][Chan[nadc][i]])>-1&&
-	   (MapSig[nadc][Chan[nadc][i]])<3){  //Re-maps "RawData" array into "Data" array
-	  Data[MapDet[nadc][Chan[nadc][i]]][MapSig[nadc][Chan[nadc][i]]]=RawData[nadc][i]; 
-	}
-      }
-    }
- }
+  p1=unpackarray(p1,MapSlot,hADC,Data); //hit pattern and data words for each of ADCs 1-5
 
   //Done unpacking event, filling raw histograms, and remapping data.
   //Filling histograms with (24x3) detector mapping  
@@ -784,8 +716,8 @@ int userdecode(ScarletEvnt &event){
       hXN->Fill(xn,i+1);
       hT->Fill(t,i+1);
       
-      if (checkcutg("cTime2D",t,e)) GoodTime=kTRUE;
-      //      if (checkcutg("cScat",t,e)) GoodScat=kTRUE;
+      if (gateinside(gTime2D,t,e)) GoodTime=kTRUE;
+      //      if (gateinside(gScat,t,e)) GoodScat=kTRUE;
       
          if((goodESum&&goodEDiff)||DoCut[4]==0||DoCal[1]<2){
 	   //  if((goodEDiff)||DoCut[4]==0||DoCal[1]<2){
@@ -828,6 +760,7 @@ int userfunc(const struct ScarletEvntHdr* h)
     for(Int_t i=0;i<24;i++)CountsSum+=Counts[i];
     printf("Run sorted.  Total counts: %1.0f\n",CountsSum);
     //for(Int_t i=0;i<24;i++) printf("Detector %2d: Counts = %10d (%5.2f%%)\n",i+1,Counts[i],(Float_t)((Counts[i]/CountsSum)*100));
+    unpackreport(); //channel-field cross-check from unpackarray()
     break;
   }
   return 0;
@@ -841,11 +774,16 @@ int userfunc(const struct ScarletEvntHdr* h)
  */
 int userexit()
 {
+  scclose(Scaler);
   cout<<"Exiting sort..."<<endl;
   //  f->ls();
+  hdensify(); //the entries of the count spectra, see helios_hist.h
+  f->cd();
+  if(DoScalerTree) scexport(Scaler);
   f->Write();
   f->Close();
   delete f;
+  hfree(); //the booking records, see helios_hist.h
   printf("\a"); //"Default Beep" at sort exit.
   return 0;
 }